@@ -21,7 +21,12 @@
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
 #include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
 #include "llvm/IR/Mangler.h"
+#include "llvm/Object/ObjectFile.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <map>
 
 namespace llvm {
 namespace orc {
@@ -31,30 +36,61 @@ public:
   typedef ObjectLinkingLayer<> ObjLayerT;
   typedef IRCompileLayer<ObjLayerT> CompileLayerT;
   typedef CompileLayerT::ModuleSetHandleT ModuleHandleT;
+  typedef object::OwningBinary<object::ObjectFile> ObjectT;
 
   KaleidoscopeJIT()
-      : TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
+      : TM(selectHostTarget()), DL(TM->createDataLayout()),
         CompileLayer(ObjectLayer, SimpleCompiler(*TM)) {
     llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
   }
 
   TargetMachine &getTargetMachine() { return *TM; }
 
+  /// selectHostTarget - Target the CPU we are running on, with all of its
+  /// features, so that the vectorizers can use its full vector width.
+  static TargetMachine *selectHostTarget() {
+    std::vector<std::string> Attrs;
+    StringMap<bool> Features;
+    if (sys::getHostCPUFeatures(Features))
+      for (auto &F : Features)
+        Attrs.push_back((F.second ? "+" : "-") + F.first().str());
+    return EngineBuilder()
+        .setMCPU(sys::getHostCPUName())
+        .setMAttrs(Attrs)
+        .selectTarget();
+  }
+
   ModuleHandleT addModule(std::unique_ptr<Module> M) {
     // We need a memory manager to allocate memory and resolve symbols for this
     // new module. Create one that resolves symbols by looking back into the
     // JIT.
-    auto Resolver = createLambdaResolver(
-        [&](const std::string &Name) {
-          if (auto Sym = findMangledSymbol(Name))
-            return RuntimeDyld::SymbolInfo(Sym.getAddress(), Sym.getFlags());
-          return RuntimeDyld::SymbolInfo(nullptr);
-        },
-        [](const std::string &S) { return nullptr; });
     auto H = CompileLayer.addModuleSet(singletonSet(std::move(M)),
                                        make_unique<SectionMemoryManager>(),
-                                       std::move(Resolver));
+                                       createResolver());
+
+    ModuleHandles.push_back(H);
+    return H;
+  }
 
+  /// Compile M to a relocatable object without adding it to this JIT, e.g. to
+  /// ship it to another process that links it with addObject.
+  ObjectT compileModule(Module &M) { return SimpleCompiler(*TM)(M); }
+
+  /// Link an object produced by compileModule (possibly in another process).
+  /// The returned handle can be passed to removeModule.
+  ModuleHandleT addObject(std::unique_ptr<MemoryBuffer> Buffer) {
+    auto Obj = object::ObjectFile::createObjectFile(Buffer->getMemBufferRef());
+    if (!Obj)
+      report_fatal_error("KaleidoscopeJIT: not a valid object file");
+
+    std::vector<object::ObjectFile *> Set;
+    Set.push_back(Obj->get());
+    auto H = ObjectLayer.addObjectSet(Set, make_unique<SectionMemoryManager>(),
+                                      createResolver());
+
+    // Keep the object alive for as long as it is linked.
+    Objects.push_back(std::make_pair(
+        H, ObjectT(std::move(*Obj), std::move(Buffer))));
     ModuleHandles.push_back(H);
     return H;
   }
@@ -63,14 +99,40 @@ public:
     ModuleHandles.erase(
         std::find(ModuleHandles.begin(), ModuleHandles.end(), H));
     CompileLayer.removeModuleSet(H);
+    for (auto I = Objects.begin(), E = Objects.end(); I != E; ++I)
+      if (I->first == H) {
+        Objects.erase(I);
+        break;
+      }
   }
 
   JITSymbol findSymbol(const std::string Name) {
     return findMangledSymbol(mangle(Name));
   }
 
+  /// addAlias - Resolve Name to the address Target has now, even if Target is
+  /// redefined later.  A module added later that defines Name itself takes
+  /// precedence.  Returns false if Target is not defined.
+  bool addAlias(const std::string &Name, const std::string &Target) {
+    JITSymbol Sym = findSymbol(Target);
+    if (!Sym)
+      return false;
+    Aliases[mangle(Name)] = std::make_pair(Sym.getAddress(), Sym.getFlags());
+    return true;
+  }
+
 private:
 
+  std::unique_ptr<RuntimeDyld::SymbolResolver> createResolver() {
+    return createLambdaResolver(
+        [&](const std::string &Name) {
+          if (auto Sym = findMangledSymbol(Name))
+            return RuntimeDyld::SymbolInfo(Sym.getAddress(), Sym.getFlags());
+          return RuntimeDyld::SymbolInfo(nullptr);
+        },
+        [](const std::string &S) { return nullptr; });
+  }
+
   std::string mangle(const std::string &Name) {
     std::string MangledName;
     {
@@ -94,6 +156,10 @@ private:
       if (auto Sym = CompileLayer.findSymbolIn(H, Name, true))
         return Sym;
 
+    auto Alias = Aliases.find(Name);
+    if (Alias != Aliases.end())
+      return JITSymbol(Alias->second.first, Alias->second.second);
+
     // If we can't find the symbol in the JIT, try looking in the host process.
     if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name))
       return JITSymbol(SymAddr, JITSymbolFlags::Exported);
@@ -106,6 +172,8 @@ private:
   ObjLayerT ObjectLayer;
   CompileLayerT CompileLayer;
   std::vector<ModuleHandleT> ModuleHandles;
+  std::vector<std::pair<ModuleHandleT, ObjectT>> Objects;
+  std::map<std::string, std::pair<TargetAddress, JITSymbolFlags>> Aliases;
 };
 
 } // End namespace orc.
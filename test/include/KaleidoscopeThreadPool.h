@@ -0,0 +1,226 @@
+//===- KaleidoscopeThreadPool.h - Work-stealing pool for parfor -*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// A work-stealing thread pool that runs the chunks of parallel loops, and
+// single tasks such as top-level expressions.  Ranges of chunks are split in
+// halves on demand: a thread keeps working on one half and leaves the other in
+// its queue, where an idle thread can steal it.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_THREADPOOL_H
+#define KALEIDOSCOPE_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace llvm {
+namespace orc {
+
+/// KaleidoscopeThreadPool - NumThreads - 1 worker threads, plus whichever
+/// thread calls parallelFor, which works on its own loop until it is done.
+///
+/// Every worker owns a queue; threads outside the pool share one more.  A
+/// thread takes the newest range from its own queue and, when that is empty,
+/// steals the oldest (and so largest) range from another.  Loops may nest: a
+/// thread waiting for an inner loop runs whatever work it can find meanwhile.
+class KaleidoscopeThreadPool {
+public:
+  typedef std::function<void(size_t)> ChunkFnT;
+  typedef std::function<void()> TaskFnT;
+
+  explicit KaleidoscopeThreadPool(unsigned NumThreads)
+      : Queues(NumThreads ? NumThreads : 1), Queued(0) {
+    for (unsigned I = 0; I + 1 < Queues.size(); ++I)
+      Workers.emplace_back([this, I] { workerMain(I); });
+  }
+
+  ~KaleidoscopeThreadPool() {
+    {
+      std::lock_guard<std::mutex> Guard(SleepLock);
+      Stopping = true;
+    }
+    Wake.notify_all();
+    for (auto &W : Workers)
+      W.join();
+  }
+
+  /// size - The number of threads that run loops, the caller included.
+  unsigned size() const { return Queues.size(); }
+
+  /// parallelFor - Call Fn(I) for every I in [0, N), on any of the threads,
+  /// and return once all calls have returned.
+  void parallelFor(size_t N, const ChunkFnT &Fn) {
+    if (N == 0)
+      return;
+    if (N == 1 || Workers.empty()) {
+      for (size_t I = 0; I != N; ++I)
+        Fn(I);
+      return;
+    }
+
+    Loop L(Fn, N);
+    run(Range{0, N, &L});
+    // Help out until the chunks that other threads took have finished too.
+    while (L.Remaining.load() != 0) {
+      Range R;
+      if (take(R))
+        run(R);
+      else
+        std::this_thread::yield();
+    }
+  }
+
+  /// async - Run Fn on one of the workers (on this thread if there are none)
+  /// and return at once; the future is ready when Fn has returned.
+  std::future<void> async(TaskFnT Fn) {
+    Loop *L = new Loop([Fn](size_t) { Fn(); }, 1);
+    L->Detached = true;
+    std::future<void> Done = L->Done.get_future();
+    if (Workers.empty())
+      run(Range{0, 1, L});
+    else
+      push(Range{0, 1, L});
+    return Done;
+  }
+
+private:
+  /// Loop - A parallelFor in progress, or a detached one-chunk loop for async
+  /// that the thread finishing it deletes.
+  struct Loop {
+    Loop(ChunkFnT Fn, size_t N) : Fn(std::move(Fn)), Remaining(N) {}
+    ChunkFnT Fn;
+    std::atomic<size_t> Remaining;
+    bool Detached = false;
+    std::promise<void> Done;
+  };
+
+  /// Range - The chunks [Begin, End) of a loop.
+  struct Range {
+    size_t Begin, End;
+    Loop *L;
+  };
+
+  struct Queue {
+    std::mutex Lock;
+    std::deque<Range> Ranges;
+  };
+
+  /// ownQueue - The queue this thread pushes to and pops from first: its own
+  /// for a worker, the shared one for anyone else.
+  Queue &ownQueue() {
+    WorkerId &W = currentWorker();
+    unsigned I = W.Pool == this ? W.Index : Queues.size() - 1;
+    return Queues[I];
+  }
+
+  void push(const Range &R) {
+    Queue &Q = ownQueue();
+    {
+      std::lock_guard<std::mutex> Guard(Q.Lock);
+      Q.Ranges.push_back(R);
+    }
+    ++Queued;
+    // Taking the lock orders this against a worker deciding to sleep.
+    { std::lock_guard<std::mutex> Guard(SleepLock); }
+    Wake.notify_one();
+  }
+
+  /// take - Pop the newest range of our own queue, or steal the oldest one of
+  /// another.
+  bool take(Range &R) {
+    Queue &Own = ownQueue();
+    {
+      std::lock_guard<std::mutex> Guard(Own.Lock);
+      if (!Own.Ranges.empty()) {
+        R = Own.Ranges.back();
+        Own.Ranges.pop_back();
+        --Queued;
+        return true;
+      }
+    }
+    unsigned Start = NextVictim++;
+    for (unsigned N = 0; N != Queues.size(); ++N) {
+      Queue &Q = Queues[(Start + N) % Queues.size()];
+      if (&Q == &Own)
+        continue;
+      std::lock_guard<std::mutex> Guard(Q.Lock);
+      if (!Q.Ranges.empty()) {
+        R = Q.Ranges.front();
+        Q.Ranges.pop_front();
+        --Queued;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// run - Work through R, leaving the upper half of what remains to be
+  /// stolen until a single chunk is left.
+  void run(Range R) {
+    while (R.End - R.Begin > 1) {
+      size_t Mid = R.Begin + (R.End - R.Begin) / 2;
+      push(Range{Mid, R.End, R.L});
+      R.End = Mid;
+    }
+    R.L->Fn(R.Begin);
+    // Once Remaining drops to 0 the owner of a parallelFor loop may free it.
+    Loop *L = R.L;
+    bool Detached = L->Detached;
+    if (--L->Remaining == 0 && Detached) {
+      L->Done.set_value();
+      delete L;
+    }
+  }
+
+  void workerMain(unsigned I) {
+    currentWorker() = WorkerId{this, I};
+    while (true) {
+      Range R;
+      if (take(R)) {
+        run(R);
+        continue;
+      }
+      std::unique_lock<std::mutex> Guard(SleepLock);
+      Wake.wait(Guard, [this] { return Stopping || Queued.load() > 0; });
+      if (Stopping)
+        return;
+    }
+  }
+
+  struct WorkerId {
+    const KaleidoscopeThreadPool *Pool;
+    unsigned Index;
+  };
+  static WorkerId &currentWorker() {
+    static thread_local WorkerId W = {nullptr, 0};
+    return W;
+  }
+
+  std::vector<Queue> Queues;
+  std::vector<std::thread> Workers;
+  std::atomic<int> Queued;
+  std::atomic<unsigned> NextVictim{0};
+  std::mutex SleepLock;
+  std::condition_variable Wake;
+  bool Stopping = false;
+};
+
+} // End namespace orc.
+} // End namespace llvm
+
+#endif // KALEIDOSCOPE_THREADPOOL_H
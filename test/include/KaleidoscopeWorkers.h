@@ -0,0 +1,359 @@
+//===----- KaleidoscopeWorkers.h - Out-of-process execution -----*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// A pool of forked worker processes that link and run objects compiled by the
+// driver, so that a crash or runaway loop in JIT'd code only takes down (and
+// respawns) one worker instead of the whole host.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_WORKERS_H
+#define KALEIDOSCOPE_WORKERS_H
+
+#include "KaleidoscopeJIT.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace llvm {
+namespace orc {
+
+/// Outcome of running one object's entry point in a worker.
+struct WorkerResult {
+  bool Ok;
+  double Value;
+  std::string Error;
+};
+
+/// KaleidoscopeWorkerPool - Forks NumWorkers processes, each with a private
+/// KaleidoscopeJIT that links objects sent over a pipe.
+///
+/// Definitions are broadcast to every worker with addObject and remembered so
+/// that a respawned worker can be brought back to the same state.  A busy
+/// worker may be stuck in a runaway expression and not reading its commands,
+/// so it is only sent the definitions it missed before its next expression.
+/// Expressions
+/// are sent with runObject to one idle worker at a time, so up to NumWorkers
+/// run in parallel; their results are reported through the callback strictly in
+/// submission order.
+class KaleidoscopeWorkerPool {
+public:
+  typedef std::function<void(const WorkerResult &)> ResultCallbackT;
+
+  KaleidoscopeWorkerPool(unsigned NumWorkers, unsigned TimeoutMS,
+                         ResultCallbackT OnResult)
+      : Workers(NumWorkers), TimeoutMS(TimeoutMS),
+        OnResult(std::move(OnResult)) {
+    // A write to a worker that has just died must fail with EPIPE rather than
+    // kill the driver.
+    signal(SIGPIPE, SIG_IGN);
+    for (unsigned I = 0; I != Workers.size(); ++I)
+      spawn(I);
+  }
+
+  ~KaleidoscopeWorkerPool() {
+    drain();
+    // Workers exit when they see EOF on their command pipe.
+    for (auto &W : Workers) {
+      close(W.CommandFD);
+      close(W.ReplyFD);
+      waitpid(W.Pid, nullptr, 0);
+    }
+  }
+
+  /// Link Obj into every worker, now (or, for a busy one, before its next
+  /// expression) and after any future respawn.
+  void addObject(StringRef Obj) {
+    Objects.push_back(Obj.str());
+    for (unsigned I = 0; I != Workers.size(); ++I)
+      if (!Workers[I].Busy && !sendMissedObjects(I))
+        respawn(I); // Replays Objects, including this one.
+  }
+
+  /// Link Obj into one idle worker, call its Symbol (a double() function) and
+  /// unlink it again.  If every worker is busy this first waits for the oldest
+  /// outstanding expression.
+  void runObject(StringRef Obj, StringRef Symbol) {
+    unsigned I;
+    while (!findIdleWorker(I))
+      completeOldest();
+
+    if (!sendMissedObjects(I) || !send(I, MK_RunObject, Symbol, Obj)) {
+      respawn(I);
+      if (!send(I, MK_RunObject, Symbol, Obj)) {
+        OnResult(WorkerResult{false, 0, "could not reach worker"});
+        return;
+      }
+    }
+
+    Workers[I].Busy = true;
+    Job J;
+    J.WorkerIdx = I;
+    J.Deadline = Clock::now() + std::chrono::milliseconds(TimeoutMS);
+    Pending.push_back(J);
+  }
+
+  /// Wait for every outstanding expression and report its result.
+  void drain() {
+    while (!Pending.empty())
+      completeOldest();
+  }
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  enum MessageKind : uint32_t { MK_AddObject = 1, MK_RunObject = 2 };
+
+  struct MessageHeader {
+    uint32_t Kind;
+    uint32_t SymbolSize;
+    uint64_t ObjectSize;
+  };
+
+  struct ReplyMessage {
+    uint32_t Ok;
+    double Value;
+  };
+
+  struct Worker {
+    pid_t Pid = -1;
+    int CommandFD = -1;
+    int ReplyFD = -1;
+    bool Busy = false;
+    size_t NumObjects = 0; // How many of Objects it has been sent.
+  };
+
+  struct Job {
+    unsigned WorkerIdx;
+    Clock::time_point Deadline;
+  };
+
+  static bool writeAll(int FD, const void *Data, size_t Size) {
+    const char *P = static_cast<const char *>(Data);
+    while (Size) {
+      ssize_t N = write(FD, P, Size);
+      if (N < 0 && errno == EINTR)
+        continue;
+      if (N <= 0)
+        return false;
+      P += N;
+      Size -= N;
+    }
+    return true;
+  }
+
+  static bool readAll(int FD, void *Data, size_t Size) {
+    char *P = static_cast<char *>(Data);
+    while (Size) {
+      ssize_t N = read(FD, P, Size);
+      if (N < 0 && errno == EINTR)
+        continue;
+      if (N <= 0)
+        return false;
+      P += N;
+      Size -= N;
+    }
+    return true;
+  }
+
+  bool send(unsigned I, MessageKind Kind, StringRef Symbol, StringRef Obj) {
+    MessageHeader H;
+    H.Kind = Kind;
+    H.SymbolSize = Symbol.size();
+    H.ObjectSize = Obj.size();
+    int FD = Workers[I].CommandFD;
+    return writeAll(FD, &H, sizeof(H)) &&
+           writeAll(FD, Symbol.data(), Symbol.size()) &&
+           writeAll(FD, Obj.data(), Obj.size());
+  }
+
+  /// Send worker I the objects added since it was last idle.
+  bool sendMissedObjects(unsigned I) {
+    Worker &W = Workers[I];
+    for (; W.NumObjects != Objects.size(); ++W.NumObjects)
+      if (!send(I, MK_AddObject, "", Objects[W.NumObjects]))
+        return false;
+    return true;
+  }
+
+  bool findIdleWorker(unsigned &I) {
+    for (unsigned N = 0; N != Workers.size(); ++N) {
+      unsigned Candidate = (NextWorker + N) % Workers.size();
+      if (!Workers[Candidate].Busy) {
+        I = Candidate;
+        NextWorker = Candidate + 1;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// Wait for the oldest outstanding expression and report it.  A worker that
+  /// dies, overruns the timeout or cannot be polled is killed and respawned.
+  void completeOldest() {
+    Job J = Pending.front();
+    Pending.pop_front();
+    Worker &W = Workers[J.WorkerIdx];
+
+    pollfd PFD;
+    PFD.fd = W.ReplyFD;
+    PFD.events = POLLIN;
+    int Ready;
+    do {
+      int Wait = -1;
+      if (TimeoutMS) {
+        auto Left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            J.Deadline - Clock::now());
+        Wait = Left.count() > 0 ? (int)Left.count() : 0;
+      }
+      Ready = poll(&PFD, 1, Wait);
+    } while (Ready < 0 && errno == EINTR);
+
+    W.Busy = false;
+    ReplyMessage R;
+    if (Ready < 0) {
+      // Reading or reaping a worker that cannot be polled could block for
+      // good, so give up on it like on a crash.
+      std::string Why = std::string("cannot wait for worker: ") +
+                        strerror(errno);
+      respawn(J.WorkerIdx);
+      OnResult(WorkerResult{false, 0, Why});
+      return;
+    }
+    if (Ready == 0) {
+      kill(W.Pid, SIGKILL);
+      respawn(J.WorkerIdx);
+      OnResult(WorkerResult{false, 0, "timed out after " +
+                                          std::to_string(TimeoutMS) + " ms"});
+      return;
+    }
+    if (!readAll(W.ReplyFD, &R, sizeof(R))) {
+      int Status = 0;
+      waitpid(W.Pid, &Status, 0);
+      W.Pid = -1;
+      std::string Why = "worker exited";
+      if (WIFSIGNALED(Status))
+        Why = std::string("worker crashed: ") + strsignal(WTERMSIG(Status));
+      respawn(J.WorkerIdx);
+      OnResult(WorkerResult{false, 0, Why});
+      return;
+    }
+    if (!R.Ok) {
+      OnResult(WorkerResult{false, 0, "entry point not found in worker"});
+      return;
+    }
+    OnResult(WorkerResult{true, R.Value, ""});
+  }
+
+  void respawn(unsigned I) {
+    Worker &W = Workers[I];
+    close(W.CommandFD);
+    close(W.ReplyFD);
+    if (W.Pid > 0) {
+      kill(W.Pid, SIGKILL);
+      waitpid(W.Pid, nullptr, 0);
+    }
+    W = Worker();
+    spawn(I);
+  }
+
+  void spawn(unsigned I) {
+    int Command[2], Reply[2];
+    if (pipe(Command) || pipe(Reply))
+      report_fatal_error("KaleidoscopeWorkerPool: pipe failed");
+
+    // Don't let the child inherit (and later re-flush) buffered output.
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t Pid = fork();
+    if (Pid < 0)
+      report_fatal_error("KaleidoscopeWorkerPool: fork failed");
+
+    if (Pid == 0) {
+      // Drop every other worker's pipes so their EOFs stay meaningful.
+      for (auto &Other : Workers) {
+        if (Other.CommandFD >= 0)
+          close(Other.CommandFD);
+        if (Other.ReplyFD >= 0)
+          close(Other.ReplyFD);
+      }
+      close(Command[1]);
+      close(Reply[0]);
+      workerMain(Command[0], Reply[1]);
+      _exit(0);
+    }
+
+    close(Command[0]);
+    close(Reply[1]);
+    Workers[I].Pid = Pid;
+    Workers[I].CommandFD = Command[1];
+    Workers[I].ReplyFD = Reply[0];
+    Workers[I].Busy = false;
+
+    if (!sendMissedObjects(I))
+      report_fatal_error("KaleidoscopeWorkerPool: new worker died at once");
+  }
+
+  /// The body of a worker process: link whatever arrives on In, run the
+  /// expressions and write their results to Out.
+  static void workerMain(int In, int Out) {
+    KaleidoscopeJIT JIT;
+    while (true) {
+      MessageHeader H;
+      if (!readAll(In, &H, sizeof(H)))
+        return;
+      std::string Symbol(H.SymbolSize, '\0');
+      std::unique_ptr<MemoryBuffer> Buffer =
+          MemoryBuffer::getNewUninitMemBuffer(H.ObjectSize, "worker-object");
+      if (!readAll(In, &Symbol[0], H.SymbolSize) ||
+          !readAll(In, const_cast<char *>(Buffer->getBufferStart()),
+                   H.ObjectSize))
+        return;
+
+      auto Handle = JIT.addObject(std::move(Buffer));
+      if (H.Kind == MK_AddObject)
+        continue;
+
+      ReplyMessage R;
+      R.Ok = 0;
+      R.Value = 0;
+      if (auto Sym = JIT.findSymbol(Symbol)) {
+        double (*FP)() = (double (*)())(intptr_t)Sym.getAddress();
+        R.Value = FP();
+        R.Ok = 1;
+      }
+      JIT.removeModule(Handle);
+      fflush(stderr);
+      if (!writeAll(Out, &R, sizeof(R)))
+        return;
+    }
+  }
+
+  std::vector<Worker> Workers;
+  std::deque<Job> Pending;
+  std::vector<std::string> Objects;
+  unsigned TimeoutMS;
+  unsigned NextWorker = 0;
+  ResultCallbackT OnResult;
+};
+
+} // End namespace orc.
+} // End namespace llvm
+
+#endif // KALEIDOSCOPE_WORKERS_H
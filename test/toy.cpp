@@ -1,22 +1,270 @@
+#include "llvm/ADT/Optional.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/Triple.h"
 #include "llvm/Analysis/Passes.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Host.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Vectorize.h"
+#include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <list>
 #include <map>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "./include/KaleidoscopeJIT.h"
+#include "./include/KaleidoscopeThreadPool.h"
+#include "./include/KaleidoscopeWorkers.h"
 
 using namespace llvm;
 using namespace llvm::orc;
 
+//===----------------------------------------------------------------------===//
+// Command line options
+//===----------------------------------------------------------------------===//
+
+static cl::opt<bool>
+    EmitMap("emit-map",
+            cl::desc("Emit a vectorized NAME__map(x..., out, n) entry point "
+                     "next to every function definition"));
+
+static cl::opt<unsigned>
+    BenchMap("bench-map",
+             cl::desc("Time each NAME__map entry point against a scalar call "
+                      "loop over <N> elements (implies -emit-map)"),
+             cl::value_desc("N"), cl::init(0));
+
+static cl::opt<unsigned> BenchSessions(
+    "bench-sessions",
+    cl::desc("Run the script on standard input in 1, 2, 4, ... <N> concurrent "
+             "sessions and report the throughput scaling"),
+    cl::value_desc("N"), cl::init(0));
+
+static cl::opt<unsigned> BenchScopes(
+    "bench-scopes",
+    cl::desc("Time the codegen of <N> generated definitions that nest many "
+             "shadowing var bindings, and report the throughput"),
+    cl::value_desc("N"), cl::init(0));
+
+static cl::opt<unsigned>
+    NumWorkers("workers",
+               cl::desc("Compile in this process but run top-level "
+                        "expressions in a pool of <N> worker processes"),
+               cl::value_desc("N"), cl::init(0));
+
+static cl::opt<unsigned> WorkerTimeout(
+    "worker-timeout",
+    cl::desc("Kill and respawn a worker whose expression runs longer than "
+             "<ms> milliseconds (0 waits forever)"),
+    cl::value_desc("ms"), cl::init(10000));
+
+static cl::opt<bool>
+    PGO("pgo", cl::desc("Instrument definitions and recompile hot ones in the "
+                        "background using the collected profile"));
+
+static cl::opt<unsigned>
+    PGOHotCalls("pgo-hot-calls",
+                cl::desc("Calls after which a definition (or call site) is "
+                         "considered hot"),
+                cl::value_desc("N"), cl::init(1000));
+
+static cl::opt<bool> TailCalls(
+    "tail-calls",
+    cl::desc("Turn tail recursion into loops, and accumulator recursion in "
+             "fast code"),
+    cl::init(true));
+
+static cl::opt<bool> Memoize(
+    "memoize",
+    cl::desc("Memoize every pure definition, not just those marked 'memo'"));
+
+static cl::opt<unsigned> MemoSize(
+    "memo-size",
+    cl::desc("Entries in the cache of each memoized definition, rounded up to "
+             "a power of two"),
+    cl::value_desc("N"), cl::init(4096));
+
+static cl::opt<bool> MemoStats(
+    "memo-stats",
+    cl::desc("Count calls and cache hits of memoized definitions and report "
+             "the hit rates at exit"));
+
+static cl::opt<unsigned> ConstEvalSteps(
+    "const-eval-steps",
+    cl::desc("Evaluate calls of pure functions on constant arguments at "
+             "compile time if that takes at most this many steps (0 disables)"),
+    cl::value_desc("N"), cl::init(1000000));
+
+static cl::opt<unsigned> InlineLimit(
+    "inline-limit",
+    cl::desc("Inline definitions of at most this many instructions into the "
+             "modules that call them (0 disables)"),
+    cl::value_desc("N"), cl::init(32));
+
+static cl::list<std::string> BindFiles(
+    "bind",
+    cl::desc("Map a file of raw doubles as the host array NAME, without copying "
+             "(private mapping: stores are not written back)"),
+    cl::value_desc("NAME=PATH"));
+
+static cl::list<std::string> NewArrays(
+    "array", cl::desc("Create the host array NAME of N zeroed doubles"),
+    cl::value_desc("NAME=N"));
+
+static cl::opt<unsigned> PGOMaxSpecializations(
+    "pgo-max-specializations",
+    cl::desc("Most constant-argument specializations kept alive at once; "
+             "beyond that the least called one is evicted"),
+    cl::value_desc("N"), cl::init(8));
+
+static cl::opt<bool> Vectorize(
+    "vectorize",
+    cl::desc("Run the loop and SLP vectorizers on every definition, for the "
+             "host CPU"),
+    cl::init(true));
+
+static cl::opt<bool> VectorizeRemarks(
+    "vectorize-remarks",
+    cl::desc("Report which loops were vectorized, and why the others were "
+             "not"));
+
+static cl::opt<bool> MathIntrinsics(
+    "math-intrinsics",
+    cl::desc("Compile calls to extern libm functions that have an LLVM "
+             "intrinsic (sin, exp, sqrt, pow, floor, ...) as the intrinsic"),
+    cl::init(true));
+
+static cl::opt<bool> Libmvec(
+    "libmvec",
+    cl::desc("Let the vectorizers call glibc's vector math library (x86-64 "
+             "Linux)"),
+    cl::init(true));
+
+static cl::opt<bool> Float32(
+    "float32",
+    cl::desc("Compute in 32-bit floats: definitions take and return floats, "
+             "externs bind to the float variants of C functions (sinf, "
+             "printdf, ...) and host arrays hold floats"));
+
+/// FPMode - How freely floating point arithmetic may be rearranged.
+enum FPMode { FP_Strict, FP_Contract, FP_Fast };
+
+static cl::opt<FPMode> DefaultFPMode(
+    "fp-mode",
+    cl::desc("Floating point mode of definitions that do not choose their own"),
+    cl::values(clEnumValN(FP_Strict, "strict",
+                          "IEEE arithmetic, exactly as written"),
+               clEnumValN(FP_Contract, "contract",
+                          "also fuse a * b + c into one FMA"),
+               clEnumValN(FP_Fast, "fast",
+                          "all fast-math flags: reassociate, and assume no "
+                          "NaNs, infinities or signed zeros"),
+               clEnumValEnd),
+    cl::init(FP_Strict));
+
+static cl::opt<bool> FastReductions(
+    "fast-reductions",
+    cl::desc("Let sum and dot add their elements in any order, so they can "
+             "be computed in vector registers with several accumulators"));
+
+static cl::opt<unsigned> ParforThreads(
+    "parfor-threads",
+    cl::desc("Threads that run parfor loops, the one that started the loop "
+             "included (0: one per core)"),
+    cl::value_desc("N"), cl::init(0));
+
+static cl::opt<bool> AsyncExprs(
+    "async-exprs",
+    cl::desc("Run top-level expressions on the parfor thread pool while later "
+             "items are compiled, writing out what each prints in source "
+             "order"));
+
+static cl::opt<bool> Stream(
+    "stream",
+    cl::desc("Non-interactive pipelined driver: parse, compile and run on "
+             "three threads joined by bounded queues, with no prompt or IR "
+             "dump"));
+
+static cl::opt<unsigned> StreamDepth(
+    "stream-depth",
+    cl::desc("Items each -stream stage may run ahead of the next"),
+    cl::value_desc("N"), cl::init(64));
+
+static cl::opt<bool> StreamStats(
+    "stream-stats",
+    cl::desc("With -stream, report how long each stage was busy"));
+
+static cl::opt<bool>
+    Simplify("simplify", cl::init(true),
+             cl::desc("Fold constants and algebraic identities in the AST "
+                      "before emitting IR"));
+
+static cl::opt<bool> SimplifyStats(
+    "simplify-stats",
+    cl::desc("Report the rewrites of -simplify and the IR instructions "
+             "emitted and left after optimization, at exit"));
+
+static cl::opt<bool> DeclStats(
+    "decl-stats",
+    cl::desc("Report how many prototypes were registered and how many "
+             "declarations were emitted into modules, at exit"));
+
+static cl::opt<bool>
+    Dedup("dedup", cl::init(true),
+          cl::desc("Compile structurally identical definitions once and "
+                   "bind the later names to the first body"));
+
+static cl::opt<bool> DedupStats(
+    "dedup-stats",
+    cl::desc("Report how many definitions -dedup aliased and the compile "
+             "time and code it saved, at exit"));
+
+static cl::opt<std::string> SaveSession(
+    "save-session",
+    cl::desc("At exit, write the compiled definitions, prototypes and "
+             "operators of the session to <path>"),
+    cl::value_desc("path"));
+
+static cl::opt<std::string> LoadSession(
+    "load-session",
+    cl::desc("Start from a session written by -save-session, linking its "
+             "compiled code instead of compiling it again"),
+    cl::value_desc("path"));
+
 //===----------------------------------------------------------------------===//
 // Lexer
 //===----------------------------------------------------------------------===//
@@ -46,23 +294,44 @@ enum Token {
   tok_unary = -12,
 
   // var definition
-  tok_var = -13
+  tok_var = -13,
+
+  // logical operators
+  tok_and = -14,
+  tok_or = -15
 };
 
-static std::string IdentifierStr; // Filled in if tok_identifier
-static double NumVal;             // Filled in if tok_number
+// All lexer, parser and codegen state below is thread_local: every thread is
+// its own session (see KaleidoscopeSession), with its own input, operator
+// table, LLVMContext and JIT.
+static thread_local std::string IdentifierStr; // Filled in if tok_identifier
+static thread_local double NumVal;             // Filled in if tok_number
+
+/// SessionInput - If set, the lexer reads this buffer instead of standard
+/// input.  Sessions point it at their own source text.
+static thread_local const std::string *SessionInput = nullptr;
+static thread_local size_t SessionInputPos = 0;
+
+/// readChar - Return the next character of this session's input.
+static int readChar() {
+  if (!SessionInput)
+    return getchar();
+  if (SessionInputPos == SessionInput->size())
+    return EOF;
+  return (unsigned char)(*SessionInput)[SessionInputPos++];
+}
 
 /// gettok - Return the next token from standard input.
 static int gettok() {
-  static int LastChar = ' ';
+  static thread_local int LastChar = ' ';
 
   // Skip any whitespace.
   while (isspace(LastChar))
-    LastChar = getchar();
+    LastChar = readChar();
 
   if (isalpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
     IdentifierStr = LastChar;
-    while (isalnum((LastChar = getchar())))
+    while (isalnum((LastChar = readChar())))
       IdentifierStr += LastChar;
 
     if (IdentifierStr == "def")
@@ -92,7 +361,7 @@ static int gettok() {
     std::string NumStr;
     do {
       NumStr += LastChar;
-      LastChar = getchar();
+      LastChar = readChar();
     } while (isdigit(LastChar) || LastChar == '.');
 
     NumVal = strtod(NumStr.c_str(), nullptr);
@@ -102,7 +371,7 @@ static int gettok() {
   if (LastChar == '#') {
     // Comment until end of line.
     do
-      LastChar = getchar();
+      LastChar = readChar();
     while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
     if (LastChar != EOF)
@@ -113,21 +382,110 @@ static int gettok() {
   if (LastChar == EOF)
     return tok_eof;
 
-  // Otherwise, just return the character as its ascii value.
+  // Otherwise, just return the character as its ascii value; "&&" and "||"
+  // are the built-in logical operators.
   int ThisChar = LastChar;
-  LastChar = getchar();
+  LastChar = readChar();
+  if ((ThisChar == '&' || ThisChar == '|') && LastChar == ThisChar) {
+    LastChar = readChar();
+    return ThisChar == '&' ? tok_and : tok_or;
+  }
   return ThisChar;
 }
 
+//===----------------------------------------------------------------------===//
+// Symbols
+//===----------------------------------------------------------------------===//
+
+/// SymbolId - A variable name, interned by the parser so that codegen can look
+/// variables up without hashing strings.  The table is shared by all sessions,
+/// since the PGO reoptimizer compiles ASTs parsed on another thread; each
+/// thread caches what it has looked up so that it only takes the lock for
+/// names and ids it has not seen before.
+typedef unsigned SymbolId;
+
+static std::mutex SymbolLock;
+static StringMap<SymbolId> SymbolIds;
+static std::vector<StringRef> SymbolNames; // Keys of SymbolIds, by id.
+
+static thread_local StringMap<SymbolId> LocalSymbolIds;
+static thread_local std::vector<StringRef> LocalSymbolNames; // Empty if unseen.
+
+/// internSymbol - The id of Name, allocating the next one if it is new.
+static SymbolId internSymbol(StringRef Name) {
+  auto Local = LocalSymbolIds.find(Name);
+  if (Local != LocalSymbolIds.end())
+    return Local->second;
+  SymbolId Id;
+  {
+    std::lock_guard<std::mutex> Guard(SymbolLock);
+    auto Inserted =
+        SymbolIds.insert(std::make_pair(Name, (SymbolId)SymbolNames.size()));
+    if (Inserted.second)
+      SymbolNames.push_back(Inserted.first->getKey());
+    Id = Inserted.first->second;
+  }
+  LocalSymbolIds[Name] = Id;
+  return Id;
+}
+
+/// symbolName - The name that was interned as Id.  The StringRef points into
+/// SymbolIds, whose keys never move, so a cached copy stays valid.
+static StringRef symbolName(SymbolId Id) {
+  if (Id < LocalSymbolNames.size() && !LocalSymbolNames[Id].empty())
+    return LocalSymbolNames[Id];
+  StringRef Name;
+  {
+    std::lock_guard<std::mutex> Guard(SymbolLock);
+    Name = SymbolNames[Id];
+  }
+  if (Id >= LocalSymbolNames.size())
+    LocalSymbolNames.resize(Id + 1);
+  LocalSymbolNames[Id] = Name;
+  return Name;
+}
+
 //===----------------------------------------------------------------------===//
 // Abstract Syntax Tree (aka Parse Tree)
 //===----------------------------------------------------------------------===//
 namespace {
+class BodyKey;
+class ConstEvaluator;
+class Simplifier;
+
+/// ValueType - The static type of a parameter, variable or result.  Values
+/// always cross function boundaries as doubles; int and bool ones are kept as
+/// i64 and i1 in between.
+enum ValueType { VT_Double, VT_Int, VT_Bool };
+
 /// ExprAST - Base class for all expression nodes.
 class ExprAST {
 public:
   virtual ~ExprAST() {}
   virtual Value *codegen() = 0;
+  virtual bool evaluate(ConstEvaluator &E, double &Result) const = 0;
+  /// addToKey - Append the structure of this expression to K.
+  virtual void addToKey(BodyKey &K) const = 0;
+  /// simplify - Simplify the operands of this expression in place, and replace
+  /// it (through Self, which owns it) if it has a simpler equivalent.  Returns
+  /// the static type of the result, if it is known before codegen.
+  virtual Optional<ValueType> simplify(Simplifier &S,
+                                       std::unique_ptr<ExprAST> &Self) = 0;
+  /// getNumber - True, with its value in V, for a constant the simplifier has
+  /// folded as far as it goes: a literal or a comparison of literals.
+  virtual bool getNumber(double &V) const { return false; }
+  /// getUnaryOperand - The operand, if this applies unary operator Opcode.
+  virtual ExprAST *getUnaryOperand(char Opcode) { return nullptr; }
+  /// isNegationOf - True if this is "0 - Var".
+  virtual bool isNegationOf(const std::string &Var) const { return false; }
+  /// codegenAssign - Store Val to the place this expression names.
+  virtual Value *codegenAssign(Value *Val);
+  /// getVariableName - The variable this expression reads, if it is one.
+  virtual const std::string *getVariableName() const { return nullptr; }
+  /// assigns - True if this expression may assign to variable Var.
+  virtual bool assigns(const std::string &Var) const { return false; }
+  /// isIntLiteral - True for a numeric literal with an integral value.
+  virtual bool isIntLiteral() const { return false; }
 };
 
 /// NumberExprAST - Expression class for numeric literals like "1.0".
@@ -137,16 +495,157 @@ class NumberExprAST : public ExprAST {
 public:
   NumberExprAST(double Val) : Val(Val) {}
   Value *codegen() override;
+  bool evaluate(ConstEvaluator &E, double &Result) const override;
+  void addToKey(BodyKey &K) const override;
+  Optional<ValueType> simplify(Simplifier &S,
+                               std::unique_ptr<ExprAST> &Self) override {
+    return VT_Double;
+  }
+  bool getNumber(double &V) const override {
+    V = Val;
+    return true;
+  }
+  bool isIntLiteral() const override { return Val == std::trunc(Val); }
 };
 
 /// VariableExprAST - Expression class for referencing a variable, like "a".
 class VariableExprAST : public ExprAST {
   std::string Name;
+  SymbolId Id;
 
 public:
-  VariableExprAST(const std::string &Name) : Name(Name) {}
+  VariableExprAST(const std::string &Name)
+      : Name(Name), Id(internSymbol(Name)) {}
   const std::string &getName() const { return Name; }
   Value *codegen() override;
+  bool evaluate(ConstEvaluator &E, double &Result) const override;
+  void addToKey(BodyKey &K) const override;
+  Optional<ValueType> simplify(Simplifier &S,
+                               std::unique_ptr<ExprAST> &Self) override;
+  Value *codegenAssign(Value *Val) override;
+  const std::string *getVariableName() const override { return &Name; }
+};
+
+/// IndexExprAST - Expression class for an element of a host array, like
+/// "a[i]".
+class IndexExprAST : public ExprAST {
+  std::string Array;
+  std::unique_ptr<ExprAST> Index;
+
+public:
+  IndexExprAST(const std::string &Array, std::unique_ptr<ExprAST> Index)
+      : Array(Array), Index(std::move(Index)) {}
+  Value *codegen() override;
+  bool evaluate(ConstEvaluator &E, double &Result) const override {
+    return false; // Host memory is not a constant.
+  }
+  void addToKey(BodyKey &K) const override;
+  Optional<ValueType> simplify(Simplifier &S,
+                               std::unique_ptr<ExprAST> &Self) override;
+  Value *codegenAssign(Value *Val) override;
+  bool assigns(const std::string &Var) const override {
+    return Index->assigns(Var);
+  }
+};
+
+/// LenExprAST - Expression class for the length of a host array, "len(a)".
+class LenExprAST : public ExprAST {
+  std::string Array;
+
+public:
+  LenExprAST(const std::string &Array) : Array(Array) {}
+  Value *codegen() override;
+  bool evaluate(ConstEvaluator &E, double &Result) const override {
+    return false; // Arrays can be rebound.
+  }
+  void addToKey(BodyKey &K) const override;
+  Optional<ValueType> simplify(Simplifier &S,
+                               std::unique_ptr<ExprAST> &Self) override {
+    return VT_Int;
+  }
+};
+
+/// ReduceKind - What a reduction combines its elements with.
+enum ReduceKind { RK_Sum, RK_Min, RK_Max, RK_Dot };
+
+/// ReduceExprAST - Expression class for a reduction over a range, like
+/// "sum i = 0, i < n in f(i)".
+class ReduceExprAST : public ExprAST {
+  ReduceKind Kind;
+  std::string VarName;
+  SymbolId VarId;
+  std::unique_ptr<ExprAST> Start, End, Step, Body;
+
+public:
+  ReduceExprAST(ReduceKind Kind, const std::string &VarName,
+                std::unique_ptr<ExprAST> Start, std::unique_ptr<ExprAST> End,
+                std::unique_ptr<ExprAST> Step, std::unique_ptr<ExprAST> Body)
+      : Kind(Kind), VarName(VarName), VarId(internSymbol(VarName)),
+        Start(std::move(Start)),
+        End(std::move(End)), Step(std::move(Step)), Body(std::move(Body)) {}
+  Value *codegen() override;
+  bool evaluate(ConstEvaluator &E, double &Result) const override;
+  void addToKey(BodyKey &K) const override;
+  Optional<ValueType> simplify(Simplifier &S,
+                               std::unique_ptr<ExprAST> &Self) override;
+  // Conservatively ignores shadowing by the range variable.
+  bool assigns(const std::string &Var) const override {
+    return Start->assigns(Var) || End->assigns(Var) ||
+           (Step && Step->assigns(Var)) || Body->assigns(Var);
+  }
+};
+
+/// ArrayReduceExprAST - Expression class for a reduction over whole host
+/// arrays, like "sum(a)" or "dot(a, b)".
+class ArrayReduceExprAST : public ExprAST {
+  ReduceKind Kind;
+  std::string Array, Other;
+
+public:
+  ArrayReduceExprAST(ReduceKind Kind, const std::string &Array,
+                     const std::string &Other = "")
+      : Kind(Kind), Array(Array), Other(Other) {}
+  Value *codegen() override;
+  bool evaluate(ConstEvaluator &E, double &Result) const override {
+    return false; // Host memory is not a constant.
+  }
+  void addToKey(BodyKey &K) const override;
+  Optional<ValueType> simplify(Simplifier &S,
+                               std::unique_ptr<ExprAST> &Self) override {
+    return VT_Double;
+  }
+};
+
+/// ParForExprAST - Expression class for parallel loops, "parfor i = 0, i < n
+/// in body", and parallel reductions, "parfor sum i = 0, i < n in body".  The
+/// body is compiled into a function of its own that runs chunks of the range
+/// on the thread pool.
+class ParForExprAST : public ExprAST {
+  bool IsReduce;
+  ReduceKind Kind;
+  std::string VarName;
+  SymbolId VarId;
+  std::unique_ptr<ExprAST> Start, Bound, Body;
+
+public:
+  ParForExprAST(bool IsReduce, ReduceKind Kind, const std::string &VarName,
+                std::unique_ptr<ExprAST> Start, std::unique_ptr<ExprAST> Bound,
+                std::unique_ptr<ExprAST> Body)
+      : IsReduce(IsReduce), Kind(Kind), VarName(VarName),
+        VarId(internSymbol(VarName)), Start(std::move(Start)),
+        Bound(std::move(Bound)), Body(std::move(Body)) {}
+  Value *codegen() override;
+  Function *outlineBody(Function *Parent, StructType *EnvTy,
+                        const std::vector<SymbolId> &Captured);
+  bool evaluate(ConstEvaluator &E, double &Result) const override {
+    return false; // Runs on other threads.
+  }
+  void addToKey(BodyKey &K) const override;
+  Optional<ValueType> simplify(Simplifier &S,
+                               std::unique_ptr<ExprAST> &Self) override;
+  bool assigns(const std::string &Var) const override {
+    return Start->assigns(Var) || Bound->assigns(Var);
+  }
 };
 
 /// UnaryExprAST - Expression class for a unary operator.
@@ -158,6 +657,16 @@ public:
   UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand)
       : Opcode(Opcode), Operand(std::move(Operand)) {}
   Value *codegen() override;
+  bool evaluate(ConstEvaluator &E, double &Result) const override;
+  void addToKey(BodyKey &K) const override;
+  Optional<ValueType> simplify(Simplifier &S,
+                               std::unique_ptr<ExprAST> &Self) override;
+  ExprAST *getUnaryOperand(char Opcode) override {
+    return Opcode == this->Opcode ? Operand.get() : nullptr;
+  }
+  bool assigns(const std::string &Var) const override {
+    return Operand->assigns(Var);
+  }
 };
 
 /// BinaryExprAST - Expression class for a binary operator.
@@ -170,6 +679,38 @@ public:
                 std::unique_ptr<ExprAST> RHS)
       : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
   Value *codegen() override;
+  bool evaluate(ConstEvaluator &E, double &Result) const override;
+  void addToKey(BodyKey &K) const override;
+  Optional<ValueType> simplify(Simplifier &S,
+                               std::unique_ptr<ExprAST> &Self) override;
+  bool getNumber(double &V) const override;
+  bool isNegationOf(const std::string &Var) const override;
+  bool assigns(const std::string &Var) const override {
+    const std::string *Name = LHS->getVariableName();
+    if (Op == '=' && Name && *Name == Var)
+      return true;
+    return LHS->assigns(Var) || RHS->assigns(Var);
+  }
+};
+
+/// LogicalExprAST - Expression class for the short-circuit "&&" and "||",
+/// which only evaluate RHS when LHS does not decide the result.
+class LogicalExprAST : public ExprAST {
+  bool IsAnd;
+  std::unique_ptr<ExprAST> LHS, RHS;
+
+public:
+  LogicalExprAST(bool IsAnd, std::unique_ptr<ExprAST> LHS,
+                 std::unique_ptr<ExprAST> RHS)
+      : IsAnd(IsAnd), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+  Value *codegen() override;
+  bool evaluate(ConstEvaluator &E, double &Result) const override;
+  void addToKey(BodyKey &K) const override;
+  Optional<ValueType> simplify(Simplifier &S,
+                               std::unique_ptr<ExprAST> &Self) override;
+  bool assigns(const std::string &Var) const override {
+    return LHS->assigns(Var) || RHS->assigns(Var);
+  }
 };
 
 /// CallExprAST - Expression class for function calls.
@@ -182,6 +723,16 @@ public:
               std::vector<std::unique_ptr<ExprAST>> Args)
       : Callee(Callee), Args(std::move(Args)) {}
   Value *codegen() override;
+  bool evaluate(ConstEvaluator &E, double &Result) const override;
+  void addToKey(BodyKey &K) const override;
+  Optional<ValueType> simplify(Simplifier &S,
+                               std::unique_ptr<ExprAST> &Self) override;
+  bool assigns(const std::string &Var) const override {
+    for (auto &Arg : Args)
+      if (Arg->assigns(Var))
+        return true;
+    return false;
+  }
 };
 
 /// IfExprAST - Expression class for if/then/else.
@@ -193,33 +744,68 @@ public:
             std::unique_ptr<ExprAST> Else)
       : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
   Value *codegen() override;
+  bool evaluate(ConstEvaluator &E, double &Result) const override;
+  void addToKey(BodyKey &K) const override;
+  Optional<ValueType> simplify(Simplifier &S,
+                               std::unique_ptr<ExprAST> &Self) override;
+  bool assigns(const std::string &Var) const override {
+    return Cond->assigns(Var) || Then->assigns(Var) || Else->assigns(Var);
+  }
 };
 
 /// ForExprAST - Expression class for for/in.
 class ForExprAST : public ExprAST {
   std::string VarName;
+  SymbolId VarId;
   std::unique_ptr<ExprAST> Start, End, Step, Body;
 
 public:
   ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start,
              std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step,
              std::unique_ptr<ExprAST> Body)
-      : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
-        Step(std::move(Step)), Body(std::move(Body)) {}
+      : VarName(VarName), VarId(internSymbol(VarName)),
+        Start(std::move(Start)), End(std::move(End)), Step(std::move(Step)),
+        Body(std::move(Body)) {}
   Value *codegen() override;
+  bool evaluate(ConstEvaluator &E, double &Result) const override;
+  void addToKey(BodyKey &K) const override;
+  Optional<ValueType> simplify(Simplifier &S,
+                               std::unique_ptr<ExprAST> &Self) override;
+  // Conservatively ignores shadowing by the loop variable.
+  bool assigns(const std::string &Var) const override {
+    return Start->assigns(Var) || End->assigns(Var) ||
+           (Step && Step->assigns(Var)) || Body->assigns(Var);
+  }
 };
 
 /// VarExprAST - Expression class for var/in
 class VarExprAST : public ExprAST {
   std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+  std::vector<SymbolId> VarIds;
+  std::vector<ValueType> VarTypes;
   std::unique_ptr<ExprAST> Body;
 
 public:
   VarExprAST(
       std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames,
-      std::unique_ptr<ExprAST> Body)
-      : VarNames(std::move(VarNames)), Body(std::move(Body)) {}
+      std::vector<ValueType> VarTypes, std::unique_ptr<ExprAST> Body)
+      : VarNames(std::move(VarNames)), VarTypes(std::move(VarTypes)),
+        Body(std::move(Body)) {
+    for (auto &V : this->VarNames)
+      VarIds.push_back(internSymbol(V.first));
+  }
   Value *codegen() override;
+  bool evaluate(ConstEvaluator &E, double &Result) const override;
+  void addToKey(BodyKey &K) const override;
+  Optional<ValueType> simplify(Simplifier &S,
+                               std::unique_ptr<ExprAST> &Self) override;
+  // Conservatively ignores shadowing by the new variables.
+  bool assigns(const std::string &Var) const override {
+    for (auto &V : VarNames)
+      if (V.second && V.second->assigns(Var))
+        return true;
+    return Body->assigns(Var);
+  }
 };
 
 /// PrototypeAST - This class represents the "prototype" for a function,
@@ -228,16 +814,39 @@ public:
 class PrototypeAST {
   std::string Name;
   std::vector<std::string> Args;
+  std::vector<SymbolId> ArgIds;
   bool IsOperator;
   unsigned Precedence; // Precedence if a binary op.
+  std::vector<ValueType> ArgTypes;
+  ValueType RetType;
 
 public:
   PrototypeAST(const std::string &Name, std::vector<std::string> Args,
-               bool IsOperator = false, unsigned Prec = 0)
+               bool IsOperator = false, unsigned Prec = 0,
+               std::vector<ValueType> ArgTypes = {},
+               ValueType RetType = VT_Double)
       : Name(Name), Args(std::move(Args)), IsOperator(IsOperator),
-        Precedence(Prec) {}
+        Precedence(Prec), ArgTypes(std::move(ArgTypes)), RetType(RetType) {
+    this->ArgTypes.resize(this->Args.size(), VT_Double);
+    for (auto &Arg : this->Args)
+      ArgIds.push_back(internSymbol(Arg));
+  }
   Function *codegen();
   const std::string &getName() const { return Name; }
+  const std::vector<std::string> &getArgs() const { return Args; }
+  SymbolId getArgId(unsigned i) const { return ArgIds[i]; }
+  ValueType getArgType(unsigned i) const { return ArgTypes[i]; }
+  ValueType getRetType() const { return RetType; }
+
+  /// isTyped - True if any parameter or the result is not a plain double.
+  bool isTyped() const {
+    if (RetType != VT_Double)
+      return true;
+    for (ValueType Ty : ArgTypes)
+      if (Ty != VT_Double)
+        return true;
+    return false;
+  }
 
   bool isUnaryOp() const { return IsOperator && Args.size() == 1; }
   bool isBinaryOp() const { return IsOperator && Args.size() == 2; }
@@ -254,12 +863,21 @@ public:
 class FunctionAST {
   std::unique_ptr<PrototypeAST> Proto;
   std::unique_ptr<ExprAST> Body;
+  bool Memo;
+  FPMode Mode;
 
 public:
   FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-              std::unique_ptr<ExprAST> Body)
-      : Proto(std::move(Proto)), Body(std::move(Body)) {}
+              std::unique_ptr<ExprAST> Body, bool Memo, FPMode Mode)
+      : Proto(std::move(Proto)), Body(std::move(Body)), Memo(Memo),
+        Mode(Mode) {}
   Function *codegen();
+  void simplify();
+  std::string getBodyKey() const;
+  const PrototypeAST &getProto() const { return *Proto; }
+  const ExprAST &getBody() const { return *Body; }
+  bool isMemo() const { return Memo; }
+  FPMode getFPMode() const { return Mode; }
 };
 } // end anonymous namespace
 
@@ -267,18 +885,79 @@ public:
 // Parser
 //===----------------------------------------------------------------------===//
 
+namespace {
+/// LookaheadToken - A token read ahead of CurTok, with its identifier or
+/// number.
+struct LookaheadToken {
+  int Tok;
+  std::string Identifier;
+  double Num;
+};
+} // end anonymous namespace
+
 /// CurTok/getNextToken - Provide a simple token buffer.  CurTok is the current
 /// token the parser is looking at.  getNextToken reads another token from the
-/// lexer and updates CurTok with its results.
-static int CurTok;
-static int getNextToken() { return CurTok = gettok(); }
+/// lexer (or the lookahead) and updates CurTok with its results.
+static thread_local int CurTok;
+static thread_local std::deque<LookaheadToken> Lookahead;
+static int getNextToken() {
+  if (Lookahead.empty())
+    return CurTok = gettok();
+  LookaheadToken &Next = Lookahead.front();
+  CurTok = Next.Tok;
+  IdentifierStr = std::move(Next.Identifier);
+  NumVal = Next.Num;
+  Lookahead.pop_front();
+  return CurTok;
+}
+
+/// peekToken - The N'th token after CurTok (counting from 0), read without
+/// consuming anything.  Names that are only keywords in some places, like
+/// "len" or "sum", are told apart from identifiers this way.
+static const LookaheadToken &peekToken(unsigned N = 0) {
+  if (Lookahead.size() <= N) {
+    std::string Identifier = IdentifierStr;
+    double Num = NumVal;
+    while (Lookahead.size() <= N) {
+      int Tok = gettok();
+      Lookahead.push_back(LookaheadToken{Tok, IdentifierStr, NumVal});
+    }
+    IdentifierStr = std::move(Identifier);
+    NumVal = Num;
+  }
+  return Lookahead[N];
+}
+
+/// isIdentifier - True if CurTok is the identifier Name.
+static bool isIdentifier(const char *Name) {
+  return CurTok == tok_identifier && IdentifierStr == Name;
+}
+
+/// ArrayDeclarations - The names the parser has seen declared with "extern
+/// array", which make "len(a)" the length of an array rather than a call.
+static thread_local std::set<std::string> ArrayDeclarations;
+
+/// isArrayArgument - True if the tokens after CurTok are '(' and a declared
+/// array.
+static bool isArrayArgument() {
+  if (peekToken().Tok != '(')
+    return false;
+  const LookaheadToken &Arg = peekToken(1);
+  return Arg.Tok == tok_identifier && ArrayDeclarations.count(Arg.Identifier);
+}
 
 /// BinopPrecedence - This holds the precedence for each binary operator that is
 /// defined.
-static std::map<char, int> BinopPrecedence;
+static thread_local std::map<char, int> BinopPrecedence;
 
 /// GetTokPrecedence - Get the precedence of the pending binary operator token.
 static int GetTokPrecedence() {
+  // The built-in logical operators bind more loosely than comparisons and the
+  // usual user-defined '&' (6) and '|' (5), but more tightly than '='.
+  if (CurTok == tok_or)
+    return 3;
+  if (CurTok == tok_and)
+    return 4;
   if (!isascii(CurTok))
     return -1;
 
@@ -289,9 +968,26 @@ static int GetTokPrecedence() {
   return TokPrec;
 }
 
+static bool queueMessage(const std::string &Text);
+
+/// printMessage - Print a diagnostic from the compiler, printf style.  While
+/// -async-exprs expressions are pending it is queued behind what they print,
+/// so that the output stays in source order.
+static void printMessage(const char *Fmt, ...) {
+  va_list Args, Copy;
+  va_start(Args, Fmt);
+  va_copy(Copy, Args);
+  std::string Text(vsnprintf(nullptr, 0, Fmt, Copy), '\0');
+  va_end(Copy);
+  vsnprintf(&Text[0], Text.size() + 1, Fmt, Args);
+  va_end(Args);
+  if (!queueMessage(Text))
+    fwrite(Text.data(), 1, Text.size(), stderr);
+}
+
 /// Error* - These are little helper functions for error handling.
 std::unique_ptr<ExprAST> Error(const char *Str) {
-  fprintf(stderr, "Error: %s\n", Str);
+  printMessage("Error: %s\n", Str);
   return nullptr;
 }
 
@@ -302,6 +998,30 @@ std::unique_ptr<PrototypeAST> ErrorP(const char *Str) {
 
 static std::unique_ptr<ExprAST> ParseExpression();
 
+/// typeannotation ::= (':' ('double' | 'int' | 'bool'))?
+static bool ParseTypeAnnotation(ValueType &Ty) {
+  Ty = VT_Double;
+  if (CurTok != ':')
+    return true;
+  getNextToken(); // eat ':'.
+  if (CurTok == tok_identifier) {
+    if (IdentifierStr == "double")
+      Ty = VT_Double;
+    else if (IdentifierStr == "int")
+      Ty = VT_Int;
+    else if (IdentifierStr == "bool")
+      Ty = VT_Bool;
+    else {
+      Error("Unknown type, expected 'double', 'int' or 'bool'");
+      return false;
+    }
+    getNextToken(); // eat the type name.
+    return true;
+  }
+  Error("Expected type name after ':'");
+  return false;
+}
+
 /// numberexpr ::= number
 static std::unique_ptr<ExprAST> ParseNumberExpr() {
   auto Result = llvm::make_unique<NumberExprAST>(NumVal);
@@ -324,12 +1044,24 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
 
 /// identifierexpr
 ///   ::= identifier
+///   ::= identifier '[' expression ']'
 ///   ::= identifier '(' expression* ')'
 static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
   std::string IdName = IdentifierStr;
 
   getNextToken(); // eat identifier.
 
+  if (CurTok == '[') { // Array element.
+    getNextToken(); // eat [
+    auto Index = ParseExpression();
+    if (!Index)
+      return nullptr;
+    if (CurTok != ']')
+      return Error("Expected ']' after array index");
+    getNextToken(); // eat ]
+    return llvm::make_unique<IndexExprAST>(IdName, std::move(Index));
+  }
+
   if (CurTok != '(') // Simple variable ref.
     return llvm::make_unique<VariableExprAST>(IdName);
 
@@ -358,6 +1090,23 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
   return llvm::make_unique<CallExprAST>(IdName, std::move(Args));
 }
 
+/// lenexpr ::= 'len' '(' identifier ')'
+/// Only for a declared array; "len" is an ordinary name otherwise.
+static std::unique_ptr<ExprAST> ParseLenExpr() {
+  getNextToken(); // eat len.
+  if (CurTok != '(')
+    return Error("Expected '(' after len");
+  getNextToken(); // eat (
+  if (CurTok != tok_identifier)
+    return Error("Expected array name in len");
+  std::string Name = IdentifierStr;
+  getNextToken(); // eat identifier.
+  if (CurTok != ')')
+    return Error("Expected ')' after array name in len");
+  getNextToken(); // eat )
+  return llvm::make_unique<LenExprAST>(Name);
+}
+
 /// ifexpr ::= 'if' expression 'then' expression 'else' expression
 static std::unique_ptr<ExprAST> ParseIfExpr() {
   getNextToken(); // eat the if.
@@ -434,12 +1183,190 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
                                        std::move(Step), std::move(Body));
 }
 
-/// varexpr ::= 'var' identifier ('=' expression)?
-//                    (',' identifier ('=' expression)?)* 'in' expression
+/// getReduceKind - The reduction Name stands for, if it is one.
+static bool getReduceKind(const std::string &Name, ReduceKind &Kind) {
+  if (Name == "sum")
+    Kind = RK_Sum;
+  else if (Name == "min")
+    Kind = RK_Min;
+  else if (Name == "max")
+    Kind = RK_Max;
+  else if (Name == "dot")
+    Kind = RK_Dot;
+  else
+    return false;
+  return true;
+}
+
+/// isReduceExpr - True if CurTok starts a reduction: "sum", "min" or "max"
+/// before a variable and '=', or before a declared array in parentheses, or
+/// "dot" before two declared arrays.  Elsewhere they are ordinary names.
+static bool isReduceExpr() {
+  ReduceKind Kind;
+  if (CurTok != tok_identifier || !getReduceKind(IdentifierStr, Kind))
+    return false;
+  if (isArrayArgument())
+    return peekToken(2).Tok == (Kind == RK_Dot ? ',' : ')');
+  return Kind != RK_Dot && peekToken().Tok == tok_identifier &&
+         peekToken(1).Tok == '=';
+}
+
+/// reduceexpr
+///   ::= ('sum' | 'min' | 'max') identifier '=' expr ',' expr (',' expr)?
+///       'in' expression
+///   ::= ('sum' | 'min' | 'max') '(' identifier ')'
+///   ::= 'dot' '(' identifier ',' identifier ')'
+static std::unique_ptr<ExprAST> ParseReduceExpr() {
+  ReduceKind Kind;
+  getReduceKind(IdentifierStr, Kind);
+  getNextToken(); // eat sum, min, max or dot.
+
+  if (CurTok == '(') { // Whole arrays.
+    getNextToken(); // eat (
+    if (CurTok != tok_identifier)
+      return Error("Expected array name in reduction");
+    std::string Array = IdentifierStr, Other;
+    getNextToken(); // eat identifier.
+    if (Kind == RK_Dot) {
+      if (CurTok != ',')
+        return Error("Expected ',' between the arrays of dot");
+      getNextToken(); // eat ,
+      if (CurTok != tok_identifier)
+        return Error("Expected array name in reduction");
+      Other = IdentifierStr;
+      getNextToken(); // eat identifier.
+    }
+    if (CurTok != ')')
+      return Error("Expected ')' after array name in reduction");
+    getNextToken(); // eat )
+    return llvm::make_unique<ArrayReduceExprAST>(Kind, Array, Other);
+  }
+
+  if (Kind == RK_Dot)
+    return Error("Expected '(' after dot");
+  if (CurTok != tok_identifier)
+    return Error("Expected '(' or identifier after reduction");
+
+  std::string IdName = IdentifierStr;
+  getNextToken(); // eat identifier.
+
+  if (CurTok != '=')
+    return Error("expected '=' after reduction variable");
+  getNextToken(); // eat '='.
+
+  auto Start = ParseExpression();
+  if (!Start)
+    return nullptr;
+  if (CurTok != ',')
+    return Error("expected ',' after reduction start value");
+  getNextToken();
+
+  auto End = ParseExpression();
+  if (!End)
+    return nullptr;
+
+  // The step value is optional.
+  std::unique_ptr<ExprAST> Step;
+  if (CurTok == ',') {
+    getNextToken();
+    Step = ParseExpression();
+    if (!Step)
+      return nullptr;
+  }
+
+  if (CurTok != tok_in)
+    return Error("expected 'in' after reduction range");
+  getNextToken(); // eat 'in'.
+
+  auto Body = ParseExpression();
+  if (!Body)
+    return nullptr;
+
+  return llvm::make_unique<ReduceExprAST>(Kind, IdName, std::move(Start),
+                                          std::move(End), std::move(Step),
+                                          std::move(Body));
+}
+
+/// isParForExpr - True if CurTok starts a parallel loop: "parfor" before a
+/// variable and '=', with "sum", "min" or "max" in between for a reduction.
+/// Elsewhere parfor is an ordinary name.
+static bool isParForExpr() {
+  if (!isIdentifier("parfor") || peekToken().Tok != tok_identifier)
+    return false;
+  if (peekToken(1).Tok == '=')
+    return true;
+  ReduceKind Kind;
+  return getReduceKind(peekToken().Identifier, Kind) && Kind != RK_Dot &&
+         peekToken(1).Tok == tok_identifier && peekToken(2).Tok == '=';
+}
+
+/// parforexpr
+///   ::= 'parfor' ('sum' | 'min' | 'max')? identifier '=' expr ','
+///       identifier '<' expr 'in' expression
+static std::unique_ptr<ExprAST> ParseParForExpr() {
+  getNextToken(); // eat the parfor.
+
+  // "parfor sum i = ..." is a reduction, "parfor sum = ..." a loop over sum.
+  ReduceKind Kind;
+  bool IsReduce = CurTok == tok_identifier &&
+                  getReduceKind(IdentifierStr, Kind) && Kind != RK_Dot &&
+                  peekToken().Tok == tok_identifier;
+  if (!IsReduce)
+    Kind = RK_Sum;
+  else
+    getNextToken(); // eat sum, min or max.
+
+  if (CurTok != tok_identifier)
+    return Error("expected identifier after parfor");
+  std::string IdName = IdentifierStr;
+  getNextToken(); // eat identifier.
+
+  if (CurTok != '=')
+    return Error("expected '=' after parfor");
+  getNextToken(); // eat '='.
+
+  auto Start = ParseExpression();
+  if (!Start)
+    return nullptr;
+  if (CurTok != ',')
+    return Error("expected ',' after parfor start value");
+  getNextToken();
+
+  // The range must be known before the loop starts, so the end condition is
+  // always "i < bound".
+  if (CurTok != tok_identifier || IdentifierStr != IdName)
+    return Error("expected the parfor variable before '<' in its end "
+                 "condition");
+  getNextToken(); // eat identifier.
+  if (CurTok != '<')
+    return Error("expected '<' in parfor end condition");
+  getNextToken(); // eat '<'.
+
+  auto Bound = ParseExpression();
+  if (!Bound)
+    return nullptr;
+
+  if (CurTok != tok_in)
+    return Error("expected 'in' after parfor");
+  getNextToken(); // eat 'in'.
+
+  auto Body = ParseExpression();
+  if (!Body)
+    return nullptr;
+
+  return llvm::make_unique<ParForExprAST>(IsReduce, Kind, IdName,
+                                          std::move(Start), std::move(Bound),
+                                          std::move(Body));
+}
+
+/// varexpr ::= 'var' identifier typeannotation ('=' expression)?
+//                    (',' identifier typeannotation ('=' expression)?)*
+//                    'in' expression
 static std::unique_ptr<ExprAST> ParseVarExpr() {
   getNextToken(); // eat the var.
 
   std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+  std::vector<ValueType> VarTypes;
 
   // At least one variable name is required.
   if (CurTok != tok_identifier)
@@ -449,6 +1376,11 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
     std::string Name = IdentifierStr;
     getNextToken(); // eat identifier.
 
+    ValueType Ty;
+    if (!ParseTypeAnnotation(Ty))
+      return nullptr;
+    VarTypes.push_back(Ty);
+
     // Read the optional initializer.
     std::unique_ptr<ExprAST> Init = nullptr;
     if (CurTok == '=') {
@@ -479,7 +1411,8 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
   if (!Body)
     return nullptr;
 
-  return llvm::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+  return llvm::make_unique<VarExprAST>(std::move(VarNames), std::move(VarTypes),
+                                      std::move(Body));
 }
 
 /// primary
@@ -489,11 +1422,20 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
 ///   ::= ifexpr
 ///   ::= forexpr
 ///   ::= varexpr
+///   ::= lenexpr
+///   ::= reduceexpr
+///   ::= parforexpr
 static std::unique_ptr<ExprAST> ParsePrimary() {
   switch (CurTok) {
   default:
     return Error("unknown token when expecting an expression");
   case tok_identifier:
+    if (isIdentifier("len") && isArrayArgument())
+      return ParseLenExpr();
+    if (isReduceExpr())
+      return ParseReduceExpr();
+    if (isParForExpr())
+      return ParseParForExpr();
     return ParseIdentifierExpr();
   case tok_number:
     return ParseNumberExpr();
@@ -525,7 +1467,7 @@ static std::unique_ptr<ExprAST> ParseUnary() {
 }
 
 /// binoprhs
-///   ::= ('+' unary)*
+///   ::= (('+' | '&&' | '||') unary)*
 static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
                                               std::unique_ptr<ExprAST> LHS) {
   // If this is a binop, find its precedence.
@@ -556,8 +1498,12 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
     }
 
     // Merge LHS/RHS.
-    LHS =
-        llvm::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+    if (BinOp == tok_and || BinOp == tok_or)
+      LHS = llvm::make_unique<LogicalExprAST>(BinOp == tok_and, std::move(LHS),
+                                              std::move(RHS));
+    else
+      LHS = llvm::make_unique<BinaryExprAST>(BinOp, std::move(LHS),
+                                             std::move(RHS));
   }
 }
 
@@ -573,9 +1519,9 @@ static std::unique_ptr<ExprAST> ParseExpression() {
 }
 
 /// prototype
-///   ::= id '(' id* ')'
-///   ::= binary LETTER number? (id, id)
-///   ::= unary LETTER (id)
+///   ::= id '(' (id typeannotation)* ')' typeannotation
+///   ::= binary LETTER number? (id, id) typeannotation
+///   ::= unary LETTER (id) typeannotation
 static std::unique_ptr<PrototypeAST> ParsePrototype() {
   std::string FnName;
 
@@ -622,31 +1568,97 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     return ErrorP("Expected '(' in prototype");
 
   std::vector<std::string> ArgNames;
-  while (getNextToken() == tok_identifier)
+  std::vector<ValueType> ArgTypes;
+  getNextToken(); // eat '('.
+  while (CurTok == tok_identifier) {
     ArgNames.push_back(IdentifierStr);
+    getNextToken(); // eat identifier.
+    ValueType Ty;
+    if (!ParseTypeAnnotation(Ty))
+      return nullptr;
+    ArgTypes.push_back(Ty);
+  }
   if (CurTok != ')')
     return ErrorP("Expected ')' in prototype");
 
   // success.
   getNextToken(); // eat ')'.
 
+  ValueType RetType;
+  if (!ParseTypeAnnotation(RetType))
+    return nullptr;
+
   // Verify right number of names for operator.
   if (Kind && ArgNames.size() != Kind)
     return ErrorP("Invalid number of operands for operator");
 
   return llvm::make_unique<PrototypeAST>(FnName, ArgNames, Kind != 0,
-                                         BinaryPrecedence);
+                                         BinaryPrecedence, ArgTypes, RetType);
+}
+
+/// getFPModeWord - The floating point mode Word names, if it is one.
+static bool getFPModeWord(const std::string &Word, FPMode &Mode) {
+  if (Word == "strict")
+    Mode = FP_Strict;
+  else if (Word == "contract")
+    Mode = FP_Contract;
+  else if (Word == "fast")
+    Mode = FP_Fast;
+  else
+    return false;
+  return true;
+}
+
+/// isAnnotationWord - True if Word may annotate a definition: 'memo' or a
+/// floating point mode word.
+static bool isAnnotationWord(const std::string &Word) {
+  FPMode Mode;
+  return Word == "memo" || getFPModeWord(Word, Mode);
+}
+
+/// isDefinitionStart - True if the top-level item at CurTok is a definition:
+/// 'def', after any number of annotation words.  Only there are 'memo',
+/// 'strict', 'contract' and 'fast' keywords; anywhere else they are ordinary
+/// names.
+static bool isDefinitionStart() {
+  if (CurTok == tok_def)
+    return true;
+  if (CurTok != tok_identifier || !isAnnotationWord(IdentifierStr))
+    return false;
+  for (unsigned N = 0;; ++N) {
+    const LookaheadToken &T = peekToken(N);
+    if (T.Tok == tok_def)
+      return true;
+    if (T.Tok != tok_identifier || !isAnnotationWord(T.Identifier))
+      return false;
+  }
 }
 
-/// definition ::= 'def' prototype expression
+/// definition
+///   ::= ('memo' | 'strict' | 'contract' | 'fast')* 'def' prototype expression
 static std::unique_ptr<FunctionAST> ParseDefinition() {
+  bool Memo = false;
+  FPMode Mode = DefaultFPMode;
+  while (CurTok != tok_def) {
+    FPMode WordMode;
+    if (isIdentifier("memo"))
+      Memo = true;
+    else if (CurTok == tok_identifier && getFPModeWord(IdentifierStr, WordMode))
+      Mode = WordMode;
+    else {
+      ErrorP("Expected 'def' after 'memo', 'strict', 'contract' or 'fast'");
+      return nullptr;
+    }
+    getNextToken(); // eat the annotation.
+  }
   getNextToken(); // eat def.
   auto Proto = ParsePrototype();
   if (!Proto)
     return nullptr;
 
   if (auto E = ParseExpression())
-    return llvm::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    return llvm::make_unique<FunctionAST>(std::move(Proto), std::move(E),
+                                          Memo, Mode);
   return nullptr;
 }
 
@@ -656,575 +1668,5462 @@ static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
     // Make an anonymous proto.
     auto Proto = llvm::make_unique<PrototypeAST>("__anon_expr",
                                                  std::vector<std::string>());
-    return llvm::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    return llvm::make_unique<FunctionAST>(std::move(Proto), std::move(E),
+                                          false, DefaultFPMode);
   }
   return nullptr;
 }
 
+/// isExternArray - True if CurTok, just after 'extern', is "array" followed by
+/// a name, rather than the prototype of a function called array.
+static bool isExternArray() {
+  return isIdentifier("array") && peekToken().Tok == tok_identifier;
+}
+
 /// external ::= 'extern' prototype
+///          ::= 'extern' 'array' identifier
 static std::unique_ptr<PrototypeAST> ParseExtern() {
   getNextToken(); // eat extern.
+  if (isExternArray())
+    return nullptr; // Left to HandleExtern, see ParseExternArray.
   return ParsePrototype();
 }
 
+/// Parse the "array identifier" of an array extern, where isExternArray()
+/// holds, and return the name.
+static std::string ParseExternArray() {
+  getNextToken(); // eat array.
+  std::string Name = IdentifierStr;
+  ArrayDeclarations.insert(Name);
+  getNextToken(); // eat identifier.
+  return Name;
+}
+
 //===----------------------------------------------------------------------===//
 // Code Generation
 //===----------------------------------------------------------------------===//
 
-static std::unique_ptr<Module> TheModule;
-static IRBuilder<> Builder(getGlobalContext());
-static std::map<std::string, AllocaInst *> NamedValues;
-static std::unique_ptr<legacy::FunctionPassManager> TheFPM;
-static std::unique_ptr<KaleidoscopeJIT> TheJIT;
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+namespace {
+/// SymbolTable - The variables in scope in the function being compiled.  The
+/// current binding of every symbol sits in a vector slot indexed by its id, and
+/// each new binding is logged on a trail together with the one it shadows, so
+/// binding, lookup and unbinding at the end of a scope are O(1) per variable.
+class SymbolTable {
+  std::vector<AllocaInst *> Current;
+  std::vector<std::pair<SymbolId, AllocaInst *>> Trail;
+  std::vector<size_t> Scopes;
+
+  void unwind(size_t Size) {
+    while (Trail.size() > Size) {
+      Current[Trail.back().first] = Trail.back().second;
+      Trail.pop_back();
+    }
+  }
 
-Value *ErrorV(const char *Str) {
-  Error(Str);
-  return nullptr;
-}
+public:
+  AllocaInst *lookup(SymbolId Id) const {
+    return Id < Current.size() ? Current[Id] : nullptr;
+  }
 
-Function *getFunction(std::string Name) {
-  // First, see if the function has already been added to the current module.
-  if (auto *F = TheModule->getFunction(Name))
-    return F;
+  /// bind - Make Id name Alloca until the innermost scope is popped.
+  void bind(SymbolId Id, AllocaInst *Alloca) {
+    if (Id >= Current.size())
+      Current.resize(Id + 1);
+    Trail.push_back(std::make_pair(Id, Current[Id]));
+    Current[Id] = Alloca;
+  }
 
-  // If not, check whether we can codegen the declaration from some existing
-  // prototype.
-  auto FI = FunctionProtos.find(Name);
-  if (FI != FunctionProtos.end())
-    return FI->second->codegen();
+  void pushScope() { Scopes.push_back(Trail.size()); }
 
-  // If no existing prototype exists, return null.
-  return nullptr;
-}
+  /// popScope - Drop the bindings made since the matching pushScope, bringing
+  /// back the ones they shadowed.
+  void popScope() {
+    unwind(Scopes.back());
+    Scopes.pop_back();
+  }
 
-/// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
-/// the function.  This is used for mutable variables etc.
-static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
-                                          const std::string &VarName) {
-  IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
-                   TheFunction->getEntryBlock().begin());
-  return TmpB.CreateAlloca(Type::getDoubleTy(getGlobalContext()), nullptr,
-                           VarName.c_str());
-}
+  /// clear - Drop every binding, for the next function.
+  void clear() {
+    unwind(0);
+    Scopes.clear();
+  }
 
-Value *NumberExprAST::codegen() {
-  return ConstantFP::get(getGlobalContext(), APFloat(Val));
-}
+  /// visible - The id of every variable in scope, innermost binding first.
+  std::vector<SymbolId> visible() const {
+    std::vector<SymbolId> Ids;
+    std::vector<bool> Seen(Current.size());
+    for (auto I = Trail.rbegin(), E = Trail.rend(); I != E; ++I)
+      if (!Seen[I->first]) {
+        Seen[I->first] = true;
+        Ids.push_back(I->first);
+      }
+    return Ids;
+  }
+};
 
-Value *VariableExprAST::codegen() {
-  // Look this variable up in the function.
-  Value *V = NamedValues[Name];
-  if (!V)
-    return ErrorV("Unknown variable name");
+/// PrototypeRegistry - The prototype of every function defined or declared so
+/// far, by name.  Each module that calls an earlier function needs a
+/// declaration of it; the registry builds its type and symbol name once, when
+/// it is first declared, so that later declarations only create the Function.
+class PrototypeRegistry {
+  struct Entry {
+    std::unique_ptr<PrototypeAST> Proto;
+    FunctionType *Type = nullptr; // Built by the first declare.
+    std::string Symbol;
+  };
+  StringMap<Entry> Entries;
 
-  // Load the value.
-  return Builder.CreateLoad(V, Name.c_str());
-}
+public:
+  /// Stats - Counters for -decl-stats.
+  struct Stats {
+    uint64_t Registered = 0;   // Prototypes added.
+    uint64_t Replaced = 0;     // ... of which replaced an older one.
+    uint64_t TypesBuilt = 0;   // Function types built for declarations.
+    uint64_t Declarations = 0; // Declarations emitted into modules.
+    uint64_t ModuleHits = 0;   // Lookups the current module already had.
+  } Counts;
+
+  /// add - Register P, replacing any prototype of the same name.
+  void add(std::unique_ptr<PrototypeAST> P);
+
+  /// find - The prototype registered as Name, or null.
+  const PrototypeAST *find(StringRef Name) const {
+    auto I = Entries.find(Name);
+    return I == Entries.end() ? nullptr : I->second.Proto.get();
+  }
 
-Value *UnaryExprAST::codegen() {
-  Value *OperandV = Operand->codegen();
-  if (!OperandV)
-    return nullptr;
+  /// declare - The function Name in the current module, declared from its
+  /// prototype if the module has not seen it yet; null if Name is unknown.
+  Function *declare(StringRef Name);
 
-  Function *F = getFunction(std::string("unary") + Opcode);
-  if (!F)
-    return ErrorV("Unknown unary operator");
+  /// forEach - Call Fn on every registered prototype.
+  template <typename FnT> void forEach(FnT Fn) const {
+    for (auto &E : Entries)
+      Fn(*E.second.Proto);
+  }
 
-  return Builder.CreateCall(F, OperandV, "unop");
-}
+  void clear() { Entries.clear(); }
+  void printStats() const;
+};
+} // end anonymous namespace
 
-Value *BinaryExprAST::codegen() {
-  // Special case '=' because we don't want to emit the LHS as an expression.
-  if (Op == '=') {
-    // Assignment requires the LHS to be an identifier.
-    // This assume we're building without RTTI because LLVM builds that way by
-    // default.  If you build LLVM with RTTI this can be changed to a
-    // dynamic_cast for automatic error checking.
-    VariableExprAST *LHSE = static_cast<VariableExprAST *>(LHS.get());
-    if (!LHSE)
-      return ErrorV("destination of '=' must be a variable");
-    // Codegen the RHS.
-    Value *Val = RHS->codegen();
-    if (!Val)
-      return nullptr;
+static thread_local std::unique_ptr<LLVMContext> TheContext;
+static thread_local std::unique_ptr<Module> TheModule;
+static thread_local std::unique_ptr<IRBuilder<>> Builder;
+static thread_local SymbolTable NamedValues;
+static thread_local std::unique_ptr<legacy::FunctionPassManager> TheFPM;
+static thread_local std::unique_ptr<KaleidoscopeJIT> TheJIT;
+static thread_local PrototypeRegistry FunctionProtos;
+
+/// ExternFunctions - The functions declared with extern, as opposed to the
+/// ones defined in the program.
+static thread_local std::set<std::string> ExternFunctions;
+
+/// Workers - When set (-workers), compiled code is shipped to this pool of
+/// worker processes instead of being linked and run in TheJIT.
+static thread_local std::unique_ptr<KaleidoscopeWorkerPool> Workers;
+
+//===----------------------------------------------------------------------===//
+// Profile state (-pgo)
+//===----------------------------------------------------------------------===//
+
+namespace {
+/// CallSlot - While profiling, every call to a user definition loads its
+/// target from here, so the reoptimizer can swap in a new version by storing a
+/// new address.
+struct CallSlot {
+  std::atomic<uint64_t> Address;
+  CallSlot() : Address(0) {}
+};
+
+/// CallSiteProfile - One instrumented call.  Its counters are a call count
+/// followed by a (candidate bits, surplus) majority vote per argument; IsLiteral
+/// marks the arguments that were constants at the call site anyway.
+struct CallSiteProfile {
+  std::string Callee;
+  unsigned Counter;
+  std::vector<bool> IsLiteral;
+  std::vector<double> Literal;
+};
 
-    // Look up the name.
-    Value *Variable = NamedValues[LHSE->getName()];
-    if (!Variable)
-      return ErrorV("Unknown variable name");
+/// FunctionProfile - The counters of one instrumented definition.  Counter 0
+/// counts entries; every if, for and call site gets its own counters, found
+/// through Sites by the AST node that emitted them.  Counters is a deque so the
+/// addresses baked into the instrumented code stay valid as it grows.  Any
+/// number of threads running the code update the counters atomically while
+/// the reoptimizer reads them, see getCounter.
+struct FunctionProfile {
+  std::string Name;
+  std::shared_ptr<FunctionAST> AST;
+  std::deque<std::atomic<uint64_t>> Counters;
+  std::map<const ExprAST *, unsigned> Sites;
+  std::map<const ExprAST *, CallSiteProfile> Calls;
+  std::vector<double> SampleArgs; // arguments of the first call
+  bool CallsExterns = false;
+  bool Queued = false;
+  uint64_t InstrumentedAddr = 0;
+  uint64_t OptimizedAddr = 0;
+};
 
-    Builder.CreateStore(Val, Variable);
-    return Val;
+/// ProfileState - Every profile and call slot of one session.  It is shared
+/// between the session thread, which instruments and runs code, and its
+/// reoptimizer thread; Lock guards the maps.  Epoch counts finished top-level
+/// expressions: code unlinked from every slot in an earlier epoch can no longer
+/// be running.
+struct ProfileState {
+  std::mutex Lock;
+  std::atomic<uint64_t> Epoch;
+  std::map<std::string, std::unique_ptr<CallSlot>> Slots;
+  std::map<std::string, FunctionProfile *> Current;
+  std::vector<std::unique_ptr<FunctionProfile>> All;
+  std::map<std::string, std::unique_ptr<PrototypeAST>> Protos;
+
+  ProfileState() : Epoch(0) {}
+
+  CallSlot *findSlot(const std::string &Name) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto I = Slots.find(Name);
+    return I == Slots.end() ? nullptr : I->second.get();
   }
 
-  Value *L = LHS->codegen();
-  Value *R = RHS->codegen();
-  if (!L || !R)
-    return nullptr;
+  FunctionProfile *findCurrent(const std::string &Name) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto I = Current.find(Name);
+    return I == Current.end() ? nullptr : I->second;
+  }
+};
+} // end anonymous namespace
 
-  switch (Op) {
-  case '+':
-    return Builder.CreateFAdd(L, R, "addtmp");
-  case '-':
-    return Builder.CreateFSub(L, R, "subtmp");
-  case '*':
-    return Builder.CreateFMul(L, R, "multmp");
-  case '<':
-    L = Builder.CreateFCmpULT(L, R, "cmptmp");
-    // Convert bool 0/1 to double 0.0 or 1.0
-    return Builder.CreateUIToFP(L, Type::getDoubleTy(getGlobalContext()),
-                                "booltmp");
+enum ProfileModeT { PM_None, PM_Instrument, PM_Optimize };
+
+/// Profiles - This session's profile state, or null without -pgo.
+/// ProfileMode - Whether FunctionAST::codegen instruments (session thread) or
+/// optimizes from the counters (reoptimizer thread).
+/// CurProfile - The profile of the function being emitted.
+static thread_local std::shared_ptr<ProfileState> Profiles;
+static thread_local ProfileModeT ProfileMode = PM_None;
+static thread_local FunctionProfile *CurProfile = nullptr;
+
+namespace {
+/// SpecializedCall - A call site that the reoptimizer routes to a constant-
+/// argument specialization whenever the Guards arguments have those values.
+struct SpecializedCall {
+  CallSlot *Slot;
+  std::vector<std::pair<unsigned, double>> Guards;
+};
+} // end anonymous namespace
+
+/// ArrayNames - The host arrays this session has declared with extern array.
+static thread_local std::set<std::string> ArrayNames;
+
+/// SpecializedCalls - The specialized call sites of the function the
+/// reoptimizer is emitting.
+static thread_local std::map<const ExprAST *, SpecializedCall> SpecializedCalls;
+
+/// CurFPMode - The floating point mode of the definition being emitted.
+static thread_local FPMode CurFPMode = FP_Strict;
+
+/// setFPMode - Emit the rest of F in floating point mode Mode.  Fast code gets
+/// fast-math flags on its instructions, and function attributes that let the
+/// backend fuse FMAs and the vectorizers reduce with min and max.
+static void setFPMode(Function *F, FPMode Mode) {
+  CurFPMode = Mode;
+  FastMathFlags FMF;
+  if (Mode == FP_Fast) {
+    FMF.setUnsafeAlgebra();
+    F->addFnAttr("unsafe-fp-math", "true");
+    F->addFnAttr("no-nans-fp-math", "true");
+    F->addFnAttr("no-infs-fp-math", "true");
+    F->addFnAttr("no-signed-zeros-fp-math", "true");
+  }
+  Builder->SetFastMathFlags(FMF);
+}
+
+Value *ErrorV(const char *Str) {
+  Error(Str);
+  return nullptr;
+}
+
+/// hasFloatVariant - True if the C function Name is known to have a float
+/// variant named Name + "f" with the same arguments: libm's, and the library
+/// functions below.  Any other NAMEf in the process may be unrelated (print
+/// would become the variadic printf).
+static bool hasFloatVariant(const std::string &Name) {
+  static const char *const Names[] = {
+      "sin",   "cos",    "tan",       "asin",     "acos",   "atan",
+      "atan2", "sinh",   "cosh",      "tanh",     "asinh",  "acosh",
+      "atanh", "exp",    "exp2",      "expm1",    "log",    "log2",
+      "log10", "log1p",  "pow",       "sqrt",     "cbrt",   "hypot",
+      "fabs",  "floor",  "ceil",      "round",    "trunc",  "rint",
+      "fmod",  "fmin",   "fmax",      "fdim",     "copysign", "erf",
+      "erfc",  "tgamma", "lgamma",    "printd",   "putchard", "clockd"};
+  for (const char *N : Names)
+    if (Name == N)
+      return true;
+  return false;
+}
+
+/// getSymbolName - The symbol that calls to the function Name go to.  With
+/// -float32, an extern is bound to its float variant where it has one, in the
+/// C library's style: sin to sinf, printd to printdf.
+static std::string getSymbolName(const std::string &Name) {
+  if (Float32 && ExternFunctions.count(Name) && hasFloatVariant(Name) &&
+      sys::DynamicLibrary::SearchForAddressOfSymbol(Name + "f"))
+    return Name + "f";
+  return Name;
+}
+
+Function *getFunction(std::string Name) {
+  // First, see if the function has already been added to the current module.
+  // If not, declare it from its registered prototype, if it has one.
+  return FunctionProtos.declare(Name);
+}
+
+/// getNumTy - The type numbers are computed in: double, or float with
+/// -float32.
+static Type *getNumTy() {
+  return Float32 ? Type::getFloatTy(*TheContext)
+                 : Type::getDoubleTy(*TheContext);
+}
+
+/// getValueType - The LLVM type that values of static type Ty are kept in.
+static Type *getValueType(ValueType Ty) {
+  switch (Ty) {
+  case VT_Int:
+    return Type::getInt64Ty(*TheContext);
+  case VT_Bool:
+    return Type::getInt1Ty(*TheContext);
   default:
-    break;
+    return getNumTy();
   }
+}
 
-  // If it wasn't a builtin binary operator, it must be a user defined one. Emit
-  // a call to it.
-  Function *F = getFunction(std::string("binary") + Op);
-  assert(F && "binary operator not found!");
+/// convertValue - Convert V, a number, i64 or i1, to Ty.  Numbers become ints
+/// by truncation toward zero, and anything becomes a bool the way conditions
+/// are tested: not equal to zero (and, for numbers, ordered).
+static Value *convertValue(Value *V, Type *Ty) {
+  Type *From = V->getType();
+  if (From == Ty)
+    return V;
+  if (Ty->isFloatingPointTy())
+    return From->isIntegerTy(1) ? Builder->CreateUIToFP(V, Ty, "booltmp")
+                                : Builder->CreateSIToFP(V, Ty, "inttmp");
+  if (Ty->isIntegerTy(1))
+    return From->isFloatingPointTy()
+               ? Builder->CreateFCmpONE(V, ConstantFP::get(From, 0.0), "tobool")
+               : Builder->CreateICmpNE(V, ConstantInt::get(From, 0), "tobool");
+  return From->isFloatingPointTy() ? Builder->CreateFPToSI(V, Ty, "toint")
+                                   : Builder->CreateZExt(V, Ty, "toint");
+}
 
-  Value *Ops[] = {L, R};
-  return Builder.CreateCall(F, Ops, "binop");
+/// toDouble - V as a number: a double, or a float with -float32.
+static Value *toDouble(Value *V) { return convertValue(V, getNumTy()); }
+
+/// getConstantValue - The value of the number constant C.
+static double getConstantValue(const ConstantFP *C) {
+  return C->getType()->isFloatTy() ? C->getValueAPF().convertToFloat()
+                                   : C->getValueAPF().convertToDouble();
 }
 
-Value *CallExprAST::codegen() {
-  // Look up the name in the global module table.
-  Function *CalleeF = getFunction(Callee);
-  if (!CalleeF)
-    return ErrorV("Unknown function referenced");
+/// toBits - The bits of the number V, zero-extended to i64.
+static Value *toBits(Value *V) {
+  unsigned Width = V->getType()->getPrimitiveSizeInBits();
+  Value *Bits = Builder->CreateBitCast(V, Builder->getIntNTy(Width), "bits");
+  return Builder->CreateZExt(Bits, Builder->getInt64Ty());
+}
 
-  // If argument mismatch error.
-  if (CalleeF->arg_size() != Args.size())
-    return ErrorV("Incorrect # arguments passed");
+/// fromBits - The number whose bits toBits gave as Bits.
+static Value *fromBits(Value *Bits) {
+  Type *NumTy = getNumTy();
+  unsigned Width = NumTy->getPrimitiveSizeInBits();
+  return Builder->CreateBitCast(
+      Builder->CreateTrunc(Bits, Builder->getIntNTy(Width)), NumTy);
+}
 
-  std::vector<Value *> ArgsV;
-  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-    ArgsV.push_back(Args[i]->codegen());
-    if (!ArgsV.back())
-      return nullptr;
+/// asIntOperand - V as an operand of integer arithmetic: ints as they are and
+/// integral double constants converted; null for anything else.
+static Value *asIntOperand(Value *V) {
+  if (V->getType()->isIntegerTy(64))
+    return V;
+  if (ConstantFP *C = dyn_cast<ConstantFP>(V)) {
+    double D = getConstantValue(C);
+    if (D == std::trunc(D) && std::fabs(D) < 9.2e18)
+      return Builder->getInt64((int64_t)D);
   }
+  return nullptr;
+}
 
-  return Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+/// saturatingToInt - Round the double D with llvm.ceil (or llvm.floor) and
+/// convert it to i64, clamping out-of-range values to INT64_MIN/INT64_MAX.  A
+/// NaN goes to INT64_MAX when rounding up and INT64_MIN when rounding down, so
+/// that comparisons against it stay true as "<" (unordered less than) wants.
+static Value *saturatingToInt(Value *D, bool RoundUp) {
+  Type *DoubleTy = D->getType();
+  Function *Round = Intrinsic::getDeclaration(
+      TheModule.get(), RoundUp ? Intrinsic::ceil : Intrinsic::floor, DoubleTy);
+  Value *R = Builder->CreateCall(Round, D, "round");
+
+  Constant *Limit = ConstantFP::get(DoubleTy, 9223372036854775808.0);
+  Constant *NegLimit = ConstantFP::get(DoubleTy, -9223372036854775808.0);
+  Value *Hi = RoundUp ? Builder->CreateFCmpUGE(R, Limit, "toobig")
+                      : Builder->CreateFCmpOGE(R, Limit, "toobig");
+  Value *Lo = RoundUp ? Builder->CreateFCmpOLT(R, NegLimit, "toosmall")
+                      : Builder->CreateFCmpULT(R, NegLimit, "toosmall");
+
+  Value *Safe = Builder->CreateSelect(Builder->CreateOr(Hi, Lo),
+                                      ConstantFP::get(DoubleTy, 0.0), R);
+  Value *I = Builder->CreateFPToSI(Safe, Builder->getInt64Ty(), "toint");
+  I = Builder->CreateSelect(Lo, Builder->getInt64(INT64_MIN), I);
+  return Builder->CreateSelect(Hi, Builder->getInt64(INT64_MAX), I, "sat");
 }
 
-Value *IfExprAST::codegen() {
-  Value *CondV = Cond->codegen();
-  if (!CondV)
-    return nullptr;
+/// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
+/// the function.  This is used for mutable variables etc.
+static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
+                                          const std::string &VarName,
+                                          ValueType Ty = VT_Double) {
+  IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+                   TheFunction->getEntryBlock().begin());
+  return TmpB.CreateAlloca(getValueType(Ty), nullptr, VarName.c_str());
+}
 
-  // Convert condition to a bool by comparing equal to 0.0.
-  CondV = Builder.CreateFCmpONE(
-      CondV, ConstantFP::get(getGlobalContext(), APFloat(0.0)), "ifcond");
+/// emitProfileAddress - A pointer constant for host memory at P; profiling code
+/// always runs in this process, so its counters are baked in as addresses.
+static Value *emitProfileAddress(const void *P, Type *PointeeTy) {
+  return Builder->CreateIntToPtr(Builder->getInt64((uint64_t)(uintptr_t)P),
+                                 PointeeTy->getPointerTo());
+}
 
-  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+/// startProfile - Create the profile for a new instrumented definition.  It
+/// only becomes the current profile for Name once the definition has compiled
+/// and been added to the JIT (see installProfile).
+static FunctionProfile *startProfile(const std::string &Name, unsigned Arity) {
+  auto Prof = llvm::make_unique<FunctionProfile>();
+  Prof->Name = Name;
+  Prof->Counters.emplace_back(0);
+  Prof->SampleArgs.resize(Arity);
+
+  FunctionProfile *Result = Prof.get();
+  std::lock_guard<std::mutex> Guard(Profiles->Lock);
+  Profiles->All.push_back(std::move(Prof));
+  return Result;
+}
 
-  // Create blocks for the then and else cases.  Insert the 'then' block at the
-  // end of the function.
-  BasicBlock *ThenBB =
-      BasicBlock::Create(getGlobalContext(), "then", TheFunction);
-  BasicBlock *ElseBB = BasicBlock::Create(getGlobalContext(), "else");
-  BasicBlock *MergeBB = BasicBlock::Create(getGlobalContext(), "ifcont");
+/// getCounter - Read a counter that instrumented code may be updating.  The
+/// counts only steer heuristics, so no ordering with other memory is needed.
+static uint64_t getCounter(const FunctionProfile &P, unsigned Idx) {
+  return P.Counters[Idx].load(std::memory_order_relaxed);
+}
 
-  Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+/// emitCounterAdd - Atomically add 1 to counter Idx of the current profile,
+/// and return the value it had before.
+static Value *emitCounterAdd(unsigned Idx) {
+  Value *Ptr = emitProfileAddress(&CurProfile->Counters[Idx],
+                                  Builder->getInt64Ty());
+  return Builder->CreateAtomicRMW(AtomicRMWInst::Add, Ptr,
+                                  Builder->getInt64(1),
+                                  AtomicOrdering::Monotonic);
+}
 
-  // Emit then value.
-  Builder.SetInsertPoint(ThenBB);
+/// emitCounterIncrement - Bump counter Idx of the current profile.
+static void emitCounterIncrement(unsigned Idx) { emitCounterAdd(Idx); }
+
+/// emitEntryProfile - Count an entry into F and, on the very first one, save
+/// its arguments so that the report can replay the call.
+static void emitEntryProfile(Function *F) {
+  Value *Count = emitCounterAdd(0);
+  if (F->arg_empty())
+    return;
+
+  BasicBlock *SaveBB = BasicBlock::Create(*TheContext, "saveargs", F);
+  BasicBlock *BodyBB = BasicBlock::Create(*TheContext, "body", F);
+  Builder->CreateCondBr(Builder->CreateICmpEQ(Count, Builder->getInt64(0)),
+                        SaveBB, BodyBB);
+  Builder->SetInsertPoint(SaveBB);
+  unsigned Idx = 0;
+  for (auto &Arg : F->args())
+    Builder->CreateStore(&Arg,
+                         emitProfileAddress(&CurProfile->SampleArgs[Idx++],
+                                            Builder->getDoubleTy()));
+  Builder->CreateBr(BodyBB);
+  Builder->SetInsertPoint(BodyBB);
+}
 
-  Value *ThenV = Then->codegen();
-  if (!ThenV)
-    return nullptr;
+/// emitRelaxedLoad, emitRelaxedStore - Access a counter or call slot with
+/// monotonic (relaxed) atomics, so that concurrent updates are racy only in
+/// the counts, and a call sees either the old or the new target.
+static Value *emitRelaxedLoad(Value *Ptr, const Twine &Name) {
+  LoadInst *L = Builder->CreateLoad(Ptr, Name);
+  L->setAlignment(8);
+  L->setAtomic(AtomicOrdering::Monotonic);
+  return L;
+}
 
-  Builder.CreateBr(MergeBB);
-  // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
-  ThenBB = Builder.GetInsertBlock();
+static void emitRelaxedStore(Value *V, Value *Ptr) {
+  StoreInst *S = Builder->CreateStore(V, Ptr);
+  S->setAlignment(8);
+  S->setAtomic(AtomicOrdering::Monotonic);
+}
 
-  // Emit else block.
-  TheFunction->getBasicBlockList().push_back(ElseBB);
-  Builder.SetInsertPoint(ElseBB);
+/// emitValueProfile - Track the majority value of Arg with a Boyer-Moore vote
+/// over counters Idx (candidate, as bits) and Idx + 1 (its surplus).  Threads
+/// voting at once may lose each other's votes, which only blurs the estimate.
+static void emitValueProfile(unsigned Idx, Value *Arg) {
+  Type *I64 = Builder->getInt64Ty();
+  Value *CandPtr = emitProfileAddress(&CurProfile->Counters[Idx], I64);
+  Value *SurplusPtr = emitProfileAddress(&CurProfile->Counters[Idx + 1], I64);
+  Value *Bits = Builder->CreateBitCast(Arg, I64, "argbits");
+  Value *Cand = emitRelaxedLoad(CandPtr, "cand");
+  Value *Surplus = emitRelaxedLoad(SurplusPtr, "surplus");
+
+  Value *One = Builder->getInt64(1);
+  Value *Same = Builder->CreateICmpEQ(Bits, Cand, "same");
+  Value *Empty = Builder->CreateICmpEQ(Surplus, Builder->getInt64(0), "empty");
+  emitRelaxedStore(Builder->CreateSelect(Empty, Bits, Cand), CandPtr);
+  emitRelaxedStore(
+      Builder->CreateSelect(Same, Builder->CreateAdd(Surplus, One),
+                            Builder->CreateSelect(Empty, One,
+                                                  Builder->CreateSub(Surplus,
+                                                                     One))),
+      SurplusPtr);
+}
 
-  Value *ElseV = Else->codegen();
-  if (!ElseV)
-    return nullptr;
+/// getConstantArgs - The arguments of call site CS in P worth specializing on:
+/// literals, and those whose profiled majority value won at least half of the
+/// calls.
+static std::vector<std::pair<unsigned, double>>
+getConstantArgs(const FunctionProfile &P, const CallSiteProfile &CS) {
+  std::vector<std::pair<unsigned, double>> Result;
+  uint64_t Calls = getCounter(P, CS.Counter);
+  for (unsigned i = 0, e = CS.IsLiteral.size(); i != e; ++i) {
+    if (CS.IsLiteral[i]) {
+      Result.push_back(std::make_pair(i, CS.Literal[i]));
+      continue;
+    }
+    uint64_t Bits = getCounter(P, CS.Counter + 1 + 2 * i);
+    uint64_t Surplus = getCounter(P, CS.Counter + 2 + 2 * i);
+    if (Surplus * 2 < Calls)
+      continue;
+    double V;
+    memcpy(&V, &Bits, sizeof(V));
+    Result.push_back(std::make_pair(i, V));
+  }
+  return Result;
+}
 
-  Builder.CreateBr(MergeBB);
-  // Codegen of 'Else' can change the current block, update ElseBB for the PHI.
-  ElseBB = Builder.GetInsertBlock();
+/// isInstrumenting - True while emitting an instrumented definition.
+static bool isInstrumenting() {
+  return ProfileMode == PM_Instrument && CurProfile;
+}
 
-  // Emit merge block.
-  TheFunction->getBasicBlockList().push_back(MergeBB);
-  Builder.SetInsertPoint(MergeBB);
-  PHINode *PN =
-      Builder.CreatePHI(Type::getDoubleTy(getGlobalContext()), 2, "iftmp");
+/// isOptimizingFromProfile - True while the reoptimizer emits a definition.
+static bool isOptimizingFromProfile() {
+  return ProfileMode == PM_Optimize && CurProfile;
+}
 
-  PN->addIncoming(ThenV, ThenBB);
-  PN->addIncoming(ElseV, ElseBB);
-  return PN;
+/// getProfileSite - The first of NumCounters counters for Site in the current
+/// profile, allocating them the first time the site is instrumented.
+static unsigned getProfileSite(const ExprAST *Site, unsigned NumCounters) {
+  auto I = CurProfile->Sites.find(Site);
+  if (I != CurProfile->Sites.end())
+    return I->second;
+  unsigned Idx = CurProfile->Counters.size();
+  for (unsigned i = 0; i != NumCounters; ++i)
+    CurProfile->Counters.emplace_back(0);
+  CurProfile->Sites[Site] = Idx;
+  return Idx;
 }
 
-// Output for-loop as:
-//   var = alloca double
-//   ...
-//   start = startexpr
-//   store start -> var
-//   goto loop
-// loop:
-//   ...
-//   bodyexpr
-//   ...
-// loopend:
-//   step = stepexpr
-//   endcond = endexpr
-//
-//   curvar = load var
-//   nextvar = curvar + step
-//   store nextvar -> var
-//   br endcond, loop, endloop
-// outloop:
-Value *ForExprAST::codegen() {
-  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+/// getProfileCount - Counter K of Site in the current profile, 0 if the site
+/// was never instrumented.
+static uint64_t getProfileCount(const ExprAST *Site, unsigned K) {
+  auto I = CurProfile->Sites.find(Site);
+  if (I == CurProfile->Sites.end())
+    return 0;
+  return getCounter(*CurProfile, I->second + K);
+}
 
-  // Create an alloca for the variable in the entry block.
-  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+/// setBranchWeights - Attach profile weights to a conditional branch, scaled
+/// into the 32 bits branch_weights metadata holds.
+static void setBranchWeights(BranchInst *Br, uint64_t Taken,
+                             uint64_t NotTaken) {
+  while (Taken > UINT32_MAX || NotTaken > UINT32_MAX) {
+    Taken >>= 1;
+    NotTaken >>= 1;
+  }
+  // Add one so that a never-seen edge is unlikely rather than impossible.
+  Br->setMetadata(LLVMContext::MD_prof,
+                  MDBuilder(*TheContext)
+                      .createBranchWeights((uint32_t)Taken + 1,
+                                           (uint32_t)NotTaken + 1));
+}
 
-  // Emit the start code first, without 'variable' in scope.
-  Value *StartVal = Start->codegen();
-  if (!StartVal)
-    return nullptr;
+/// setLoopHints - Make Hints, {"llvm.loop.*", value} nodes, the loop ID of the
+/// loop whose latch is Br.
+static void setLoopHints(BranchInst *Br, ArrayRef<Metadata *> Hints) {
+  LLVMContext &C = *TheContext;
+  // A loop ID is a distinct node whose first operand is itself.
+  auto Temp = MDNode::getTemporary(C, None);
+  SmallVector<Metadata *, 4> Ops;
+  Ops.push_back(Temp.get());
+  Ops.append(Hints.begin(), Hints.end());
+  MDNode *LoopID = MDNode::get(C, Ops);
+  LoopID->replaceOperandWith(0, LoopID);
+  Br->setMetadata("llvm.loop", LoopID);
+}
 
-  // Store the value into the alloca.
-  Builder.CreateStore(StartVal, Alloca);
+/// getLoopHint - The loop hint node {Name, Val}.
+static Metadata *getLoopHint(StringRef Name, Constant *Val) {
+  Metadata *Ops[] = {MDString::get(*TheContext, Name),
+                     ConstantAsMetadata::get(Val)};
+  return MDNode::get(*TheContext, Ops);
+}
 
-  // Make the new basic block for the loop header, inserting after current
-  // block.
-  BasicBlock *LoopBB =
-      BasicBlock::Create(getGlobalContext(), "loop", TheFunction);
+/// setLoopUnrollCount - Ask the loop unroller to unroll the loop whose latch is
+/// Br Count times.
+static void setLoopUnrollCount(BranchInst *Br, unsigned Count) {
+  setLoopHints(Br, getLoopHint("llvm.loop.unroll.count",
+                               Builder->getInt32(Count)));
+}
 
-  // Insert an explicit fall through from the current block to the LoopBB.
-  Builder.CreateBr(LoopBB);
+/// emitCall - Emit a call to CalleeF.  While profiling, a call to another user
+/// definition loads its target from the callee's CallSlot instead of binding to
+/// the symbol, so that reoptimized versions take effect in existing callers.
+static CallInst *emitCall(Function *CalleeF, ArrayRef<Value *> Args,
+                          const Twine &Name) {
+  CallSlot *Slot = nullptr;
+  if (Profiles && CalleeF->isDeclaration())
+    Slot = Profiles->findSlot(CalleeF->getName());
+
+  if (isInstrumenting() && CalleeF->isDeclaration()) {
+    // Remember whether running this definition can have visible effects, so
+    // the report knows whether it is safe to time it.
+    FunctionProfile *Callee = Profiles->findCurrent(CalleeF->getName());
+    if (!Slot || !Callee || Callee->CallsExterns)
+      CurProfile->CallsExterns = true;
+  }
 
-  // Start insertion in LoopBB.
-  Builder.SetInsertPoint(LoopBB);
+  if (!Slot)
+    return Builder->CreateCall(CalleeF, Args, Name);
 
-  // Within the loop, the variable is defined equal to the PHI node.  If it
-  // shadows an existing variable, we have to restore it, so save it now.
-  AllocaInst *OldVal = NamedValues[VarName];
-  NamedValues[VarName] = Alloca;
+  // The reoptimizer thread stores to the slot while this code runs.
+  Value *Target = emitRelaxedLoad(
+      emitProfileAddress(&Slot->Address, Builder->getInt64Ty()), "slot");
+  Target = Builder->CreateIntToPtr(Target, CalleeF->getType());
+  return Builder->CreateCall(Target, Args, Name);
+}
 
-  // Emit the body of the loop.  This, like any other expr, can change the
-  // current BB.  Note that we ignore the value computed by the body, but don't
-  // allow an error.
-  if (!Body->codegen())
-    return nullptr;
+//===----------------------------------------------------------------------===//
+// Compile-time evaluation
+//===----------------------------------------------------------------------===//
 
-  // Emit the step value.
-  Value *StepVal = nullptr;
-  if (Step) {
-    StepVal = Step->codegen();
-    if (!StepVal)
-      return nullptr;
-  } else {
-    // If not specified, use 1.0.
-    StepVal = ConstantFP::get(getGlobalContext(), APFloat(1.0));
+/// PureFunctions - Functions known to have no side effects and to depend only
+/// on their arguments: the libm functions users declare with extern, and every
+/// definition found pure by isPure.
+static thread_local std::set<std::string> PureFunctions = {
+    "sin",  "cos",  "tan",   "asin", "acos",  "atan", "atan2", "sinh",
+    "cosh", "tanh", "exp",   "exp2", "log",   "log2", "log10", "pow",
+    "sqrt", "cbrt", "fabs",  "floor", "ceil", "round", "trunc", "fmod",
+    "fmin", "fmax", "hypot"};
+
+/// DefinitionASTs - The AST of every current definition, to recompile it when
+/// a definition it inlined is replaced and to evaluate it at compile time.
+static thread_local std::map<std::string, std::shared_ptr<FunctionAST>>
+    DefinitionASTs;
+
+//===----------------------------------------------------------------------===//
+// Math library
+//===----------------------------------------------------------------------===//
+
+/// isLibmExtern - True if calls to Name go to the C library's libm function
+/// rather than to a definition of the program's own.
+static bool isLibmExtern(const std::string &Name) {
+  return PureFunctions.count(Name) && !DefinitionASTs.count(Name);
+}
+
+/// getMathIntrinsic - The intrinsic that computes the libm function Name of
+/// NumArgs doubles, or not_intrinsic.  Unlike the calls, intrinsics are known
+/// to the optimizer, which can fold, hoist and vectorize them, and some of
+/// them (sqrt, fabs, floor, ...) are single instructions.
+static Intrinsic::ID getMathIntrinsic(const std::string &Name,
+                                      unsigned NumArgs) {
+  static const std::map<std::string, std::pair<Intrinsic::ID, unsigned>>
+      Intrinsics = {{"sin", {Intrinsic::sin, 1}},
+                    {"cos", {Intrinsic::cos, 1}},
+                    {"exp", {Intrinsic::exp, 1}},
+                    {"exp2", {Intrinsic::exp2, 1}},
+                    {"log", {Intrinsic::log, 1}},
+                    {"log2", {Intrinsic::log2, 1}},
+                    {"log10", {Intrinsic::log10, 1}},
+                    {"sqrt", {Intrinsic::sqrt, 1}},
+                    {"fabs", {Intrinsic::fabs, 1}},
+                    {"floor", {Intrinsic::floor, 1}},
+                    {"ceil", {Intrinsic::ceil, 1}},
+                    {"round", {Intrinsic::round, 1}},
+                    {"trunc", {Intrinsic::trunc, 1}},
+                    {"pow", {Intrinsic::pow, 2}},
+                    {"fmin", {Intrinsic::minnum, 2}},
+                    {"fmax", {Intrinsic::maxnum, 2}}};
+  auto I = Intrinsics.find(Name);
+  if (I == Intrinsics.end() || I->second.second != NumArgs)
+    return Intrinsic::not_intrinsic;
+  return I->second.first;
+}
+
+/// VectorMathFunctions - The vector variants of libm functions the
+/// vectorizers may call, both for the libm names and for their intrinsics.
+/// Filled in once by initVectorMath, before any session starts.
+static std::vector<VecDesc> VectorMathFunctions;
+
+/// initVectorMath - Load glibc's libmvec and describe its variants for the
+/// host's widest vector ISA: _ZGV<isa>N<lanes><args>_<name>, where the ISA is
+/// b (SSE4), c (AVX), d (AVX2) or e (AVX-512).
+static void initVectorMath() {
+  Triple Host(sys::getProcessTriple());
+  if (!Libmvec || Host.getArch() != Triple::x86_64 || !Host.isOSLinux())
+    return;
+  if (sys::DynamicLibrary::LoadLibraryPermanently("libmvec.so.1"))
+    return;
+
+  StringMap<bool> Features;
+  sys::getHostCPUFeatures(Features);
+  std::vector<std::pair<char, unsigned>> ISAs = {{'b', 2}};
+  if (Features.lookup("avx512f"))
+    ISAs.push_back({'e', 8});
+  if (Features.lookup("avx2"))
+    ISAs.push_back({'d', 4});
+  else if (Features.lookup("avx"))
+    ISAs.push_back({'c', 4});
+
+  // The names must outlive the table.
+  static std::deque<std::string> Names;
+  auto Intern = [](const std::string &S) {
+    Names.push_back(S);
+    return Names.back().c_str();
+  };
+  static const std::pair<const char *, const char *> Functions[] = {
+      {"sin", "v"}, {"cos", "v"}, {"exp", "v"}, {"log", "v"}, {"pow", "vv"}};
+  // The float variants (sinf, ...) have twice the lanes, for -float32.
+  for (auto &ISA : ISAs)
+    for (auto &F : Functions)
+      for (bool Float : {false, true}) {
+        unsigned Lanes = Float ? 2 * ISA.second : ISA.second;
+        std::string Scalar = std::string(F.first) + (Float ? "f" : "");
+        const char *VectorName =
+            Intern(std::string("_ZGV") + ISA.first + "N" +
+                   std::to_string(Lanes) + F.second + "_" + Scalar);
+        VectorMathFunctions.push_back({Intern(Scalar), VectorName, Lanes});
+        VectorMathFunctions.push_back(
+            {Intern(std::string("llvm.") + F.first + (Float ? ".f32" : ".f64")),
+             VectorName, Lanes});
+      }
+}
+
+/// addTargetLibraryInfo - Tell the passes in PM about the host's C library,
+/// including the vector math functions.
+static void addTargetLibraryInfo(legacy::PassManagerBase &PM) {
+  TargetLibraryInfoImpl TLII(TheJIT->getTargetMachine().getTargetTriple());
+  TLII.addVectorizableFunctions(VectorMathFunctions);
+  PM.add(new TargetLibraryInfoWrapperPass(TLII));
+}
+
+namespace {
+/// ConstEvaluator - Interprets pure definitions on constant arguments, with
+/// the semantics of the code they compile to, until it runs out of steps.
+/// Results of calls are cached by argument bits, which is sound because only
+/// pure functions are called.
+class ConstEvaluator {
+  uint64_t StepsLeft;
+  unsigned Depth = 0;
+  std::map<std::pair<std::string, std::vector<uint64_t>>, double> Cache;
+
+public:
+  std::map<std::string, double> Vars;
+
+  explicit ConstEvaluator(uint64_t Steps) : StepsLeft(Steps) {}
+
+  bool step() {
+    if (!StepsLeft)
+      return false;
+    --StepsLeft;
+    return true;
   }
 
-  // Compute the end condition.
-  Value *EndCond = End->codegen();
-  if (!EndCond)
-    return nullptr;
+  bool call(const std::string &Callee, const std::vector<double> &Args,
+            double &Result);
+};
+} // end anonymous namespace
+
+/// MaxEvalDepth - Calls nested deeper than this are left to run time, to keep
+/// the evaluator within the compiler's own stack.
+static const unsigned MaxEvalDepth = 2000;
+
+/// callLibm - Evaluate a libm function the program declared with extern.
+static bool callLibm(const std::string &Name, const std::vector<double> &A,
+                     double &Result) {
+  typedef double (*UnaryFn)(double);
+  typedef double (*BinaryFn)(double, double);
+  static const std::map<std::string, UnaryFn> Unary = {
+      {"sin", ::sin},     {"cos", ::cos},     {"tan", ::tan},
+      {"asin", ::asin},   {"acos", ::acos},   {"atan", ::atan},
+      {"sinh", ::sinh},   {"cosh", ::cosh},   {"tanh", ::tanh},
+      {"exp", ::exp},     {"exp2", ::exp2},   {"log", ::log},
+      {"log2", ::log2},   {"log10", ::log10}, {"sqrt", ::sqrt},
+      {"cbrt", ::cbrt},   {"fabs", ::fabs},   {"floor", ::floor},
+      {"ceil", ::ceil},   {"round", ::round}, {"trunc", ::trunc}};
+  static const std::map<std::string, BinaryFn> Binary = {
+      {"atan2", ::atan2}, {"pow", ::pow},     {"fmod", ::fmod},
+      {"fmin", ::fmin},   {"fmax", ::fmax},   {"hypot", ::hypot}};
+
+  if (A.size() == 1) {
+    auto I = Unary.find(Name);
+    if (I == Unary.end())
+      return false;
+    Result = I->second(A[0]);
+    return true;
+  }
+  if (A.size() == 2) {
+    auto I = Binary.find(Name);
+    if (I == Binary.end())
+      return false;
+    Result = I->second(A[0], A[1]);
+    return true;
+  }
+  return false;
+}
+
+bool ConstEvaluator::call(const std::string &Callee,
+                          const std::vector<double> &Args, double &Result) {
+  if (!step() || !PureFunctions.count(Callee))
+    return false;
+
+  auto Def = DefinitionASTs.find(Callee);
+  if (Def == DefinitionASTs.end())
+    return callLibm(Callee, Args, Result);
+  // Typed definitions convert and wrap in ways this double interpreter does
+  // not model.
+  const FunctionAST &F = *Def->second;
+  const std::vector<std::string> &Params = F.getProto().getArgs();
+  if (Params.size() != Args.size() || Depth == MaxEvalDepth ||
+      F.getProto().isTyped())
+    return false;
+
+  std::vector<uint64_t> Key(Args.size());
+  memcpy(Key.data(), Args.data(), Args.size() * sizeof(double));
+  auto Cached = Cache.find(std::make_pair(Callee, Key));
+  if (Cached != Cache.end()) {
+    Result = Cached->second;
+    return true;
+  }
+
+  std::map<std::string, double> CallerVars;
+  std::swap(CallerVars, Vars);
+  for (unsigned i = 0, e = Params.size(); i != e; ++i)
+    Vars[Params[i]] = Args[i];
+  ++Depth;
+  bool Ok = F.getBody().evaluate(*this, Result);
+  --Depth;
+  std::swap(CallerVars, Vars);
+
+  if (Ok)
+    Cache[std::make_pair(Callee, Key)] = Result;
+  return Ok;
+}
+
+/// isTrue - Conditions test "ordered and not equal to 0.0", as the fcmp one
+/// that if and for compile to.
+static bool isTrue(double V) { return V != 0.0 && !std::isnan(V); }
+
+/// isBuiltinNot - True if unary Opcode is the built-in logical not, which a
+/// program can still replace with its own "def unary!".
+static bool isBuiltinNot(char Opcode) {
+  return Opcode == '!' && !FunctionProtos.find("unary!");
+}
+
+/// getReduceIdentity - The result of a reduction over no elements.
+static double getReduceIdentity(ReduceKind Kind) {
+  switch (Kind) {
+  case RK_Min:
+    return INFINITY;
+  case RK_Max:
+    return -INFINITY;
+  default:
+    return 0.0;
+  }
+}
+
+/// combineReduced - Fold X into Acc the way emitReduceStep does: min and max
+/// skip NaNs.
+static double combineReduced(ReduceKind Kind, double Acc, double X) {
+  switch (Kind) {
+  case RK_Min:
+    return X < Acc ? X : Acc;
+  case RK_Max:
+    return X > Acc ? X : Acc;
+  default:
+    return Acc + X;
+  }
+}
+
+bool NumberExprAST::evaluate(ConstEvaluator &E, double &Result) const {
+  Result = Val;
+  return E.step();
+}
+
+bool VariableExprAST::evaluate(ConstEvaluator &E, double &Result) const {
+  auto I = E.Vars.find(Name);
+  if (I == E.Vars.end())
+    return false;
+  Result = I->second;
+  return E.step();
+}
+
+bool UnaryExprAST::evaluate(ConstEvaluator &E, double &Result) const {
+  double V;
+  if (!Operand->evaluate(E, V))
+    return false;
+  if (isBuiltinNot(Opcode)) {
+    Result = isTrue(V) ? 0.0 : 1.0;
+    return E.step();
+  }
+  return E.call(std::string("unary") + Opcode, {V}, Result);
+}
+
+bool LogicalExprAST::evaluate(ConstEvaluator &E, double &Result) const {
+  double L, R;
+  if (!LHS->evaluate(E, L) || !E.step())
+    return false;
+  // LHS false decides "&&", LHS true decides "||".
+  if (isTrue(L) != IsAnd) {
+    Result = IsAnd ? 0.0 : 1.0;
+    return true;
+  }
+  if (!RHS->evaluate(E, R))
+    return false;
+  Result = isTrue(R) ? 1.0 : 0.0;
+  return true;
+}
+
+bool BinaryExprAST::evaluate(ConstEvaluator &E, double &Result) const {
+  if (Op == '=') {
+    const std::string *Name = LHS->getVariableName();
+    if (!Name)
+      return false;
+    auto I = E.Vars.find(*Name);
+    if (I == E.Vars.end() || !RHS->evaluate(E, Result))
+      return false;
+    I->second = Result;
+    return true;
+  }
+
+  double L, R;
+  if (!LHS->evaluate(E, L) || !RHS->evaluate(E, R) || !E.step())
+    return false;
+  switch (Op) {
+  case '+':
+    Result = L + R;
+    return true;
+  case '-':
+    Result = L - R;
+    return true;
+  case '*':
+    Result = L * R;
+    return true;
+  case '<':
+    // fcmp ult: true if unordered, too.
+    Result = (L < R || std::isnan(L) || std::isnan(R)) ? 1.0 : 0.0;
+    return true;
+  default:
+    return E.call(std::string("binary") + Op, {L, R}, Result);
+  }
+}
+
+bool CallExprAST::evaluate(ConstEvaluator &E, double &Result) const {
+  std::vector<double> ArgVals(Args.size());
+  for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    if (!Args[i]->evaluate(E, ArgVals[i]))
+      return false;
+  return E.call(Callee, ArgVals, Result);
+}
+
+bool IfExprAST::evaluate(ConstEvaluator &E, double &Result) const {
+  double C;
+  if (!Cond->evaluate(E, C))
+    return false;
+  return (isTrue(C) ? Then : Else)->evaluate(E, Result);
+}
+
+bool ForExprAST::evaluate(ConstEvaluator &E, double &Result) const {
+  double Cur;
+  if (!Start->evaluate(E, Cur))
+    return false;
+
+  auto Old = E.Vars.find(VarName);
+  bool HadOld = Old != E.Vars.end();
+  double OldVal = HadOld ? Old->second : 0.0;
+
+  // Same order as the loop codegen emits: body, step, end condition, then
+  // the increment.
+  E.Vars[VarName] = Cur;
+  bool Ok;
+  while (true) {
+    double Ignored, StepVal = 1.0, EndCond;
+    Ok = Body->evaluate(E, Ignored) && (!Step || Step->evaluate(E, StepVal)) &&
+         End->evaluate(E, EndCond);
+    if (!Ok)
+      break;
+    E.Vars[VarName] += StepVal;
+    if (!isTrue(EndCond))
+      break;
+  }
+
+  if (HadOld)
+    E.Vars[VarName] = OldVal;
+  else
+    E.Vars.erase(VarName);
+  Result = 0.0;
+  return Ok;
+}
+
+bool ReduceExprAST::evaluate(ConstEvaluator &E, double &Result) const {
+  double Cur;
+  if (!Start->evaluate(E, Cur))
+    return false;
+
+  auto Old = E.Vars.find(VarName);
+  bool HadOld = Old != E.Vars.end();
+  double OldVal = HadOld ? Old->second : 0.0;
+
+  // Same order as the codegen: end condition, then body, step and increment;
+  // in strict order, which -fast-reductions allows but does not require.
+  E.Vars[VarName] = Cur;
+  double Acc = getReduceIdentity(Kind);
+  bool Ok;
+  while (true) {
+    double EndCond, X, StepVal = 1.0;
+    Ok = End->evaluate(E, EndCond);
+    if (!Ok || !isTrue(EndCond))
+      break;
+    Ok = Body->evaluate(E, X) && (!Step || Step->evaluate(E, StepVal));
+    if (!Ok)
+      break;
+    Acc = combineReduced(Kind, Acc, X);
+    E.Vars[VarName] += StepVal;
+  }
+
+  if (HadOld)
+    E.Vars[VarName] = OldVal;
+  else
+    E.Vars.erase(VarName);
+  Result = Acc;
+  return Ok;
+}
+
+bool VarExprAST::evaluate(ConstEvaluator &E, double &Result) const {
+  for (ValueType Ty : VarTypes)
+    if (Ty != VT_Double)
+      return false;
+
+  std::vector<std::pair<bool, double>> OldBindings;
+  bool Ok = true;
+  unsigned Bound = 0;
+  for (auto &Var : VarNames) {
+    double InitVal = 0.0;
+    if (Var.second && !Var.second->evaluate(E, InitVal)) {
+      Ok = false;
+      break;
+    }
+    auto Old = E.Vars.find(Var.first);
+    OldBindings.push_back(Old == E.Vars.end()
+                              ? std::make_pair(false, 0.0)
+                              : std::make_pair(true, Old->second));
+    E.Vars[Var.first] = InitVal;
+    ++Bound;
+  }
+  if (Ok)
+    Ok = Body->evaluate(E, Result);
+
+  // Unbind in reverse, so a name bound twice gets its outer value back.
+  while (Bound--) {
+    if (OldBindings[Bound].first)
+      E.Vars[VarNames[Bound].first] = OldBindings[Bound].second;
+    else
+      E.Vars.erase(VarNames[Bound].first);
+  }
+  return Ok;
+}
+
+//===----------------------------------------------------------------------===//
+// AST simplification (-simplify)
+//===----------------------------------------------------------------------===//
+
+// Before a definition or top-level expression is compiled its AST is folded
+// and canonicalized: constant subtrees of the built-in operators become
+// literals, x*1, x-0 and the like become x, and an if whose condition is a
+// constant becomes the branch it takes.  The rewrites are exact in IEEE
+// arithmetic (x+0 is not x when x is -0, so it is only dropped for ints and in
+// fast code), and keep the static type of every expression, so that int
+// arithmetic stays int and doubles stay doubles.
+
+namespace {
+/// Simplifier - The static types of the variables in scope while a definition
+/// is simplified.  Variables of for and reduction loops are ints or doubles
+/// depending on how codegen finds their start value, so their type is unknown.
+class Simplifier {
+  std::vector<std::pair<SymbolId, Optional<ValueType>>> Vars;
+
+public:
+  FPMode Mode;
+
+  explicit Simplifier(FPMode Mode) : Mode(Mode) {}
+
+  size_t getScope() const { return Vars.size(); }
+  void bind(SymbolId Id, Optional<ValueType> Ty) {
+    Vars.push_back(std::make_pair(Id, Ty));
+  }
+  void popScope(size_t Scope) { Vars.resize(Scope); }
+
+  Optional<ValueType> lookup(SymbolId Id) const {
+    for (auto I = Vars.rbegin(), E = Vars.rend(); I != E; ++I)
+      if (I->first == Id)
+        return I->second;
+    return None;
+  }
+};
+
+/// SimplifyCountsT - What -simplify did, and the IR that was left, for
+/// -simplify-stats.
+struct SimplifyCountsT {
+  uint64_t Constants = 0;       // Constant subtrees folded.
+  uint64_t Identities = 0;      // x*1, x-0, ... reduced to x.
+  uint64_t Branches = 0;        // ifs with a constant condition.
+  uint64_t Negations = 0;       // -(-x) through a user unary-.
+  uint64_t EmittedInstrs = 0;   // Before the function pass pipeline.
+  uint64_t OptimizedInstrs = 0; // After it.
+};
+} // end anonymous namespace
+
+static thread_local SimplifyCountsT SimplifyCounts;
+
+static Optional<ValueType> simplifyExpr(Simplifier &S,
+                                        std::unique_ptr<ExprAST> &E) {
+  return E->simplify(S, E);
+}
+
+/// makeBoolConstant - A bool constant: there is no literal for one, but a
+/// comparison of literals folds to it without emitting an instruction.
+static std::unique_ptr<ExprAST> makeBoolConstant(bool B) {
+  return llvm::make_unique<BinaryExprAST>(
+      '<', llvm::make_unique<NumberExprAST>(0.0),
+      llvm::make_unique<NumberExprAST>(B ? 1.0 : 0.0));
+}
+
+template <typename T> static double foldBuiltinOpIn(char Op, T L, T R) {
+  switch (Op) {
+  case '+':
+    return (T)(L + R);
+  case '-':
+    return (T)(L - R);
+  case '*':
+    return (T)(L * R);
+  default:
+    // fcmp ult: true if unordered, too.
+    return (L < R || std::isnan(L) || std::isnan(R)) ? 1.0 : 0.0;
+  }
+}
+
+/// foldBuiltinOp - L Op R for a built-in arithmetic operator or '<', rounded
+/// the way the code it replaces would be.
+static double foldBuiltinOp(char Op, double L, double R) {
+  return Float32 ? foldBuiltinOpIn<float>(Op, L, R)
+                 : foldBuiltinOpIn<double>(Op, L, R);
+}
+
+Optional<ValueType> VariableExprAST::simplify(Simplifier &S,
+                                              std::unique_ptr<ExprAST> &Self) {
+  return S.lookup(Id);
+}
+
+Optional<ValueType> IndexExprAST::simplify(Simplifier &S,
+                                           std::unique_ptr<ExprAST> &Self) {
+  simplifyExpr(S, Index);
+  return VT_Double;
+}
+
+Optional<ValueType> ReduceExprAST::simplify(Simplifier &S,
+                                            std::unique_ptr<ExprAST> &Self) {
+  simplifyExpr(S, Start);
+  size_t Scope = S.getScope();
+  S.bind(VarId, None);
+  simplifyExpr(S, End);
+  if (Step)
+    simplifyExpr(S, Step);
+  simplifyExpr(S, Body);
+  S.popScope(Scope);
+  return VT_Double;
+}
+
+Optional<ValueType> ParForExprAST::simplify(Simplifier &S,
+                                            std::unique_ptr<ExprAST> &Self) {
+  simplifyExpr(S, Start);
+  simplifyExpr(S, Bound);
+  size_t Scope = S.getScope();
+  S.bind(VarId, VT_Int);
+  simplifyExpr(S, Body);
+  S.popScope(Scope);
+  return VT_Double;
+}
+
+Optional<ValueType> UnaryExprAST::simplify(Simplifier &S,
+                                           std::unique_ptr<ExprAST> &Self) {
+  simplifyExpr(S, Operand);
+  return isBuiltinNot(Opcode) ? VT_Bool : VT_Double;
+}
+
+bool BinaryExprAST::getNumber(double &V) const {
+  double L, R;
+  if (Op != '<' || !LHS->getNumber(L) || !RHS->getNumber(R))
+    return false;
+  V = foldBuiltinOp(Op, L, R);
+  return true;
+}
+
+bool BinaryExprAST::isNegationOf(const std::string &Var) const {
+  double L;
+  const std::string *Name = RHS->getVariableName();
+  return Op == '-' && LHS->getNumber(L) && L == 0.0 && !std::signbit(L) &&
+         Name && *Name == Var;
+}
+
+Optional<ValueType> BinaryExprAST::simplify(Simplifier &S,
+                                            std::unique_ptr<ExprAST> &Self) {
+  Optional<ValueType> LTy = simplifyExpr(S, LHS);
+  Optional<ValueType> RTy = simplifyExpr(S, RHS);
+  if (Op == '=')
+    return LTy;
+  if (Op == '<')
+    return VT_Bool;
+  if (Op != '+' && Op != '-' && Op != '*')
+    return VT_Double; // A call of a user-defined operator.
+
+  double L, R;
+  bool LConst = LHS->getNumber(L), RConst = RHS->getNumber(R);
+  if (LConst && RConst) {
+    ++SimplifyCounts.Constants;
+    Self = llvm::make_unique<NumberExprAST>(foldBuiltinOp(Op, L, R));
+    return VT_Double;
+  }
+
+  // x op c is x if the type of x (an int or a double, but not a bool, which
+  // the arithmetic would make a double) stays the same.
+  auto Keep = [&](std::unique_ptr<ExprAST> &X, Optional<ValueType> Ty,
+                  bool Exact) -> bool {
+    if (!Ty || *Ty == VT_Bool || !(Exact || *Ty == VT_Int))
+      return false;
+    ++SimplifyCounts.Identities;
+    std::unique_ptr<ExprAST> Kept = std::move(X);
+    Self = std::move(Kept); // Destroys this node.
+    return true;
+  };
+  // The constant must be a literal: a comparison is a bool, which would make
+  // int arithmetic double.
+  bool LLit = LConst && *LTy == VT_Double, RLit = RConst && *RTy == VT_Double;
+  bool Fast = S.Mode == FP_Fast;
+  switch (Op) {
+  case '*':
+    if (RLit && R == 1.0 && Keep(LHS, LTy, true))
+      return LTy;
+    if (LLit && L == 1.0 && Keep(RHS, RTy, true))
+      return RTy;
+    break;
+  case '-':
+    // x - 0 is x, even for -0; x - -0 is x + 0.
+    if (RLit && R == 0.0 && Keep(LHS, LTy, !std::signbit(R) || Fast))
+      return LTy;
+    break;
+  case '+':
+    // x + -0 is x, even for -0; x + 0 is not.
+    if (RLit && R == 0.0 && Keep(LHS, LTy, std::signbit(R) || Fast))
+      return LTy;
+    if (LLit && L == 0.0 && Keep(RHS, RTy, std::signbit(L) || Fast))
+      return RTy;
+    break;
+  }
+
+  // An int meets an int, or an integral literal, in integer arithmetic.  Any
+  // other double operand might still turn out a constant (a pure call on
+  // constants is folded in codegen), so the type of the result is only known
+  // for a literal.
+  if (!LTy || !RTy)
+    return None;
+  if (*LTy == VT_Int && *RTy == VT_Int)
+    return VT_Int;
+  if (*LTy == VT_Int || *RTy == VT_Int) {
+    if (*LTy == VT_Bool || *RTy == VT_Bool)
+      return VT_Double;
+    double C;
+    if (!(*LTy == VT_Int ? RHS : LHS)->getNumber(C))
+      return None;
+    return C == std::trunc(C) && std::fabs(C) < 9.2e18 ? VT_Int : VT_Double;
+  }
+  return VT_Double;
+}
+
+Optional<ValueType> LogicalExprAST::simplify(Simplifier &S,
+                                             std::unique_ptr<ExprAST> &Self) {
+  simplifyExpr(S, LHS);
+  simplifyExpr(S, RHS);
+  // A constant left-hand side that decides the result leaves the right-hand
+  // side unevaluated.
+  double L;
+  if (LHS->getNumber(L) && isTrue(L) != IsAnd) {
+    ++SimplifyCounts.Constants;
+    Self = makeBoolConstant(!IsAnd);
+  }
+  return VT_Bool;
+}
+
+Optional<ValueType> CallExprAST::simplify(Simplifier &S,
+                                          std::unique_ptr<ExprAST> &Self) {
+  for (auto &Arg : Args)
+    simplifyExpr(S, Arg);
+  return VT_Double;
+}
+
+Optional<ValueType> IfExprAST::simplify(Simplifier &S,
+                                        std::unique_ptr<ExprAST> &Self) {
+  simplifyExpr(S, Cond);
+  Optional<ValueType> ThenTy = simplifyExpr(S, Then);
+  Optional<ValueType> ElseTy = simplifyExpr(S, Else);
+  if (!ThenTy || !ElseTy)
+    return None;
+  // Branches of different types meet as doubles, so the one taken can only
+  // stand for the whole if when they agree.
+  double C;
+  if (*ThenTy == *ElseTy && Cond->getNumber(C)) {
+    ++SimplifyCounts.Branches;
+    std::unique_ptr<ExprAST> Taken = std::move(isTrue(C) ? Then : Else);
+    Self = std::move(Taken); // Destroys this node.
+    return ThenTy;
+  }
+  return *ThenTy == *ElseTy ? ThenTy : Optional<ValueType>(VT_Double);
+}
+
+Optional<ValueType> ForExprAST::simplify(Simplifier &S,
+                                         std::unique_ptr<ExprAST> &Self) {
+  simplifyExpr(S, Start);
+  size_t Scope = S.getScope();
+  S.bind(VarId, None);
+  simplifyExpr(S, End);
+  if (Step)
+    simplifyExpr(S, Step);
+  simplifyExpr(S, Body);
+  S.popScope(Scope);
+  return VT_Double;
+}
+
+Optional<ValueType> VarExprAST::simplify(Simplifier &S,
+                                         std::unique_ptr<ExprAST> &Self) {
+  size_t Scope = S.getScope();
+  for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
+    if (VarNames[i].second)
+      simplifyExpr(S, VarNames[i].second);
+    S.bind(VarIds[i], VarTypes[i]);
+  }
+  Optional<ValueType> Ty = simplifyExpr(S, Body);
+  S.popScope(Scope);
+  return Ty;
+}
+
+/// simplify - Simplify the body, for the parameters' declared types and the
+/// definition's floating point mode.
+void FunctionAST::simplify() {
+  Simplifier S(Mode);
+  for (unsigned i = 0, e = Proto->getArgs().size(); i != e; ++i)
+    S.bind(Proto->getArgId(i), Proto->getArgType(i));
+  simplifyExpr(S, Body);
+}
+
+/// isUserNegation - True if unary- is currently a definition "0 - v", which
+/// makes -(-x) the same as 0 + x: both are x, except that -0 becomes +0.
+static bool isUserNegation() {
+  auto Def = DefinitionASTs.find("unary-");
+  if (Def == DefinitionASTs.end() || ExternFunctions.count("unary-"))
+    return false;
+  const PrototypeAST &P = Def->second->getProto();
+  return !P.isTyped() && P.getArgs().size() == 1 &&
+         Def->second->getBody().isNegationOf(P.getArgs()[0]);
+}
+
+/// reportSimplifyStats - Print what -simplify did and the IR that was emitted.
+static void reportSimplifyStats() {
+  const SimplifyCountsT &St = SimplifyCounts;
+  fprintf(stderr,
+          "simplify: %llu constants folded, %llu identities, %llu constant "
+          "branches, %llu double negations removed\n",
+          (unsigned long long)St.Constants, (unsigned long long)St.Identities,
+          (unsigned long long)St.Branches, (unsigned long long)St.Negations);
+  fprintf(stderr,
+          "simplify: %llu IR instructions emitted, %llu after optimization\n",
+          (unsigned long long)St.EmittedInstrs,
+          (unsigned long long)St.OptimizedInstrs);
+}
+
+/// foldPureCall - If every argument is a constant and Callee is pure, evaluate
+/// the call now and return its result as a constant.  The evaluator computes in
+/// doubles, so float code is left alone.
+static Value *foldPureCall(const std::string &Callee, ArrayRef<Value *> ArgsV) {
+  if (!ConstEvalSteps || Float32)
+    return nullptr;
+  std::vector<double> Args;
+  for (Value *V : ArgsV) {
+    ConstantFP *C = dyn_cast<ConstantFP>(V);
+    if (!C)
+      return nullptr;
+    Args.push_back(C->getValueAPF().convertToDouble());
+  }
+
+  ConstEvaluator E(ConstEvalSteps);
+  double Result;
+  if (!E.call(Callee, Args, Result))
+    return nullptr;
+  return ConstantFP::get(*TheContext, APFloat(Result));
+}
+
+/// emitSpecializedCall - Call the specialization in SC if the guarded arguments
+/// have the values it was compiled for (compared bitwise, so -0.0 and NaNs are
+/// told apart) and it has not been evicted; call CalleeF otherwise.
+static Value *emitSpecializedCall(const SpecializedCall &SC, Function *CalleeF,
+                                  ArrayRef<Value *> ArgsV) {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  Type *I64 = Builder->getInt64Ty();
+
+  Value *Target =
+      emitRelaxedLoad(emitProfileAddress(&SC.Slot->Address, I64), "spec");
+  Value *Guard = Builder->CreateICmpNE(Target, Builder->getInt64(0), "live");
+  for (auto &G : SC.Guards) {
+    uint64_t Bits;
+    memcpy(&Bits, &G.second, sizeof(Bits));
+    Value *Arg = Builder->CreateBitCast(ArgsV[G.first], I64, "argbits");
+    Guard = Builder->CreateAnd(
+        Guard, Builder->CreateICmpEQ(Arg, Builder->getInt64(Bits)), "guard");
+  }
+
+  BasicBlock *SpecBB = BasicBlock::Create(*TheContext, "spec", TheFunction);
+  BasicBlock *GenericBB = BasicBlock::Create(*TheContext, "generic");
+  BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "speccont");
+  Builder->CreateCondBr(Guard, SpecBB, GenericBB);
+
+  Builder->SetInsertPoint(SpecBB);
+  Value *SpecV = Builder->CreateCall(
+      Builder->CreateIntToPtr(Target, CalleeF->getType()), ArgsV, "speccall");
+  Builder->CreateBr(MergeBB);
+  SpecBB = Builder->GetInsertBlock();
+
+  TheFunction->getBasicBlockList().push_back(GenericBB);
+  Builder->SetInsertPoint(GenericBB);
+  Value *GenericV = emitCall(CalleeF, ArgsV, "calltmp");
+  Builder->CreateBr(MergeBB);
+  GenericBB = Builder->GetInsertBlock();
+
+  TheFunction->getBasicBlockList().push_back(MergeBB);
+  Builder->SetInsertPoint(MergeBB);
+  PHINode *PN = Builder->CreatePHI(getNumTy(), 2, "spectmp");
+  PN->addIncoming(SpecV, SpecBB);
+  PN->addIncoming(GenericV, GenericBB);
+  return PN;
+}
+
+Value *NumberExprAST::codegen() {
+  return ConstantFP::get(getNumTy(), Val);
+}
+
+Value *VariableExprAST::codegen() {
+  // Look this variable up in the function.
+  Value *V = NamedValues.lookup(Id);
+  if (!V)
+    return ErrorV("Unknown variable name");
+
+  // Load the value.
+  return Builder->CreateLoad(V, Name.c_str());
+}
+
+Value *ExprAST::codegenAssign(Value *Val) {
+  return ErrorV("destination of '=' must be a variable or array element");
+}
+
+Value *VariableExprAST::codegenAssign(Value *Val) {
+  // Look up the name.
+  AllocaInst *Variable = NamedValues.lookup(Id);
+  if (!Variable)
+    return ErrorV("Unknown variable name");
+
+  Val = convertValue(Val, Variable->getAllocatedType());
+  Builder->CreateStore(Val, Variable);
+  return Val;
+}
+
+//===----------------------------------------------------------------------===//
+// Host arrays
+//===----------------------------------------------------------------------===//
+
+// An "extern array" names memory the host owns.  Code reaches it through a
+// descriptor (data pointer and length) that the array's symbol resolves to,
+// so elements are never copied and rebinding the array needs no recompile.
+
+namespace {
+/// KaleidoscopeArray - The descriptor of one host array.
+struct KaleidoscopeArray {
+  void *Data;
+  int64_t Length;
+};
+} // end anonymous namespace
+
+/// HostArrays - Every array the host has bound, shared by all sessions.
+static std::mutex HostArraysLock;
+static std::map<std::string, std::unique_ptr<KaleidoscopeArray>> HostArrays;
+
+/// getArraySymbol - The symbol Name's descriptor is found under.
+static std::string getArraySymbol(const std::string &Name) {
+  return Name + ".array";
+}
+
+/// getElementSize - The size of an array element: a double, or a float with
+/// -float32.
+static size_t getElementSize() {
+  return Float32 ? sizeof(float) : sizeof(double);
+}
+
+/// bindHostArray - Let code declaring "extern array Name" use the Length
+/// numbers at Data.  Rebinding takes effect for code that runs afterwards.
+static void bindHostArray(const std::string &Name, void *Data, size_t Length) {
+  std::lock_guard<std::mutex> Guard(HostArraysLock);
+  auto &A = HostArrays[Name];
+  if (!A) {
+    A = llvm::make_unique<KaleidoscopeArray>();
+    sys::DynamicLibrary::AddSymbol(getArraySymbol(Name), A.get());
+  }
+  A->Data = Data;
+  A->Length = Length;
+}
+
+static bool isHostArray(const std::string &Name) {
+  std::lock_guard<std::mutex> Guard(HostArraysLock);
+  return HostArrays.count(Name);
+}
+
+/// bindCommandLineArrays - Bind the arrays given with -bind and -array.  The
+/// memory stays mapped for the life of the process.
+static bool bindCommandLineArrays() {
+  for (const std::string &Arg : BindFiles) {
+    size_t Eq = Arg.find('=');
+    if (Eq == std::string::npos || !Eq) {
+      fprintf(stderr, "Error: -bind expects NAME=PATH, got '%s'\n",
+              Arg.c_str());
+      return false;
+    }
+    std::string Path = Arg.substr(Eq + 1);
+    int FD = open(Path.c_str(), O_RDONLY);
+    struct stat St;
+    if (FD < 0 || fstat(FD, &St)) {
+      fprintf(stderr, "Error: cannot open %s: %s\n", Path.c_str(),
+              strerror(errno));
+      if (FD >= 0)
+        close(FD);
+      return false;
+    }
+    size_t Length = St.st_size / getElementSize();
+    void *Data = nullptr;
+    if (Length) {
+      Data = mmap(nullptr, Length * getElementSize(), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE, FD, 0);
+      if (Data == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map %s: %s\n", Path.c_str(),
+                strerror(errno));
+        close(FD);
+        return false;
+      }
+    }
+    close(FD);
+    bindHostArray(Arg.substr(0, Eq), Data, Length);
+  }
+
+  for (const std::string &Arg : NewArrays) {
+    size_t Eq = Arg.find('=');
+    char *End = nullptr;
+    unsigned long long Length =
+        Eq == std::string::npos ? 0 : strtoull(Arg.c_str() + Eq + 1, &End, 10);
+    if (Eq == std::string::npos || !Eq || !End || *End) {
+      fprintf(stderr, "Error: -array expects NAME=N, got '%s'\n", Arg.c_str());
+      return false;
+    }
+    void *Data = calloc(Length ? Length : 1, getElementSize());
+    if (!Data) {
+      fprintf(stderr, "Error: cannot allocate array %s\n", Arg.c_str());
+      return false;
+    }
+    bindHostArray(Arg.substr(0, Eq), Data, Length);
+  }
+  return true;
+}
+
+/// emitArrayField - Load field Idx (0 for the data pointer, 1 for the length)
+/// of the descriptor of Array.  The descriptor does not change while code
+/// runs, which lets LICM hoist these out of loops.
+static Value *emitArrayField(const std::string &Array, unsigned Idx) {
+  LLVMContext &C = *TheContext;
+  std::string Symbol = getArraySymbol(Array);
+  GlobalVariable *Desc = TheModule->getGlobalVariable(Symbol);
+  if (!Desc) {
+    Type *Fields[] = {getNumTy()->getPointerTo(), Type::getInt64Ty(C)};
+    Desc = new GlobalVariable(*TheModule, StructType::get(C, Fields), true,
+                              GlobalValue::ExternalLinkage, nullptr, Symbol);
+  }
+  Value *Indices[] = {Builder->getInt32(0), Builder->getInt32(Idx)};
+  LoadInst *Field = Builder->CreateLoad(
+      Builder->CreateInBoundsGEP(Desc, Indices),
+      Idx ? Array + ".len" : Array + ".data");
+  Field->setMetadata(LLVMContext::MD_invariant_load, MDNode::get(C, None));
+  return Field;
+}
+
+/// emitBoundsCheck - Branch to a new block, left as the insertion point, if
+/// Index is within Array; otherwise report the error in ErrBB and branch from
+/// there to FailBB.  Returns the element's address.  Int indices are checked with one unsigned
+/// compare, a form IRCE can remove from for loops; others are checked as
+/// doubles, since converting NaN or an out of range value to int is undefined,
+/// and truncated.
+static Value *emitBoundsCheck(const std::string &Array, Value *Index,
+                              BasicBlock *FailBB, BasicBlock *&ErrBB) {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  Value *Data = emitArrayField(Array, 0);
+  Value *Len = emitArrayField(Array, 1);
+
+  Value *InBounds;
+  Value *Reported = Index;
+  if (Index->getType()->isFloatingPointTy()) {
+    Value *Zero = ConstantFP::get(Index->getType(), 0.0);
+    InBounds = Builder->CreateAnd(
+        Builder->CreateFCmpOGE(Index, Zero),
+        Builder->CreateFCmpOLT(Index, toDouble(Len)), "inbounds");
+    Index = Builder->CreateFPToSI(Index, Builder->getInt64Ty(), "idx");
+  } else {
+    Index = convertValue(Index, Builder->getInt64Ty());
+    InBounds = Builder->CreateICmpULT(Index, Len, "inbounds");
+  }
+
+  BasicBlock *OkBB = BasicBlock::Create(*TheContext, "inbounds", TheFunction);
+  ErrBB = BasicBlock::Create(*TheContext, "outofbounds", TheFunction);
+  BranchInst *Br = Builder->CreateCondBr(InBounds, OkBB, ErrBB);
+  setBranchWeights(Br, 1 << 20, 0);
+
+  Builder->SetInsertPoint(ErrBB);
+  Function *Report = TheModule->getFunction("kaleidoscope_bounds_error");
+  if (!Report) {
+    Type *Params[] = {Builder->getDoubleTy(), Builder->getInt64Ty()};
+    Report = Function::Create(
+        FunctionType::get(Builder->getVoidTy(), Params, false),
+        Function::ExternalLinkage, "kaleidoscope_bounds_error", TheModule.get());
+    Report->addFnAttr(Attribute::Cold);
+  }
+  Value *Args[] = {
+      Builder->CreateFPCast(toDouble(Reported), Builder->getDoubleTy()), Len};
+  Builder->CreateCall(Report, Args);
+  Builder->CreateBr(FailBB);
+
+  Builder->SetInsertPoint(OkBB);
+  return Builder->CreateInBoundsGEP(Data, Index, Array + ".elt");
+}
+
+Value *IndexExprAST::codegen() {
+  if (!ArrayNames.count(Array))
+    return ErrorV("Unknown array name");
+  Value *IndexV = Index->codegen();
+  if (!IndexV)
+    return nullptr;
+
+  // An out of bounds read is reported and yields NaN.
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "eltcont");
+  BasicBlock *ErrBB;
+  Value *Ptr = emitBoundsCheck(Array, IndexV, MergeBB, ErrBB);
+  Value *Elt = Builder->CreateLoad(Ptr, Array + ".val");
+  Builder->CreateBr(MergeBB);
+  BasicBlock *OkBB = Builder->GetInsertBlock();
+
+  TheFunction->getBasicBlockList().push_back(MergeBB);
+  Builder->SetInsertPoint(MergeBB);
+  PHINode *PN = Builder->CreatePHI(getNumTy(), 2, "elt");
+  PN->addIncoming(Elt, OkBB);
+  PN->addIncoming(ConstantFP::getNaN(getNumTy()), ErrBB);
+  return PN;
+}
+
+Value *IndexExprAST::codegenAssign(Value *Val) {
+  if (!ArrayNames.count(Array))
+    return ErrorV("Unknown array name");
+  Value *IndexV = Index->codegen();
+  if (!IndexV)
+    return nullptr;
+
+  // An out of bounds store is reported and skipped.
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "storecont");
+  BasicBlock *ErrBB;
+  Val = toDouble(Val);
+  Builder->CreateStore(Val, emitBoundsCheck(Array, IndexV, MergeBB, ErrBB));
+  Builder->CreateBr(MergeBB);
+  TheFunction->getBasicBlockList().push_back(MergeBB);
+  Builder->SetInsertPoint(MergeBB);
+  return Val;
+}
+
+Value *LenExprAST::codegen() {
+  if (!ArrayNames.count(Array))
+    return ErrorV("Unknown array name");
+  return emitArrayField(Array, 1);
+}
+
+Value *UnaryExprAST::codegen() {
+  // -(-x) through a user "def unary-(v) 0 - v" is 0 + x.  This depends on the
+  // current unary-, so it is left to codegen rather than the AST simplifier.
+  ExprAST *Inner = Operand->getUnaryOperand('-');
+  if (Simplify && Opcode == '-' && Inner && isUserNegation()) {
+    Value *X = Inner->codegen();
+    if (!X)
+      return nullptr;
+    ++SimplifyCounts.Negations;
+    return Builder->CreateFAdd(ConstantFP::get(getNumTy(), 0.0), toDouble(X),
+                               "negnegtmp");
+  }
+
+  Value *OperandV = Operand->codegen();
+  if (!OperandV)
+    return nullptr;
+  if (isBuiltinNot(Opcode))
+    return Builder->CreateNot(convertValue(OperandV, Builder->getInt1Ty()),
+                              "nottmp");
+  OperandV = toDouble(OperandV);
+
+  Function *F = getFunction(std::string("unary") + Opcode);
+  if (!F)
+    return ErrorV("Unknown unary operator");
+
+  if (Value *V = foldPureCall(F->getName(), OperandV))
+    return V;
+  return emitCall(F, OperandV, "unop");
+}
+
+/// fuseMultiplyAdd - In contract mode, compile L + R or L - R where one side
+/// is a product just emitted for this expression as llvm.fmuladd, which the
+/// backend makes a single FMA, with one rounding, where the CPU has one.
+/// Returns null if there is no such product.  Fast mode leaves the fusing to
+/// the backend, since fmuladd would hide sums from the vectorizer.
+static Value *fuseMultiplyAdd(Value *L, Value *R, bool Subtract) {
+  if (CurFPMode != FP_Contract)
+    return nullptr;
+  auto AsProduct = [](Value *V) -> BinaryOperator * {
+    BinaryOperator *M = dyn_cast<BinaryOperator>(V);
+    return M && M->getOpcode() == Instruction::FMul && M->use_empty() ? M
+                                                                       : nullptr;
+  };
+
+  // a*b + c, a*b - c = fmuladd(a, b, -c), c + a*b, c - a*b = fmuladd(-a, b, c).
+  BinaryOperator *M = AsProduct(L);
+  Value *Addend = R;
+  bool NegateProduct = false;
+  if (M) {
+    if (Subtract)
+      Addend = Builder->CreateFNeg(R, "neg");
+  } else if ((M = AsProduct(R))) {
+    Addend = L;
+    NegateProduct = Subtract;
+  } else {
+    return nullptr;
+  }
+
+  Value *A = M->getOperand(0), *B = M->getOperand(1);
+  if (NegateProduct)
+    A = Builder->CreateFNeg(A, "neg");
+  Function *FMulAdd = Intrinsic::getDeclaration(
+      TheModule.get(), Intrinsic::fmuladd, getNumTy());
+  Value *Ops[] = {A, B, Addend};
+  Value *Fused = Builder->CreateCall(FMulAdd, Ops, "fmatmp");
+  M->eraseFromParent();
+  return Fused;
+}
+
+Value *BinaryExprAST::codegen() {
+  // Special case '=' because we don't want to emit the LHS as an expression.
+  if (Op == '=') {
+    // Codegen the RHS.
+    Value *Val = RHS->codegen();
+    if (!Val)
+      return nullptr;
+
+    // The LHS, a variable or an array element, knows how to store it.
+    return LHS->codegenAssign(Val);
+  }
+
+  Value *L = LHS->codegen();
+  Value *R = RHS->codegen();
+  if (!L || !R)
+    return nullptr;
+
+  // An int combines with an int or an integral constant in 64-bit integer
+  // arithmetic, which wraps on overflow; any other mix is computed in double.
+  Value *IntL = asIntOperand(L), *IntR = asIntOperand(R);
+  if (IntL && IntR &&
+      (L->getType()->isIntegerTy() || R->getType()->isIntegerTy())) {
+    switch (Op) {
+    case '+':
+      return Builder->CreateAdd(IntL, IntR, "addtmp");
+    case '-':
+      return Builder->CreateSub(IntL, IntR, "subtmp");
+    case '*':
+      return Builder->CreateMul(IntL, IntR, "multmp");
+    case '<':
+      return Builder->CreateICmpSLT(IntL, IntR, "cmptmp");
+    default:
+      break;
+    }
+  }
+
+  // Compare an int with a double in integers too: "i < n" is "i < ceil(n)" and
+  // "n < i" is "floor(n) < i".  The rounding is loop invariant when n is, which
+  // leaves loop exit tests that scalar evolution understands, and so loops the
+  // vectorizers can handle.
+  if (Op == '<' && L->getType()->isIntegerTy(64) &&
+      R->getType()->isFloatingPointTy())
+    return Builder->CreateICmpSLT(L, saturatingToInt(R, true), "cmptmp");
+  if (Op == '<' && L->getType()->isFloatingPointTy() &&
+      R->getType()->isIntegerTy(64))
+    return Builder->CreateICmpSLT(saturatingToInt(L, false), R, "cmptmp");
+  L = toDouble(L);
+  R = toDouble(R);
+
+  if (Op == '+' || Op == '-')
+    if (Value *Fused = fuseMultiplyAdd(L, R, Op == '-'))
+      return Fused;
+
+  switch (Op) {
+  case '+':
+    return Builder->CreateFAdd(L, R, "addtmp");
+  case '-':
+    return Builder->CreateFSub(L, R, "subtmp");
+  case '*':
+    return Builder->CreateFMul(L, R, "multmp");
+  case '<':
+    // A bool; it becomes 0.0 or 1.0 only where a double is needed.
+    return Builder->CreateFCmpULT(L, R, "cmptmp");
+  default:
+    break;
+  }
+
+  // If it wasn't a builtin binary operator, it must be a user defined one. Emit
+  // a call to it.
+  Function *F = getFunction(std::string("binary") + Op);
+  assert(F && "binary operator not found!");
+
+  Value *Ops[] = {L, R};
+  if (Value *V = foldPureCall(F->getName(), Ops))
+    return V;
+  return emitCall(F, Ops, "binop");
+}
+
+Value *CallExprAST::codegen() {
+  // Look up the name in the global module table.
+  Function *CalleeF = getFunction(Callee);
+  if (!CalleeF)
+    return ErrorV("Unknown function referenced");
+
+  // If argument mismatch error.
+  if (CalleeF->arg_size() != Args.size())
+    return ErrorV("Incorrect # arguments passed");
+
+  std::vector<Value *> ArgsV;
+  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+    ArgsV.push_back(Args[i]->codegen());
+    if (!ArgsV.back())
+      return nullptr;
+    ArgsV.back() = toDouble(ArgsV.back());
+  }
+
+  // A pure call on constants is just its result.
+  if (Value *V = foldPureCall(Callee, ArgsV))
+    return V;
+
+  if (isLibmExtern(Callee)) {
+    Intrinsic::ID IID = MathIntrinsics
+                            ? getMathIntrinsic(Callee, ArgsV.size())
+                            : Intrinsic::not_intrinsic;
+    CallInst *Call = Builder->CreateCall(
+        IID ? Intrinsic::getDeclaration(TheModule.get(), IID, getNumTy())
+            : CalleeF,
+        ArgsV, "calltmp");
+    // Fast code may approximate math functions too.
+    Call->setFastMathFlags(Builder->getFastMathFlags());
+    return Call;
+  }
+
+  if (isInstrumenting()) {
+    unsigned Site = getProfileSite(this, 1 + 2 * Args.size());
+    CallSiteProfile &CS = CurProfile->Calls[this];
+    CS.Callee = Callee;
+    CS.Counter = Site;
+    emitCounterIncrement(Site);
+    for (unsigned i = 0, e = ArgsV.size(); i != e; ++i) {
+      ConstantFP *C = dyn_cast<ConstantFP>(ArgsV[i]);
+      CS.IsLiteral.push_back(C != nullptr);
+      CS.Literal.push_back(C ? C->getValueAPF().convertToDouble() : 0.0);
+      if (!C)
+        emitValueProfile(Site + 1 + 2 * i, ArgsV[i]);
+    }
+  }
+
+  if (isOptimizingFromProfile()) {
+    auto I = SpecializedCalls.find(this);
+    if (I != SpecializedCalls.end())
+      return emitSpecializedCall(I->second, CalleeF, ArgsV);
+  }
+
+  CallInst *Call = emitCall(CalleeF, ArgsV, "calltmp");
+
+  // The reoptimizer compiles the hot callees of a function into the same
+  // module; have their hot call sites inlined.
+  if (isOptimizingFromProfile() && !CalleeF->isDeclaration() &&
+      CalleeF != Builder->GetInsertBlock()->getParent() &&
+      getProfileCount(this, 0) >= PGOHotCalls)
+    Call->addAttribute(AttributeSet::FunctionIndex, Attribute::AlwaysInline);
+  return Call;
+}
+
+Value *IfExprAST::codegen() {
+  Value *CondV = Cond->codegen();
+  if (!CondV)
+    return nullptr;
+
+  // Convert condition to a bool by comparing non-equal to 0.0; comparisons
+  // are bools already and branch directly.
+  CondV = convertValue(CondV, Builder->getInt1Ty());
+
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+  // Create blocks for the then and else cases.  Insert the 'then' block at the
+  // end of the function.
+  BasicBlock *ThenBB =
+      BasicBlock::Create(*TheContext, "then", TheFunction);
+  BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
+  BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "ifcont");
+
+  BranchInst *CondBr = Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+  unsigned Site = isInstrumenting() ? getProfileSite(this, 2) : 0;
+  if (isOptimizingFromProfile())
+    setBranchWeights(CondBr, getProfileCount(this, 0),
+                     getProfileCount(this, 1));
+
+  // Emit then value.
+  Builder->SetInsertPoint(ThenBB);
+  if (isInstrumenting())
+    emitCounterIncrement(Site);
+
+  Value *ThenV = Then->codegen();
+  if (!ThenV)
+    return nullptr;
+
+  Builder->CreateBr(MergeBB);
+  // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
+  ThenBB = Builder->GetInsertBlock();
+
+  // Emit else block.
+  TheFunction->getBasicBlockList().push_back(ElseBB);
+  Builder->SetInsertPoint(ElseBB);
+  if (isInstrumenting())
+    emitCounterIncrement(Site + 1);
+
+  Value *ElseV = Else->codegen();
+  if (!ElseV)
+    return nullptr;
+
+  Builder->CreateBr(MergeBB);
+  // Codegen of 'Else' can change the current block, update ElseBB for the PHI.
+  ElseBB = Builder->GetInsertBlock();
+
+  // Branches of different types meet as doubles.
+  if (ThenV->getType() != ElseV->getType()) {
+    Builder->SetInsertPoint(ThenBB->getTerminator());
+    ThenV = toDouble(ThenV);
+    Builder->SetInsertPoint(ElseBB->getTerminator());
+    ElseV = toDouble(ElseV);
+  }
+
+  // Emit merge block.
+  TheFunction->getBasicBlockList().push_back(MergeBB);
+  Builder->SetInsertPoint(MergeBB);
+  PHINode *PN = Builder->CreatePHI(ThenV->getType(), 2, "iftmp");
+
+  PN->addIncoming(ThenV, ThenBB);
+  PN->addIncoming(ElseV, ElseBB);
+  return PN;
+}
+
+// Output "L && R" as:
+//   lhs = lhsexpr
+//   br lhs, and.rhs, and.end
+// and.rhs:
+//   rhs = rhsexpr
+//   br and.end
+// and.end:
+//   phi [false, entry], [rhs, and.rhs]
+// and "||" the same way with the branch targets swapped.  The result is a
+// bool, so an if or for condition made of these branches on it directly.
+Value *LogicalExprAST::codegen() {
+  Value *L = LHS->codegen();
+  if (!L)
+    return nullptr;
+  L = convertValue(L, Builder->getInt1Ty());
+
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  BasicBlock *LHSBB = Builder->GetInsertBlock();
+  BasicBlock *RHSBB =
+      BasicBlock::Create(*TheContext, IsAnd ? "and.rhs" : "or.rhs", TheFunction);
+  BasicBlock *MergeBB =
+      BasicBlock::Create(*TheContext, IsAnd ? "and.end" : "or.end");
+
+  if (IsAnd)
+    Builder->CreateCondBr(L, RHSBB, MergeBB);
+  else
+    Builder->CreateCondBr(L, MergeBB, RHSBB);
+
+  Builder->SetInsertPoint(RHSBB);
+  Value *R = RHS->codegen();
+  if (!R)
+    return nullptr;
+  R = convertValue(R, Builder->getInt1Ty());
+  Builder->CreateBr(MergeBB);
+  // Codegen of 'RHS' can change the current block, update RHSBB for the PHI.
+  RHSBB = Builder->GetInsertBlock();
+
+  TheFunction->getBasicBlockList().push_back(MergeBB);
+  Builder->SetInsertPoint(MergeBB);
+  PHINode *PN = Builder->CreatePHI(Builder->getInt1Ty(), 2,
+                                   IsAnd ? "andtmp" : "ortmp");
+  PN->addIncoming(Builder->getInt1(!IsAnd), LHSBB);
+  PN->addIncoming(R, RHSBB);
+  return PN;
+}
+
+// Output for-loop as:
+//   var = alloca double
+//   ...
+//   start = startexpr
+//   store start -> var
+//   goto loop
+// loop:
+//   ...
+//   bodyexpr
+//   ...
+// loopend:
+//   step = stepexpr
+//   endcond = endexpr
+//
+//   curvar = load var
+//   nextvar = curvar + step
+//   store nextvar -> var
+//   br endcond, loop, endloop
+// outloop:
+Value *ForExprAST::codegen() {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+  // Emit the start code first, without 'variable' in scope.
+  Value *StartVal = Start->codegen();
+  if (!StartVal)
+    return nullptr;
+
+  // The variable is an int if it starts as an int or integral constant, steps
+  // by an integral constant and is never assigned in the loop.
+  bool IsInt = asIntOperand(StartVal) && (!Step || Step->isIntLiteral()) &&
+               !End->assigns(VarName) && !(Step && Step->assigns(VarName)) &&
+               !Body->assigns(VarName);
+
+  // Create an alloca for the variable in the entry block.
+  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName,
+                                              IsInt ? VT_Int : VT_Double);
+
+  // Store the value into the alloca.
+  Builder->CreateStore(IsInt ? asIntOperand(StartVal) : toDouble(StartVal),
+                       Alloca);
+
+  // Make the new basic block for the loop header, inserting after current
+  // block.
+  BasicBlock *LoopBB =
+      BasicBlock::Create(*TheContext, "loop", TheFunction);
+
+  // Count loop entries and iterations; their ratio is the trip count.
+  unsigned Site = isInstrumenting() ? getProfileSite(this, 2) : 0;
+  if (isInstrumenting())
+    emitCounterIncrement(Site);
+
+  // Insert an explicit fall through from the current block to the LoopBB.
+  Builder->CreateBr(LoopBB);
+
+  // Start insertion in LoopBB.
+  Builder->SetInsertPoint(LoopBB);
+  if (isInstrumenting())
+    emitCounterIncrement(Site + 1);
+
+  // Within the loop, the variable is defined equal to the PHI node.  It may
+  // shadow an existing variable until the scope is popped.
+  NamedValues.pushScope();
+  NamedValues.bind(VarId, Alloca);
+
+  // Emit the body of the loop.  This, like any other expr, can change the
+  // current BB.  Note that we ignore the value computed by the body, but don't
+  // allow an error.
+  if (!Body->codegen())
+    return nullptr;
+
+  // Emit the step value.
+  Value *StepVal = nullptr;
+  if (Step) {
+    StepVal = Step->codegen();
+    if (!StepVal)
+      return nullptr;
+    StepVal = IsInt ? asIntOperand(StepVal) : toDouble(StepVal);
+  } else {
+    // If not specified, use 1.0.
+    StepVal = IsInt ? static_cast<Value *>(Builder->getInt64(1))
+                    : ConstantFP::get(getNumTy(), 1.0);
+  }
+
+  // Compute the end condition.
+  Value *EndCond = End->codegen();
+  if (!EndCond)
+    return nullptr;
+
+  // Reload, increment, and restore the alloca.  This handles the case where
+  // the body of the loop mutates the variable.
+  Value *CurVar = Builder->CreateLoad(Alloca, VarName.c_str());
+  Value *NextVar = IsInt ? Builder->CreateAdd(CurVar, StepVal, "nextvar")
+                         : Builder->CreateFAdd(CurVar, StepVal, "nextvar");
+  Builder->CreateStore(NextVar, Alloca);
+
+  // Convert condition to a bool by comparing non-equal to 0.0.
+  EndCond = convertValue(EndCond, Builder->getInt1Ty());
+
+  // Create the "after loop" block and insert it.
+  BasicBlock *AfterBB =
+      BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+
+  // Insert the conditional branch into the end of LoopEndBB.
+  BranchInst *LatchBr = Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+  if (isOptimizingFromProfile()) {
+    uint64_t Entries = getProfileCount(this, 0);
+    uint64_t Iterations = getProfileCount(this, 1);
+    setBranchWeights(LatchBr, Iterations - std::min(Iterations, Entries),
+                     Entries);
+    if (Entries && Iterations >= PGOHotCalls && Iterations / Entries >= 4)
+      setLoopUnrollCount(LatchBr, 4);
+  }
+
+  // Any new code will be inserted in AfterBB.
+  Builder->SetInsertPoint(AfterBB);
+
+  // Restore the unshadowed variable.
+  NamedValues.popScope();
+
+  // for expr always returns 0.0.
+  return Constant::getNullValue(getNumTy());
+}
+
+/// reassociateReductions - True if sum and dot may add in any order: with
+/// -fast-reductions, and in fast code.
+static bool reassociateReductions() {
+  return FastReductions || CurFPMode == FP_Fast;
+}
+
+/// emitReduceStep - Fold X into Acc, both doubles or both vectors of doubles.
+/// min and max skip NaNs in X; a Reassociate'd sum may be regrouped.
+static Value *emitReduceStep(ReduceKind Kind, Value *Acc, Value *X,
+                             bool Reassociate = false) {
+  switch (Kind) {
+  case RK_Min:
+    return Builder->CreateSelect(Builder->CreateFCmpOLT(X, Acc, "lt"), X, Acc,
+                                 "min");
+  case RK_Max:
+    return Builder->CreateSelect(Builder->CreateFCmpOGT(X, Acc, "gt"), X, Acc,
+                                 "max");
+  default: {
+    Value *Sum = Builder->CreateFAdd(Acc, X, "sum");
+    if (Reassociate)
+      if (Instruction *I = dyn_cast<Instruction>(Sum))
+        I->setHasUnsafeAlgebra(true);
+    return Sum;
+  }
+  }
+}
+
+// Output reduce-loop as:
+//   var = alloca double
+//   ...
+//   start = startexpr
+//   store start -> var
+//   br cond
+// cond:
+//   acc = phi [identity, entry], [nextacc, body]
+//   endcond = endexpr
+//   br endcond, body, afterreduce
+// body:
+//   nextacc = acc op bodyexpr
+//   step = stepexpr
+//   store var + step -> var
+//   br cond
+// afterreduce:
+//   result is acc
+//
+// Unlike a for loop, the condition is tested before every element, so an empty
+// range reduces to the identity.
+Value *ReduceExprAST::codegen() {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+  Value *StartVal = Start->codegen();
+  if (!StartVal)
+    return nullptr;
+
+  // The variable is typed as a for loop's would be.
+  bool IsInt = asIntOperand(StartVal) && (!Step || Step->isIntLiteral()) &&
+               !End->assigns(VarName) && !(Step && Step->assigns(VarName)) &&
+               !Body->assigns(VarName);
+  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName,
+                                              IsInt ? VT_Int : VT_Double);
+  Builder->CreateStore(IsInt ? asIntOperand(StartVal) : toDouble(StartVal),
+                       Alloca);
+
+  BasicBlock *EntryBB = Builder->GetInsertBlock();
+  BasicBlock *CondBB =
+      BasicBlock::Create(*TheContext, "reducecond", TheFunction);
+  BasicBlock *BodyBB = BasicBlock::Create(*TheContext, "reducebody");
+  BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterreduce");
+  Builder->CreateBr(CondBB);
+
+  // The running result is a phi, not a variable.
+  Builder->SetInsertPoint(CondBB);
+  Type *NumTy = getNumTy();
+  PHINode *Acc = Builder->CreatePHI(NumTy, 2, "acc");
+  Acc->addIncoming(ConstantFP::get(NumTy, getReduceIdentity(Kind)), EntryBB);
+
+  NamedValues.pushScope();
+  NamedValues.bind(VarId, Alloca);
+
+  Value *EndCond = End->codegen();
+  if (!EndCond)
+    return nullptr;
+  Builder->CreateCondBr(convertValue(EndCond, Builder->getInt1Ty()), BodyBB,
+                        AfterBB);
+
+  TheFunction->getBasicBlockList().push_back(BodyBB);
+  Builder->SetInsertPoint(BodyBB);
+  Value *X = Body->codegen();
+  if (!X)
+    return nullptr;
+  Value *NextAcc =
+      emitReduceStep(Kind, Acc, toDouble(X), reassociateReductions());
+
+  Value *StepVal;
+  if (Step) {
+    StepVal = Step->codegen();
+    if (!StepVal)
+      return nullptr;
+    StepVal = IsInt ? asIntOperand(StepVal) : toDouble(StepVal);
+  } else {
+    StepVal = IsInt ? static_cast<Value *>(Builder->getInt64(1))
+                    : ConstantFP::get(getNumTy(), 1.0);
+  }
+  Value *CurVar = Builder->CreateLoad(Alloca, VarName.c_str());
+  Value *NextVar = IsInt ? Builder->CreateAdd(CurVar, StepVal, "nextvar")
+                         : Builder->CreateFAdd(CurVar, StepVal, "nextvar");
+  Builder->CreateStore(NextVar, Alloca);
+
+  BranchInst *LatchBr = Builder->CreateBr(CondBB);
+  Acc->addIncoming(NextAcc, Builder->GetInsertBlock());
+  // A reassociable sum can be split across vector lanes and interleaved
+  // accumulators.
+  if (reassociateReductions() && Kind == RK_Sum) {
+    Metadata *Hints[] = {
+        getLoopHint("llvm.loop.vectorize.enable", Builder->getTrue()),
+        getLoopHint("llvm.loop.interleave.count", Builder->getInt32(4))};
+    setLoopHints(LatchBr, Hints);
+  }
+
+  TheFunction->getBasicBlockList().push_back(AfterBB);
+  Builder->SetInsertPoint(AfterBB);
+
+  NamedValues.popScope();
+
+  return Acc;
+}
+
+/// ReduceAccumulators - The number of independent vector accumulators in the
+/// vector loop of an array reduction, enough to hide the latency of the adds.
+static const unsigned ReduceAccumulators = 4;
+
+/// getReduceLanes - The lanes of each accumulator: 256 bits of numbers.
+static unsigned getReduceLanes() { return Float32 ? 8 : 4; }
+
+// Array reductions are emitted as a kernel over the element count N (for dot,
+// the shorter array's).  A vector loop reads N rounded down to a whole number
+// of blocks into the accumulators, which are then combined pairwise, and then
+// their lanes; a scalar loop does the rest.  A strict sum or dot skips the
+// vector loop and adds every element in order.
+Value *ArrayReduceExprAST::codegen() {
+  if (!ArrayNames.count(Array) || (Kind == RK_Dot && !ArrayNames.count(Other)))
+    return ErrorV("Unknown array name");
+
+  LLVMContext &C = *TheContext;
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  Type *NumTy = getNumTy();
+  Type *Int64Ty = Builder->getInt64Ty();
+
+  Value *A = emitArrayField(Array, 0), *B = nullptr;
+  Value *N = emitArrayField(Array, 1);
+  if (Kind == RK_Dot) {
+    B = emitArrayField(Other, 0);
+    Value *LenB = emitArrayField(Other, 1);
+    N = Builder->CreateSelect(Builder->CreateICmpULT(LenB, N), LenB, N, "n");
+  }
+
+  // The element (or vector of elements) at Idx: a[i], or a[i]*b[i] for dot.
+  auto EmitElement = [&](Value *Idx, Type *Ty) -> Value * {
+    auto Load = [&](Value *Data, const std::string &Name) -> Value * {
+      Value *Ptr = Builder->CreateInBoundsGEP(Data, Idx, Name + ".elt");
+      if (Ty->isVectorTy())
+        Ptr = Builder->CreateBitCast(Ptr, Ty->getPointerTo());
+      return Builder->CreateAlignedLoad(Ptr, getElementSize(), Name + ".val");
+    };
+    Value *X = Load(A, Array);
+    return B ? Builder->CreateFMul(X, Load(B, Other), "prod") : X;
+  };
+
+  Constant *Identity = ConstantFP::get(NumTy, getReduceIdentity(Kind));
+  Value *Result = Identity;
+  Value *VecEnd = Builder->getInt64(0);
+
+  // min and max give the same result in any order.
+  if (reassociateReductions() || Kind == RK_Min || Kind == RK_Max) {
+    const unsigned Lanes = getReduceLanes();
+    const unsigned Block = Lanes * ReduceAccumulators;
+    Type *VecTy = VectorType::get(NumTy, Lanes);
+    std::vector<Constant *> Splat(Lanes, Identity);
+    Constant *VecIdentity = ConstantVector::get(Splat);
+
+    BasicBlock *EntryBB = Builder->GetInsertBlock();
+    BasicBlock *VecBB = BasicBlock::Create(C, "reducevec", TheFunction);
+    BasicBlock *VecExitBB = BasicBlock::Create(C, "reducevecexit", TheFunction);
+    VecEnd = Builder->CreateAnd(N, Builder->getInt64(~uint64_t(Block - 1)),
+                                "vecend");
+    Builder->CreateCondBr(Builder->CreateICmpNE(VecEnd, Builder->getInt64(0)),
+                          VecBB, VecExitBB);
+
+    Builder->SetInsertPoint(VecBB);
+    PHINode *I = Builder->CreatePHI(Int64Ty, 2, "i");
+    I->addIncoming(Builder->getInt64(0), EntryBB);
+    std::vector<PHINode *> Accs;
+    std::vector<Value *> Next;
+    for (unsigned K = 0; K != ReduceAccumulators; ++K) {
+      Accs.push_back(Builder->CreatePHI(VecTy, 2, "vacc"));
+      Accs.back()->addIncoming(VecIdentity, EntryBB);
+    }
+    for (unsigned K = 0; K != ReduceAccumulators; ++K) {
+      Value *Idx = Builder->CreateAdd(I, Builder->getInt64(K * Lanes),
+                                      "idx", true, true);
+      Next.push_back(emitReduceStep(Kind, Accs[K], EmitElement(Idx, VecTy)));
+      Accs[K]->addIncoming(Next[K], VecBB);
+    }
+    Value *INext =
+        Builder->CreateAdd(I, Builder->getInt64(Block), "inext", true, true);
+    I->addIncoming(INext, VecBB);
+    Builder->CreateCondBr(Builder->CreateICmpEQ(INext, VecEnd), VecExitBB,
+                          VecBB);
+
+    // Combine the accumulators pairwise, then the lanes of what is left.
+    Builder->SetInsertPoint(VecExitBB);
+    std::vector<Value *> Parts;
+    for (unsigned K = 0; K != ReduceAccumulators; ++K) {
+      PHINode *P = Builder->CreatePHI(VecTy, 2, "vacc.out");
+      P->addIncoming(VecIdentity, EntryBB);
+      P->addIncoming(Next[K], VecBB);
+      Parts.push_back(P);
+    }
+    while (Parts.size() > 1) {
+      std::vector<Value *> Halved;
+      for (unsigned K = 0; K + 1 < Parts.size(); K += 2)
+        Halved.push_back(emitReduceStep(Kind, Parts[K], Parts[K + 1]));
+      Parts.swap(Halved);
+    }
+    Value *Vec = Parts[0];
+    for (unsigned Width = Lanes / 2; Width; Width /= 2) {
+      std::vector<uint32_t> Mask;
+      for (unsigned L = 0; L != Lanes; ++L)
+        Mask.push_back(Width + L % Width);
+      Value *Upper = Builder->CreateShuffleVector(
+          Vec, Vec, ConstantDataVector::get(C, Mask), "upper");
+      Vec = emitReduceStep(Kind, Vec, Upper);
+    }
+    Result = Builder->CreateExtractElement(Vec, Builder->getInt32(0), "vred");
+  }
+
+  // The scalar loop over elements VecEnd..N-1.
+  BasicBlock *PreTailBB = Builder->GetInsertBlock();
+  BasicBlock *TailBB = BasicBlock::Create(C, "reducetail", TheFunction);
+  BasicBlock *DoneBB = BasicBlock::Create(C, "reducedone", TheFunction);
+  Builder->CreateCondBr(Builder->CreateICmpULT(VecEnd, N), TailBB, DoneBB);
+
+  Builder->SetInsertPoint(TailBB);
+  PHINode *J = Builder->CreatePHI(Int64Ty, 2, "j");
+  J->addIncoming(VecEnd, PreTailBB);
+  PHINode *Acc = Builder->CreatePHI(NumTy, 2, "acc");
+  Acc->addIncoming(Result, PreTailBB);
+  Value *NextAcc = emitReduceStep(Kind, Acc, EmitElement(J, NumTy));
+  Value *JNext =
+      Builder->CreateAdd(J, Builder->getInt64(1), "jnext", true, true);
+  J->addIncoming(JNext, TailBB);
+  Acc->addIncoming(NextAcc, TailBB);
+  Builder->CreateCondBr(Builder->CreateICmpEQ(JNext, N), DoneBB, TailBB);
+
+  Builder->SetInsertPoint(DoneBB);
+  PHINode *Reduced = Builder->CreatePHI(NumTy, 2, "reduced");
+  Reduced->addIncoming(Result, PreTailBB);
+  Reduced->addIncoming(NextAcc, TailBB);
+  return Reduced;
+}
+
+//===----------------------------------------------------------------------===//
+// Parallel loops
+//===----------------------------------------------------------------------===//
+
+// The body of a parfor is outlined into a function of its own,
+//
+//   double NAME.parforN(i8 *env, i64 begin, i64 end)
+//
+// which runs the iterations [begin, end) in order and returns their reduction
+// (0 for a plain parfor).  Every variable in scope is copied into a struct for
+// env, so the body sees the values they had when the loop started; it may not
+// assign to them.  The loop is a call to kaleidoscope_parfor, which cuts the
+// range into chunks for the thread pool and combines their results in order.
+
+/// ParforBodies - The bodies outlined from the definition being compiled, in
+/// the order they were finished; each is optimized along with the definition.
+static thread_local std::vector<Function *> ParforBodies;
+
+/// NumParforBodies - Numbers outlined bodies, so that their symbols do not
+/// collide with those of earlier versions of the same definition.
+static thread_local unsigned NumParforBodies = 0;
+
+/// emitRangeBound - V as an i64 parfor bound: ints as they are, numbers
+/// rounded up, since the variable takes the integers in [start, bound).
+static Value *emitRangeBound(Value *V) {
+  if (V->getType()->isIntegerTy())
+    return convertValue(V, Builder->getInt64Ty());
+  return saturatingToInt(V, true);
+}
+
+// Output the outlined body as:
+// entry:
+//   captured = load env
+//   br begin < end, loop, exit
+// loop:
+//   i = phi [begin, entry], [inext, loop]
+//   acc = phi [identity, entry], [nextacc, loop]
+//   nextacc = acc op bodyexpr
+//   inext = i + 1
+//   br inext < end, loop, exit
+// exit:
+//   ret phi [identity, entry], [nextacc, loop]
+Function *ParForExprAST::outlineBody(Function *Parent, StructType *EnvTy,
+                                     const std::vector<SymbolId> &Captured) {
+  LLVMContext &C = *TheContext;
+  Type *I64 = Type::getInt64Ty(C);
+  Type *Params[] = {Type::getInt8PtrTy(C), I64, I64};
+  Function *F = Function::Create(
+      FunctionType::get(Type::getDoubleTy(C), Params, false),
+      Function::ExternalLinkage,
+      Parent->getName() + ".parfor" + std::to_string(NumParforBodies++),
+      TheModule.get());
+  auto AI = F->arg_begin();
+  Value *EnvArg = &*AI++;
+  Value *Begin = &*AI++;
+  Value *End = &*AI;
+  EnvArg->setName("env");
+  Begin->setName("begin");
+  End->setName("end");
+
+  // Emit F from scratch, then carry on with Parent where we left it.
+  auto SavedIP = Builder->saveIP();
+  SymbolTable SavedNamedValues;
+  std::swap(SavedNamedValues, NamedValues);
+  auto Restore = [&] {
+    Builder->restoreIP(SavedIP);
+    std::swap(SavedNamedValues, NamedValues);
+  };
+
+  BasicBlock *EntryBB = BasicBlock::Create(C, "entry", F);
+  BasicBlock *LoopBB = BasicBlock::Create(C, "parforloop", F);
+  BasicBlock *ExitBB = BasicBlock::Create(C, "parforexit");
+  Builder->SetInsertPoint(EntryBB);
+  setFPMode(F, CurFPMode);
+
+  Value *Env = Builder->CreateBitCast(EnvArg, EnvTy->getPointerTo(), "envp");
+  for (unsigned I = 0; I != Captured.size(); ++I) {
+    AllocaInst *Alloca = Builder->CreateAlloca(EnvTy->getElementType(I),
+                                               nullptr, symbolName(Captured[I]));
+    Builder->CreateStore(
+        Builder->CreateLoad(Builder->CreateStructGEP(EnvTy, Env, I)), Alloca);
+    NamedValues.bind(Captured[I], Alloca);
+  }
+  AllocaInst *Var = CreateEntryBlockAlloca(F, VarName, VT_Int);
+  NamedValues.bind(VarId, Var);
+
+  Type *NumTy = getNumTy();
+  Constant *Identity =
+      ConstantFP::get(NumTy, IsReduce ? getReduceIdentity(Kind) : 0.0);
+  Builder->CreateCondBr(Builder->CreateICmpSLT(Begin, End, "nonempty"), LoopBB,
+                        ExitBB);
+
+  Builder->SetInsertPoint(LoopBB);
+  PHINode *I = Builder->CreatePHI(I64, 2, VarName);
+  I->addIncoming(Begin, EntryBB);
+  PHINode *Acc = Builder->CreatePHI(NumTy, 2, "acc");
+  Acc->addIncoming(Identity, EntryBB);
+  Builder->CreateStore(I, Var);
+
+  Value *X = Body->codegen();
+  if (!X) {
+    Restore();
+    F->eraseFromParent();
+    return nullptr;
+  }
+  Value *NextAcc =
+      IsReduce ? emitReduceStep(Kind, Acc, toDouble(X), reassociateReductions())
+               : static_cast<Value *>(Acc);
+
+  // i < end <= INT64_MAX, so i + 1 cannot wrap.
+  Value *Next = Builder->CreateAdd(I, ConstantInt::get(I64, 1), "inext",
+                                   /*HasNUW=*/false, /*HasNSW=*/true);
+  BranchInst *LatchBr = Builder->CreateCondBr(
+      Builder->CreateICmpSLT(Next, End, "more"), LoopBB, ExitBB);
+  BasicBlock *LatchBB = Builder->GetInsertBlock();
+  I->addIncoming(Next, LatchBB);
+  Acc->addIncoming(NextAcc, LatchBB);
+  if (IsReduce && Kind == RK_Sum && reassociateReductions()) {
+    Metadata *Hints[] = {
+        getLoopHint("llvm.loop.vectorize.enable", Builder->getTrue()),
+        getLoopHint("llvm.loop.interleave.count", Builder->getInt32(4))};
+    setLoopHints(LatchBr, Hints);
+  }
+
+  F->getBasicBlockList().push_back(ExitBB);
+  Builder->SetInsertPoint(ExitBB);
+  PHINode *Result = Builder->CreatePHI(NumTy, 2, "reduced");
+  Result->addIncoming(Identity, EntryBB);
+  Result->addIncoming(NextAcc, LatchBB);
+  Builder->CreateRet(Builder->CreateFPCast(Result, Builder->getDoubleTy()));
+
+  Restore();
+  ParforBodies.push_back(F);
+  return F;
+}
+
+Value *ParForExprAST::codegen() {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+  Value *StartVal = Start->codegen();
+  if (!StartVal)
+    return nullptr;
+  Value *BoundVal = Bound->codegen();
+  if (!BoundVal)
+    return nullptr;
+  Value *Begin = emitRangeBound(StartVal);
+  Value *End = emitRangeBound(BoundVal);
+
+  // Iterations run concurrently, so they may only write to variables of their
+  // own.
+  if (Body->assigns(VarName))
+    return ErrorV("parfor variable cannot be assigned in the loop");
+  std::vector<SymbolId> Captured;
+  std::vector<AllocaInst *> Allocas;
+  std::vector<Type *> Fields;
+  for (SymbolId Id : NamedValues.visible()) {
+    AllocaInst *Alloca = NamedValues.lookup(Id);
+    if (!Alloca || Id == VarId)
+      continue;
+    if (Body->assigns(symbolName(Id)))
+      return ErrorV("parfor body cannot assign to variables from outside "
+                    "the loop");
+    Captured.push_back(Id);
+    Allocas.push_back(Alloca);
+    Fields.push_back(Alloca->getAllocatedType());
+  }
+
+  StructType *EnvTy = StructType::get(*TheContext, Fields);
+  IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+                   TheFunction->getEntryBlock().begin());
+  AllocaInst *Env = TmpB.CreateAlloca(EnvTy, nullptr, "parfor.env");
+  for (unsigned I = 0; I != Allocas.size(); ++I)
+    Builder->CreateStore(Builder->CreateLoad(Allocas[I]),
+                         Builder->CreateStructGEP(EnvTy, Env, I));
+
+  Function *BodyF = outlineBody(TheFunction, EnvTy, Captured);
+  if (!BodyF)
+    return nullptr;
+
+  Type *I64 = Builder->getInt64Ty();
+  Function *Run = TheModule->getFunction("kaleidoscope_parfor");
+  if (!Run) {
+    Type *Params[] = {BodyF->getType(), Builder->getInt8PtrTy(), I64, I64,
+                      Builder->getInt32Ty()};
+    Run = Function::Create(
+        FunctionType::get(Builder->getDoubleTy(), Params, false),
+        Function::ExternalLinkage, "kaleidoscope_parfor", TheModule.get());
+  }
+  // A plain parfor sums the zeros its chunks return.
+  Value *Args[] = {BodyF, Builder->CreateBitCast(Env, Builder->getInt8PtrTy()),
+                   Begin, End, Builder->getInt32(IsReduce ? Kind : RK_Sum)};
+  Value *Result = Builder->CreateCall(Run, Args, "parfor");
+  if (!IsReduce)
+    return ConstantFP::get(getNumTy(), 0.0);
+  return Builder->CreateFPCast(Result, getNumTy());
+}
+
+Value *VarExprAST::codegen() {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+  // Each binding shadows any outer variable of its name until the scope is
+  // popped.
+  NamedValues.pushScope();
+
+  // Register all variables and emit their initializer.
+  for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
+    const std::string &VarName = VarNames[i].first;
+    ExprAST *Init = VarNames[i].second.get();
+
+    // Emit the initializer before adding the variable to scope, this prevents
+    // the initializer from referencing the variable itself, and permits stuff
+    // like this:
+    //  var a = 1 in
+    //    var a = a in ...   # refers to outer 'a'.
+    Value *InitVal;
+    if (Init) {
+      InitVal = Init->codegen();
+      if (!InitVal)
+        return nullptr;
+    } else { // If not specified, use 0.0.
+      InitVal = ConstantFP::get(getNumTy(), 0.0);
+    }
+
+    AllocaInst *Alloca =
+        CreateEntryBlockAlloca(TheFunction, VarName, VarTypes[i]);
+    Builder->CreateStore(convertValue(InitVal, Alloca->getAllocatedType()),
+                         Alloca);
+
+    // Remember this binding.
+    NamedValues.bind(VarIds[i], Alloca);
+  }
+
+  // Codegen the body, now that all vars are in scope.
+  Value *BodyVal = Body->codegen();
+  if (!BodyVal)
+    return nullptr;
+
+  // Pop all our variables from scope.
+  NamedValues.popScope();
+
+  // Return the body computation.
+  return BodyVal;
+}
+
+Function *PrototypeAST::codegen() {
+  // Make the function type:  double(double,double) etc.
+  std::vector<Type *> Doubles(Args.size(), getNumTy());
+  // Top-level expressions are called by the driver, which expects a double.
+  Type *RetTy =
+      Name == "__anon_expr" ? Type::getDoubleTy(*TheContext) : getNumTy();
+  FunctionType *FT = FunctionType::get(RetTy, Doubles, false);
+
+  Function *F = Function::Create(FT, Function::ExternalLinkage,
+                                 getSymbolName(Name), TheModule.get());
+
+  // Set names for all arguments.
+  unsigned Idx = 0;
+  for (auto &Arg : F->args())
+    Arg.setName(Args[Idx++]);
+
+  // Nothing here reads errno, so libm functions depend only on their
+  // arguments; saying so lets calls be hoisted, merged and vectorized.
+  if (isLibmExtern(Name)) {
+    F->setDoesNotAccessMemory();
+    F->setDoesNotThrow();
+  }
+
+  return F;
+}
+
+void PrototypeRegistry::add(std::unique_ptr<PrototypeAST> P) {
+  Entry &E = Entries[P->getName()];
+  ++Counts.Registered;
+  if (E.Proto)
+    ++Counts.Replaced;
+  E.Proto = std::move(P);
+  E.Type = nullptr;
+  E.Symbol = getSymbolName(E.Proto->getName());
+}
+
+Function *PrototypeRegistry::declare(StringRef Name) {
+  auto I = Entries.find(Name);
+  if (I == Entries.end()) {
+    // Not a function of the program; the module may still have it.
+    return TheModule->getFunction(Name);
+  }
+  Entry &E = I->second;
+  if (Function *F = TheModule->getFunction(E.Symbol)) {
+    ++Counts.ModuleHits;
+    return F;
+  }
+
+  // The same type as PrototypeAST::codegen, built once per prototype.
+  if (!E.Type) {
+    std::vector<Type *> Doubles(E.Proto->getArgs().size(), getNumTy());
+    Type *RetTy = Name == "__anon_expr" ? Type::getDoubleTy(*TheContext)
+                                        : getNumTy();
+    E.Type = FunctionType::get(RetTy, Doubles, false);
+    ++Counts.TypesBuilt;
+  }
+
+  ++Counts.Declarations;
+  Function *F = Function::Create(E.Type, Function::ExternalLinkage, E.Symbol,
+                                 TheModule.get());
+  if (isLibmExtern(Name)) {
+    F->setDoesNotAccessMemory();
+    F->setDoesNotThrow();
+  }
+  return F;
+}
+
+void PrototypeRegistry::printStats() const {
+  fprintf(stderr,
+          "decl-stats: %llu prototypes registered (%llu replacing an older "
+          "one), %llu function types built, %llu declarations emitted, %llu "
+          "found in the module already\n",
+          (unsigned long long)Counts.Registered,
+          (unsigned long long)Counts.Replaced,
+          (unsigned long long)Counts.TypesBuilt,
+          (unsigned long long)Counts.Declarations,
+          (unsigned long long)Counts.ModuleHits);
+}
+
+//===----------------------------------------------------------------------===//
+// Cross-module inlining
+//===----------------------------------------------------------------------===//
+
+// Every definition lives in a module of its own, so a call to another
+// definition is normally an opaque external call.  Instead, the optimized IR of
+// every small definition is kept in a module of its own and cloned into the
+// modules that call it, where the calls are inlined.
+
+/// InlineBodies - The optimized IR of every definition small enough to inline,
+/// each alone in a module.
+static thread_local std::map<std::string, std::unique_ptr<Module>> InlineBodies;
+
+/// InlinedInto - For each definition, the definitions its body was inlined
+/// into; they must be recompiled when it is replaced.
+static thread_local std::map<std::string, std::set<std::string>> InlinedInto;
+
+/// copyBody - Clone the body of Src into Dest, a declaration of the same type
+/// in another module.  Functions and globals (host arrays) Src refers to are
+/// redirected to declarations in Dest's module.
+static void copyBody(Function *Src, Function *Dest) {
+  Module *M = Dest->getParent();
+  ValueToValueMapTy VMap;
+  std::vector<GlobalValue *> Created;
+  for (GlobalVariable &G : Src->getParent()->globals()) {
+    GlobalVariable *D = M->getNamedGlobal(G.getName());
+    if (!D) {
+      D = new GlobalVariable(*M, G.getValueType(), G.isConstant(),
+                             GlobalValue::ExternalLinkage, nullptr,
+                             G.getName());
+      Created.push_back(D);
+    }
+    VMap[&G] = D;
+  }
+  for (Function &G : *Src->getParent()) {
+    if (&G == Src) {
+      VMap[&G] = Dest;
+      continue;
+    }
+    Function *D = M->getFunction(G.getName());
+    if (!D) {
+      D = Function::Create(G.getFunctionType(), Function::ExternalLinkage,
+                           G.getName(), M);
+      Created.push_back(D);
+    }
+    VMap[&G] = D;
+  }
+
+  auto DestArg = Dest->arg_begin();
+  for (auto &Arg : Src->args()) {
+    DestArg->setName(Arg.getName());
+    VMap[&Arg] = &*DestArg++;
+  }
+  SmallVector<ReturnInst *, 8> Returns;
+  CloneFunctionInto(Dest, Src, VMap, /*ModuleLevelChanges=*/true, Returns);
+
+  for (GlobalValue *D : Created)
+    if (D->use_empty())
+      D->eraseFromParent();
+}
+
+/// countInstructions - The size of F, as measured against InlineLimit.
+static unsigned countInstructions(const Function &F) {
+  unsigned N = 0;
+  for (auto &BB : F)
+    N += BB.size();
+  return N;
+}
+
+/// inlineDefinitions - Inline into F, part of the definition Owner, every call
+/// to a definition that has an entry in InlineBodies.  The bodies are imported
+/// for the duration and then dropped back to declarations, so nothing but F
+/// changes in the module.
+static void inlineDefinitions(Function *F, StringRef Owner) {
+  std::vector<CallInst *> Calls;
+  std::set<Function *> Imported;
+  for (auto &BB : *F)
+    for (auto &I : BB) {
+      CallInst *CI = dyn_cast<CallInst>(&I);
+      Function *Callee = CI ? CI->getCalledFunction() : nullptr;
+      if (!Callee || Callee == F)
+        continue;
+      auto Body = InlineBodies.find(Callee->getName());
+      if (Body == InlineBodies.end())
+        continue;
+      if (Callee->isDeclaration() && !Imported.count(Callee)) {
+        copyBody(Body->second->getFunction(Callee->getName()), Callee);
+        Callee->setLinkage(GlobalValue::AvailableExternallyLinkage);
+        Imported.insert(Callee);
+      }
+      if (Imported.count(Callee))
+        Calls.push_back(CI);
+    }
+
+  for (CallInst *CI : Calls) {
+    std::string CalleeName = CI->getCalledFunction()->getName();
+    InlineFunctionInfo IFI;
+    if (InlineFunction(CI, IFI) && Owner != "__anon_expr")
+      InlinedInto[CalleeName].insert(Owner.str());
+  }
+
+  for (Function *Callee : Imported)
+    Callee->deleteBody();
+}
+
+//===----------------------------------------------------------------------===//
+// Memoization
+//===----------------------------------------------------------------------===//
+
+/// MemoizedFunctions - Names of the definitions memoized so far, for
+/// -memo-stats.
+static thread_local std::vector<std::string> MemoizedFunctions;
+
+/// isPure - True if F, after optimization, calls only pure functions and
+/// itself and touches no memory other than its own stack slots.
+static bool isPure(Function &F) {
+  for (auto &BB : F)
+    for (auto &I : BB) {
+      if (CallInst *CI = dyn_cast<CallInst>(&I)) {
+        Function *Callee = CI->getCalledFunction();
+        if (!Callee)
+          return false;
+        if (Callee != &F && !Callee->isIntrinsic() &&
+            !Callee->doesNotAccessMemory() &&
+            !PureFunctions.count(Callee->getName()))
+          return false;
+        continue;
+      }
+      if (LoadInst *LI = dyn_cast<LoadInst>(&I))
+        if (isa<AllocaInst>(LI->getPointerOperand()))
+          continue;
+      if (StoreInst *SI = dyn_cast<StoreInst>(&I))
+        if (isa<AllocaInst>(SI->getPointerOperand()))
+          continue;
+      if (I.mayReadOrWriteMemory())
+        return false;
+    }
+  return true;
+}
+
+/// emitGlobalCounterIncrement - Atomically increment the i64 global Name of M,
+/// creating it (zero-initialized and visible to findSymbol) if needed.
+static void emitGlobalCounterIncrement(Module &M, const std::string &Name) {
+  Type *I64 = Builder->getInt64Ty();
+  GlobalVariable *G = M.getGlobalVariable(Name);
+  if (!G)
+    G = new GlobalVariable(M, I64, false, GlobalValue::ExternalLinkage,
+                           ConstantInt::get(I64, 0), Name);
+  // Memoized functions run concurrently from parfor chunks and -async-exprs.
+  Builder->CreateAtomicRMW(AtomicRMWInst::Add, G, Builder->getInt64(1),
+                           AtomicOrdering::Monotonic);
+}
+
+/// memoize - Put a cache in front of F.  F is renamed NAME.uncached and made
+/// internal; a new NAME looks its arguments up in a direct-mapped table of
+/// MemoSize entries, calls NAME.uncached on a miss and overwrites whatever
+/// entry was there.  Recursive calls in F go through the cache too.
+///
+/// An entry is [check, argument bits..., result bits] in i64s, and arguments
+/// are compared bitwise, so -0.0 and 0.0 get separate entries and NaN
+/// arguments are cached too.  The check word mixes the argument and result
+/// bits and is never 0, so an empty entry is a miss, and so is one torn by
+/// parfor iterations filling it at the same time.  The table is a global of
+/// the module, so the cache lives as long as this version of the definition.
+static Function *memoize(Function *F) {
+  Module &M = *F->getParent();
+  LLVMContext &C = *TheContext;
+  Type *I64 = Type::getInt64Ty(C);
+  std::string Name = F->getName();
+  unsigned Arity = F->arg_size();
+
+  uint64_t Size = 1;
+  unsigned SizeLog2 = 0;
+  while (Size < MemoSize) {
+    Size <<= 1;
+    ++SizeLog2;
+  }
+  ArrayType *EntryTy = ArrayType::get(I64, Arity + 2);
+  ArrayType *TableTy = ArrayType::get(EntryTy, Size);
+  GlobalVariable *Table =
+      new GlobalVariable(M, TableTy, false, GlobalValue::InternalLinkage,
+                         ConstantAggregateZero::get(TableTy), Name + ".memo");
+
+  F->setName(Name + ".uncached");
+  F->setLinkage(GlobalValue::InternalLinkage);
+  Function *Cached = Function::Create(F->getFunctionType(),
+                                      Function::ExternalLinkage, Name, &M);
+  F->replaceAllUsesWith(Cached);
+  // Inlining the wrapper would copy references to the table.
+  Cached->addFnAttr(Attribute::NoInline);
+
+  BasicBlock *EntryBB = BasicBlock::Create(C, "entry", Cached);
+  BasicBlock *HitBB = BasicBlock::Create(C, "hit", Cached);
+  BasicBlock *MissBB = BasicBlock::Create(C, "miss", Cached);
+  Builder->SetInsertPoint(EntryBB);
+  if (MemoStats)
+    emitGlobalCounterIncrement(M, Name + ".memo.calls");
+
+  // Fibonacci-hash the argument bits into a table index.
+  std::vector<Value *> Args, Bits;
+  Value *Hash = Builder->getInt64(0);
+  auto FArg = F->arg_begin();
+  for (auto &Arg : Cached->args()) {
+    Arg.setName((FArg++)->getName());
+    Args.push_back(&Arg);
+    Bits.push_back(toBits(&Arg));
+    Hash = Builder->CreateMul(Builder->CreateXor(Hash, Bits.back()),
+                              Builder->getInt64(0x9E3779B97F4A7C15ULL));
+  }
+  Value *Idx = SizeLog2 ? Builder->CreateLShr(Hash, 64 - SizeLog2, "idx")
+                        : Builder->getInt64(0);
+
+  auto EntryField = [&](unsigned Field) {
+    Value *Indices[] = {Builder->getInt64(0), Idx, Builder->getInt64(Field)};
+    return Builder->CreateInBoundsGEP(Table, Indices);
+  };
+  auto CheckWord = [&](Value *ResultBits) {
+    return Builder->CreateOr(
+        Builder->CreateMul(Builder->CreateXor(Hash, ResultBits),
+                           Builder->getInt64(0x9E3779B97F4A7C15ULL)),
+        Builder->getInt64(1), "check");
+  };
+  Value *Stored = Builder->CreateLoad(EntryField(Arity + 1), "stored");
+  Value *Match = Builder->CreateICmpEQ(Builder->CreateLoad(EntryField(0)),
+                                      CheckWord(Stored), "valid");
+  for (unsigned i = 0; i != Arity; ++i)
+    Match = Builder->CreateAnd(
+        Match, Builder->CreateICmpEQ(Builder->CreateLoad(EntryField(i + 1)),
+                                     Bits[i]),
+        "match");
+  Builder->CreateCondBr(Match, HitBB, MissBB);
+
+  Builder->SetInsertPoint(HitBB);
+  if (MemoStats)
+    emitGlobalCounterIncrement(M, Name + ".memo.hits");
+  Builder->CreateRet(fromBits(Stored));
+
+  Builder->SetInsertPoint(MissBB);
+  Value *Result = Builder->CreateCall(F, Args, "result");
+  for (unsigned i = 0; i != Arity; ++i)
+    Builder->CreateStore(Bits[i], EntryField(i + 1));
+  Value *ResultBits = toBits(Result);
+  Builder->CreateStore(ResultBits, EntryField(Arity + 1));
+  Builder->CreateStore(CheckWord(ResultBits), EntryField(0));
+  Builder->CreateRet(Result);
+
+  verifyFunction(*Cached);
+  MemoizedFunctions.push_back(Name);
+  return Cached;
+}
+
+/// reportMemoStats - Print the hit rate of every memoized definition still
+/// linked into the JIT.
+static void reportMemoStats() {
+  for (const std::string &Name : MemoizedFunctions) {
+    auto Calls = TheJIT->findSymbol(Name + ".memo.calls");
+    auto Hits = TheJIT->findSymbol(Name + ".memo.hits");
+    if (!Calls || !Hits)
+      continue;
+    uint64_t C = *(uint64_t *)(intptr_t)Calls.getAddress();
+    uint64_t H = *(uint64_t *)(intptr_t)Hits.getAddress();
+    fprintf(stderr, "memo: %s: %llu calls, %llu hits (%.1f%%)\n", Name.c_str(),
+            (unsigned long long)C, (unsigned long long)H,
+            C ? 100.0 * H / C : 0.0);
+  }
+}
+
+Function *FunctionAST::codegen() {
+  // Register a copy of the prototype in the FunctionProtos registry; the AST
+  // keeps its own so that the reoptimizer can compile it again.  The name is
+  // no longer an extern, which decides the symbol it is registered under.
+  auto &P = *Proto;
+  ExternFunctions.erase(P.getName());
+  FunctionProtos.add(llvm::make_unique<PrototypeAST>(P));
+  // Until the new body has been checked, calls to this name must not be
+  // evaluated with the old one.
+  PureFunctions.erase(P.getName());
+  ParforBodies.clear();
+  Function *TheFunction = getFunction(P.getName());
+  if (!TheFunction)
+    return nullptr;
+
+  // Every instrumented definition gets a fresh profile.  Top-level expressions
+  // run once, so they are not worth profiling.
+  if (ProfileMode == PM_Instrument)
+    CurProfile = P.getName() == "__anon_expr"
+                     ? nullptr
+                     : startProfile(P.getName(), TheFunction->arg_size());
+
+  // If this is an operator, install it.
+  if (P.isBinaryOp())
+    BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+
+  // Create a new basic block to start insertion into.
+  BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
+  Builder->SetInsertPoint(BB);
+  setFPMode(TheFunction, Mode);
+
+  // Record the function arguments in the symbol table.
+  NamedValues.clear();
+  unsigned ArgIdx = 0;
+  for (auto &Arg : TheFunction->args()) {
+    // Declarations from the registry leave their arguments unnamed.
+    Arg.setName(P.getArgs()[ArgIdx]);
+
+    // Create an alloca for this variable, of its declared type.
+    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName(),
+                                                P.getArgType(ArgIdx));
+
+    // Store the initial value into the alloca.
+    Builder->CreateStore(convertValue(&Arg, Alloca->getAllocatedType()),
+                         Alloca);
+
+    // Add arguments to variable symbol table.
+    NamedValues.bind(P.getArgId(ArgIdx++), Alloca);
+  }
+
+  if (isInstrumenting())
+    emitEntryProfile(TheFunction);
+
+  Value *RetVal = Body->codegen();
+  // Code emitted outside of definitions is strict.
+  Builder->clearFastMathFlags();
+  CurFPMode = FP_Strict;
+
+  if (RetVal) {
+    // Finish off the function, returning a number of the declared type.
+    RetVal = convertValue(RetVal, getValueType(P.getRetType()));
+    Builder->CreateRet(
+        Builder->CreateFPCast(toDouble(RetVal), TheFunction->getReturnType()));
+
+    // Profiled code reaches definitions through call slots instead, so that
+    // the reoptimizer can swap them.
+    if (InlineLimit && !Profiles) {
+      inlineDefinitions(TheFunction, P.getName());
+      for (Function *BodyF : ParforBodies)
+        inlineDefinitions(BodyF, P.getName());
+    }
+
+    // Validate the generated code, checking for consistency.
+    verifyFunction(*TheFunction);
+
+    // Run the optimizer on the function and the parfor bodies outlined from
+    // it.
+    SimplifyCounts.EmittedInstrs += countInstructions(*TheFunction);
+    TheFPM->run(*TheFunction);
+    SimplifyCounts.OptimizedInstrs += countInstructions(*TheFunction);
+    for (Function *BodyF : ParforBodies) {
+      verifyFunction(*BodyF);
+      SimplifyCounts.EmittedInstrs += countInstructions(*BodyF);
+      TheFPM->run(*BodyF);
+      SimplifyCounts.OptimizedInstrs += countInstructions(*BodyF);
+    }
+
+    // Memoize pure definitions on request.  Profiled code is left alone, its
+    // counters are side effects.
+    if (P.getName() != "__anon_expr" && !Profiles) {
+      bool Pure = isPure(*TheFunction);
+      if (Pure)
+        PureFunctions.insert(P.getName());
+      else
+        PureFunctions.erase(P.getName());
+      if (Memo || Memoize) {
+        if (Pure)
+          return memoize(TheFunction);
+        if (Memo)
+          printMessage("memo: %s is not pure, not memoized\n",
+                       P.getName().c_str());
+      }
+    }
+
+    return TheFunction;
+  }
+
+  // Error reading body, remove function.  Outer parfor bodies call the
+  // inner ones, which were finished first.
+  TheFunction->eraseFromParent();
+  for (auto I = ParforBodies.rbegin(), E = ParforBodies.rend(); I != E; ++I)
+    (*I)->eraseFromParent();
+  ParforBodies.clear();
+
+  if (P.isBinaryOp())
+    BinopPrecedence.erase(P.getOperatorName());
+  return nullptr;
+}
+
+//===----------------------------------------------------------------------===//
+// Batch map entry points
+//===----------------------------------------------------------------------===//
+
+/// emitMapEntryPoint - Synthesize a companion entry point for F in the current
+/// module:
+///
+///   void NAME__map(const double *x0, ..., double *out, i64 n)
+///
+/// which computes out[i] = NAME(x0[i], ...) for i in [0, n).  The loop is built
+/// directly in canonical form (integer induction variable, single latch) and the
+/// call to F is marked always-inline, so that once optimizeMapEntryPoints has
+/// run the body is inlined and the loop is ready for the loop vectorizer.
+static Function *emitMapEntryPoint(Function *F) {
+  LLVMContext &C = *TheContext;
+  Type *SizeTy = Type::getInt64Ty(C);
+  unsigned NumInputs = F->arg_size();
+
+  std::vector<Type *> Params(NumInputs + 1, getNumTy()->getPointerTo());
+  Params.push_back(SizeTy);
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(C), Params, false);
+  Function *MapF = Function::Create(FT, Function::ExternalLinkage,
+                                    F->getName() + "__map", TheModule.get());
+
+  // Name the arguments after F's, and promise that none of the streams alias so
+  // the vectorizer does not need runtime overlap checks.
+  std::vector<Value *> Streams;
+  auto FArg = F->arg_begin();
+  unsigned Idx = 0;
+  for (auto &Arg : MapF->args()) {
+    if (Idx < NumInputs)
+      Arg.setName((FArg++)->getName());
+    else if (Idx == NumInputs)
+      Arg.setName("out");
+    else
+      Arg.setName("n");
+    if (Idx <= NumInputs)
+      MapF->setDoesNotAlias(Idx + 1);
+    Streams.push_back(&Arg);
+    ++Idx;
+  }
+  Value *Out = Streams[NumInputs];
+  Value *N = Streams[NumInputs + 1];
+
+  BasicBlock *EntryBB = BasicBlock::Create(C, "entry", MapF);
+  BasicBlock *LoopBB = BasicBlock::Create(C, "loop", MapF);
+  BasicBlock *ExitBB = BasicBlock::Create(C, "exit", MapF);
+
+  Builder->SetInsertPoint(EntryBB);
+  Value *IsEmpty = Builder->CreateICmpEQ(N, ConstantInt::get(SizeTy, 0), "empty");
+  Builder->CreateCondBr(IsEmpty, ExitBB, LoopBB);
+
+  Builder->SetInsertPoint(LoopBB);
+  PHINode *I = Builder->CreatePHI(SizeTy, 2, "i");
+  I->addIncoming(ConstantInt::get(SizeTy, 0), EntryBB);
+
+  std::vector<Value *> ArgsV;
+  for (unsigned i = 0; i != NumInputs; ++i) {
+    Value *Ptr = Builder->CreateInBoundsGEP(Streams[i], I, "xptr");
+    ArgsV.push_back(Builder->CreateLoad(Ptr, "x"));
+  }
+  CallInst *Call = Builder->CreateCall(F, ArgsV, "r");
+  Call->addAttribute(AttributeSet::FunctionIndex, Attribute::AlwaysInline);
+  Builder->CreateStore(Call, Builder->CreateInBoundsGEP(Out, I, "outptr"));
+
+  Value *Next =
+      Builder->CreateAdd(I, ConstantInt::get(SizeTy, 1), "inext", true, true);
+  I->addIncoming(Next, LoopBB);
+  Builder->CreateCondBr(Builder->CreateICmpEQ(Next, N, "done"), ExitBB, LoopBB);
+
+  Builder->SetInsertPoint(ExitBB);
+  Builder->CreateRetVoid();
+
+  verifyFunction(*MapF);
+  return MapF;
+}
+
+/// optimizeMapEntryPoints - Inline the per-element calls in the __map entry
+/// points of M and run the loop vectorizers over the result.  This is a module
+/// pipeline on top of the per-function TheFPM, which has no inliner and no
+/// vectorizer.
+static void optimizeMapEntryPoints(Module &M) {
+  legacy::PassManager PM;
+  addTargetLibraryInfo(PM);
+  PM.add(createTargetTransformInfoWrapperPass(
+      TheJIT->getTargetMachine().getTargetIRAnalysis()));
+  PM.add(createAlwaysInlinerPass());
+  // The inlined body still keeps its arguments and variables in allocas.
+  PM.add(createPromoteMemoryToRegisterPass());
+  PM.add(createInstructionCombiningPass());
+  PM.add(createCFGSimplificationPass());
+  PM.add(createLICMPass());
+  PM.add(createLoopVectorizePass());
+  PM.add(createSLPVectorizerPass());
+  PM.add(createInstructionCombiningPass());
+  PM.add(createCFGSimplificationPass());
+  PM.run(M);
+}
+
+/// benchmarkMapEntryPoint - Time NAME__map over BenchMap elements against the
+/// equivalent scalar loop that calls NAME once per element from C++.
+static void benchmarkMapEntryPoint(const std::string &Name, unsigned Arity) {
+  if (Float32) {
+    fprintf(stderr, "bench-map: skipping %s, float entry points are not "
+                    "benchmarked\n",
+            Name.c_str());
+    return;
+  }
+  if (Arity > 4) {
+    fprintf(stderr, "bench-map: skipping %s, only functions of up to 4 "
+                    "arguments are benchmarked\n",
+            Name.c_str());
+    return;
+  }
+
+  auto FSym = TheJIT->findSymbol(Name);
+  auto MapSym = TheJIT->findSymbol(Name + "__map");
+  assert(FSym && MapSym && "Function not found");
+  intptr_t FAddr = (intptr_t)FSym.getAddress();
+  intptr_t MapAddr = (intptr_t)MapSym.getAddress();
+
+  uint64_t N = BenchMap;
+  std::vector<std::vector<double>> In(Arity, std::vector<double>(N));
+  for (unsigned k = 0; k != Arity; ++k)
+    for (uint64_t i = 0; i != N; ++i)
+      In[k][i] = (double)(i % 1024) * 0.25 + k;
+  const double *X[4] = {nullptr, nullptr, nullptr, nullptr};
+  for (unsigned k = 0; k != Arity; ++k)
+    X[k] = In[k].data();
+  std::vector<double> Scalar(N), Mapped(N);
+  double *S = Scalar.data(), *M = Mapped.data();
+
+  typedef double (*Fn0)();
+  typedef double (*Fn1)(double);
+  typedef double (*Fn2)(double, double);
+  typedef double (*Fn3)(double, double, double);
+  typedef double (*Fn4)(double, double, double, double);
+  typedef void (*Map0)(double *, uint64_t);
+  typedef void (*Map1)(const double *, double *, uint64_t);
+  typedef void (*Map2)(const double *, const double *, double *, uint64_t);
+  typedef void (*Map3)(const double *, const double *, const double *,
+                       double *, uint64_t);
+  typedef void (*Map4)(const double *, const double *, const double *,
+                       const double *, double *, uint64_t);
+
+  // Take the best of a few runs of each to keep noise down.
+  typedef std::chrono::steady_clock Clock;
+  double ScalarMS = HUGE_VAL, MapMS = HUGE_VAL;
+  for (unsigned Rep = 0; Rep != 5; ++Rep) {
+    auto T0 = Clock::now();
+    switch (Arity) {
+    case 0:
+      for (uint64_t i = 0; i != N; ++i)
+        S[i] = ((Fn0)FAddr)();
+      break;
+    case 1:
+      for (uint64_t i = 0; i != N; ++i)
+        S[i] = ((Fn1)FAddr)(X[0][i]);
+      break;
+    case 2:
+      for (uint64_t i = 0; i != N; ++i)
+        S[i] = ((Fn2)FAddr)(X[0][i], X[1][i]);
+      break;
+    case 3:
+      for (uint64_t i = 0; i != N; ++i)
+        S[i] = ((Fn3)FAddr)(X[0][i], X[1][i], X[2][i]);
+      break;
+    case 4:
+      for (uint64_t i = 0; i != N; ++i)
+        S[i] = ((Fn4)FAddr)(X[0][i], X[1][i], X[2][i], X[3][i]);
+      break;
+    }
+    auto T1 = Clock::now();
+    switch (Arity) {
+    case 0:
+      ((Map0)MapAddr)(M, N);
+      break;
+    case 1:
+      ((Map1)MapAddr)(X[0], M, N);
+      break;
+    case 2:
+      ((Map2)MapAddr)(X[0], X[1], M, N);
+      break;
+    case 3:
+      ((Map3)MapAddr)(X[0], X[1], X[2], M, N);
+      break;
+    case 4:
+      ((Map4)MapAddr)(X[0], X[1], X[2], X[3], M, N);
+      break;
+    }
+    auto T2 = Clock::now();
+    ScalarMS = std::min(
+        ScalarMS, std::chrono::duration<double, std::milli>(T1 - T0).count());
+    MapMS = std::min(
+        MapMS, std::chrono::duration<double, std::milli>(T2 - T1).count());
+  }
+
+  // Both paths must agree bit for bit; the map body is the same IR.
+  uint64_t Mismatches = 0;
+  for (uint64_t i = 0; i != N; ++i)
+    if (S[i] != M[i] && !(std::isnan(S[i]) && std::isnan(M[i])))
+      ++Mismatches;
+
+  fprintf(stderr,
+          "bench-map: %s over %llu elements: scalar %.3f ms, __map %.3f ms "
+          "(%.2fx)%s\n",
+          Name.c_str(), (unsigned long long)N, ScalarMS, MapMS,
+          MapMS > 0 ? ScalarMS / MapMS : 0.0,
+          Mismatches ? ", RESULTS DIFFER" : "");
+}
+
+//===----------------------------------------------------------------------===//
+// Structural dedup (-dedup)
+//===----------------------------------------------------------------------===//
+
+// Generated code is full of definitions that differ only in their names and
+// the names of their variables.  Each definition gets a key that spells out
+// the structure of its (simplified) body, with variables numbered by how far
+// out their binding is and calls to the definition itself marked as such; a
+// definition whose key matches an earlier one is not compiled again, its name
+// is bound to the earlier body instead.
+
+namespace {
+/// BodyKey - The key of a definition body, built up node by node.
+class BodyKey {
+  std::string Bytes;
+  std::vector<SymbolId> Scope; // Variables in scope, innermost last.
+  std::string Self;            // The name of the definition.
+
+public:
+  explicit BodyKey(const std::string &Self) : Self(Self) {}
+
+  void addTag(char Tag) { Bytes += Tag; }
+  void addInt(uint32_t N) { Bytes.append((const char *)&N, sizeof(N)); }
+  void addDouble(double V) {
+    uint64_t Bits;
+    memcpy(&Bits, &V, sizeof(Bits));
+    Bytes.append((const char *)&Bits, sizeof(Bits));
+  }
+  void addName(const std::string &Name) {
+    addInt(Name.size());
+    Bytes += Name;
+  }
+
+  /// addCallee - A call of the definition itself matches a call of another
+  /// definition by that one; any other callee only matches itself.
+  void addCallee(const std::string &Callee) {
+    if (Callee == Self) {
+      addTag('@');
+      return;
+    }
+    addTag('c');
+    addName(Callee);
+  }
+
+  /// addVariable - A bound variable by the number of bindings made inside its
+  /// own, anything else by name.
+  void addVariable(SymbolId Id) {
+    for (size_t I = Scope.size(); I != 0; --I)
+      if (Scope[I - 1] == Id) {
+        addTag('v');
+        addInt(Scope.size() - I);
+        return;
+      }
+    addTag('g');
+    addName(symbolName(Id));
+  }
+
+  size_t getScope() const { return Scope.size(); }
+  void bind(SymbolId Id) { Scope.push_back(Id); }
+  void popScope(size_t Size) { Scope.resize(Size); }
+
+  const std::string &str() const { return Bytes; }
+};
+
+/// SharedBody - The definition that was compiled for a key, and what
+/// compiling it took.
+struct SharedBody {
+  std::string Canonical;
+  double CompileSeconds;
+  uint64_t Instructions; // After optimization.
+};
+
+/// DedupCountsT - What -dedup did, for -dedup-stats.
+struct DedupCountsT {
+  uint64_t Compiled = 0;     // Definitions compiled by compileDefinition.
+  uint64_t Aliased = 0;      // ... and bound to an earlier body instead.
+  double KeySeconds = 0;     // Building keys.
+  double CompileSeconds = 0; // Compiling the definitions that were compiled.
+  double AliasSeconds = 0;   // Binding the aliases.
+  double SavedSeconds = 0;   // What compiling the aliased ones would have cost.
+  uint64_t SavedInstrs = 0;  // Optimized IR instructions not emitted.
+};
+} // end anonymous namespace
+
+/// SharedBodies - The definition compiled for each key.  Cleared whenever a
+/// name is redefined or an operator is defined, which can change what an
+/// identical body compiles to.
+static thread_local StringMap<SharedBody> SharedBodies;
+static thread_local DedupCountsT DedupCounts;
+
+void NumberExprAST::addToKey(BodyKey &K) const {
+  K.addTag('n');
+  K.addDouble(Val);
+}
+
+void VariableExprAST::addToKey(BodyKey &K) const { K.addVariable(Id); }
+
+void IndexExprAST::addToKey(BodyKey &K) const {
+  K.addTag('i');
+  K.addName(Array);
+  Index->addToKey(K);
+}
+
+void LenExprAST::addToKey(BodyKey &K) const {
+  K.addTag('l');
+  K.addName(Array);
+}
+
+/// addOptionalToKey - E, or a marker that it is absent.
+static void addOptionalToKey(BodyKey &K, const std::unique_ptr<ExprAST> &E) {
+  if (E)
+    E->addToKey(K);
+  else
+    K.addTag('-');
+}
+
+void ReduceExprAST::addToKey(BodyKey &K) const {
+  K.addTag('r');
+  K.addInt(Kind);
+  Start->addToKey(K);
+  size_t Scope = K.getScope();
+  K.bind(VarId);
+  End->addToKey(K);
+  addOptionalToKey(K, Step);
+  Body->addToKey(K);
+  K.popScope(Scope);
+}
+
+void ArrayReduceExprAST::addToKey(BodyKey &K) const {
+  K.addTag('a');
+  K.addInt(Kind);
+  K.addName(Array);
+  K.addName(Other);
+}
+
+void ParForExprAST::addToKey(BodyKey &K) const {
+  K.addTag('p');
+  K.addInt(IsReduce);
+  K.addInt(Kind);
+  Start->addToKey(K);
+  Bound->addToKey(K);
+  size_t Scope = K.getScope();
+  K.bind(VarId);
+  Body->addToKey(K);
+  K.popScope(Scope);
+}
+
+void UnaryExprAST::addToKey(BodyKey &K) const {
+  K.addTag('u');
+  K.addTag(Opcode);
+  Operand->addToKey(K);
+}
+
+void BinaryExprAST::addToKey(BodyKey &K) const {
+  K.addTag('b');
+  K.addTag(Op);
+  LHS->addToKey(K);
+  RHS->addToKey(K);
+}
+
+void LogicalExprAST::addToKey(BodyKey &K) const {
+  K.addTag(IsAnd ? '&' : '|');
+  LHS->addToKey(K);
+  RHS->addToKey(K);
+}
+
+void CallExprAST::addToKey(BodyKey &K) const {
+  K.addCallee(Callee);
+  K.addInt(Args.size());
+  for (auto &Arg : Args)
+    Arg->addToKey(K);
+}
+
+void IfExprAST::addToKey(BodyKey &K) const {
+  K.addTag('f');
+  Cond->addToKey(K);
+  Then->addToKey(K);
+  Else->addToKey(K);
+}
+
+void ForExprAST::addToKey(BodyKey &K) const {
+  K.addTag('o');
+  Start->addToKey(K);
+  size_t Scope = K.getScope();
+  K.bind(VarId);
+  End->addToKey(K);
+  addOptionalToKey(K, Step);
+  Body->addToKey(K);
+  K.popScope(Scope);
+}
+
+void VarExprAST::addToKey(BodyKey &K) const {
+  K.addTag('V');
+  K.addInt(VarNames.size());
+  size_t Scope = K.getScope();
+  for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
+    K.addInt(VarTypes[i]);
+    addOptionalToKey(K, VarNames[i].second);
+    K.bind(VarIds[i]);
+  }
+  Body->addToKey(K);
+  K.popScope(Scope);
+}
+
+/// getBodyKey - The key of this definition: everything that decides the code
+/// it compiles to except for its own name and the names of its variables.
+std::string FunctionAST::getBodyKey() const {
+  BodyKey K(Proto->getName());
+  K.addTag('F');
+  K.addInt(Mode);
+  K.addInt(Memo);
+  K.addInt(Proto->getArgs().size());
+  for (unsigned i = 0, e = Proto->getArgs().size(); i != e; ++i) {
+    K.addInt(Proto->getArgType(i));
+    K.bind(Proto->getArgId(i));
+  }
+  K.addInt(Proto->getRetType());
+  Body->addToKey(K);
+  return K.str();
+}
+
+/// reportDedupStats - Print what -dedup shared and what that saved.
+static void reportDedupStats() {
+  const DedupCountsT &St = DedupCounts;
+  fprintf(stderr,
+          "dedup: %llu definitions, %llu of them aliased to an identical "
+          "earlier body\n",
+          (unsigned long long)(St.Compiled + St.Aliased),
+          (unsigned long long)St.Aliased);
+  fprintf(stderr,
+          "dedup: %.3f ms hashing, %.3f ms compiling, %.3f ms aliasing; "
+          "saved %.3f ms of compile time and %llu IR instructions\n",
+          St.KeySeconds * 1000, St.CompileSeconds * 1000,
+          St.AliasSeconds * 1000, St.SavedSeconds * 1000,
+          (unsigned long long)St.SavedInstrs);
+}
+
+//===----------------------------------------------------------------------===//
+// Session snapshots (-save-session, -load-session)
+//===----------------------------------------------------------------------===//
+
+// A snapshot holds the native objects a session has linked, in order, with the
+// names -dedup bound to earlier bodies, and the prototypes, operator
+// precedences and host arrays that the parser and later definitions need.
+// Loading one maps the file and links the objects where they lie, without
+// parsing or compiling anything.  The objects are only good for the CPU and
+// number type they were compiled for, which the header records.
+//
+// The layout is the magic, then the header and the records, each a tag and
+// its fields: numbers are 32 bits, strings are a length and the bytes, and an
+// object is a 64-bit size and the bytes, starting at a multiple of 16.
+
+namespace {
+/// SessionItem - An object the session linked, or an alias it bound.
+struct SessionItem {
+  std::string Object;
+  std::string Alias, Target;
+};
+
+enum SessionRecord {
+  SR_Object = 1, // Size, object.
+  SR_Alias,      // Name, target.
+  SR_Prototype,  // Name, operator, precedence, extern, args, result type.
+  SR_Operator,   // Binary operator, precedence.
+  SR_Array,      // Host array name.
+  SR_End
+};
+
+/// SnapshotWriter - Builds the contents of a snapshot.
+class SnapshotWriter {
+  std::string Bytes;
+
+public:
+  void addInt(uint32_t N) { Bytes.append((const char *)&N, sizeof(N)); }
+  void addString(StringRef S) {
+    addInt(S.size());
+    Bytes.append(S.data(), S.size());
+  }
+  void addObject(StringRef Obj) {
+    uint64_t Size = Obj.size();
+    Bytes.append((const char *)&Size, sizeof(Size));
+    Bytes.resize((Bytes.size() + 15) & ~(size_t)15, '\0');
+    Bytes.append(Obj.data(), Obj.size());
+  }
+  const std::string &str() const { return Bytes; }
+};
+
+/// SnapshotReader - Reads the fields of a mapped snapshot; every read fails
+/// past the end.
+class SnapshotReader {
+  const char *Base, *Pos, *End;
+
+public:
+  SnapshotReader(const char *Data, size_t Size)
+      : Base(Data), Pos(Data), End(Data + Size) {}
+
+  bool readInt(uint32_t &N) {
+    if ((size_t)(End - Pos) < sizeof(N))
+      return false;
+    memcpy(&N, Pos, sizeof(N));
+    Pos += sizeof(N);
+    return true;
+  }
+  bool readString(std::string &S) {
+    uint32_t Size;
+    if (!readInt(Size) || (size_t)(End - Pos) < Size)
+      return false;
+    S.assign(Pos, Size);
+    Pos += Size;
+    return true;
+  }
+  /// readObject - An object, pointing into the mapping.
+  bool readObject(StringRef &Obj) {
+    uint64_t Size;
+    if ((size_t)(End - Pos) < sizeof(Size))
+      return false;
+    memcpy(&Size, Pos, sizeof(Size));
+    size_t Offset = ((Pos - Base) + sizeof(Size) + 15) & ~(size_t)15;
+    if (Offset > (size_t)(End - Base) || (uint64_t)(End - Base) - Offset < Size)
+      return false;
+    Obj = StringRef(Base + Offset, Size);
+    Pos = Base + Offset + Size;
+    return true;
+  }
+};
+} // end anonymous namespace
+
+static const char SessionMagic[8] = {'K', 'S', 'S', 'E', 'S', 'S', 'N', '2'};
+
+/// SessionLog - What this session has linked, in order, for -save-session.
+static thread_local std::vector<SessionItem> SessionLog;
+
+static void recordSessionObject(StringRef Obj) {
+  if (!SaveSession.empty())
+    SessionLog.push_back(SessionItem{Obj.str(), "", ""});
+}
+
+static void recordSessionAlias(const std::string &Name,
+                               const std::string &Target) {
+  if (!SaveSession.empty())
+    SessionLog.push_back(SessionItem{"", Name, Target});
+}
+
+/// addSessionHeader - What the objects of this session are only valid for.
+static void addSessionHeader(SnapshotWriter &W) {
+  TargetMachine &TM = TheJIT->getTargetMachine();
+  W.addInt(Float32);
+  W.addInt(Libmvec);
+  W.addString(TM.getTargetCPU());
+  W.addString(TM.getTargetFeatureString());
+}
+
+/// saveSession - Write the snapshot of this session to Path.  It is written
+/// next to Path first, so a failure leaves an older snapshot in place.
+static bool saveSession(const std::string &Path) {
+  SnapshotWriter W;
+  W.addString(StringRef(SessionMagic, sizeof(SessionMagic)));
+  addSessionHeader(W);
+
+  for (const SessionItem &Item : SessionLog) {
+    if (Item.Alias.empty()) {
+      W.addInt(SR_Object);
+      W.addObject(Item.Object);
+    } else {
+      W.addInt(SR_Alias);
+      W.addString(Item.Alias);
+      W.addString(Item.Target);
+    }
+  }
+  FunctionProtos.forEach([&](const PrototypeAST &P) {
+    if (P.getName() == "__anon_expr")
+      return;
+    W.addInt(SR_Prototype);
+    W.addString(P.getName());
+    W.addInt(P.isUnaryOp() || P.isBinaryOp());
+    W.addInt(P.getBinaryPrecedence());
+    W.addInt(ExternFunctions.count(P.getName()));
+    W.addInt(P.getArgs().size());
+    for (unsigned i = 0, e = P.getArgs().size(); i != e; ++i) {
+      W.addString(P.getArgs()[i]);
+      W.addInt(P.getArgType(i));
+    }
+    W.addInt(P.getRetType());
+  });
+  for (auto &Op : BinopPrecedence) {
+    W.addInt(SR_Operator);
+    W.addInt((unsigned char)Op.first);
+    W.addInt(Op.second);
+  }
+  for (const std::string &Name : ArrayNames) {
+    W.addInt(SR_Array);
+    W.addString(Name);
+  }
+  W.addInt(SR_End);
+
+  std::string Temp = Path + ".tmp";
+  FILE *F = fopen(Temp.c_str(), "wb");
+  bool Written = F && fwrite(W.str().data(), 1, W.str().size(), F) ==
+                          W.str().size();
+  if (F && fclose(F))
+    Written = false;
+  if (!Written || rename(Temp.c_str(), Path.c_str())) {
+    fprintf(stderr, "Error: cannot write session %s: %s\n", Path.c_str(),
+            strerror(errno));
+    remove(Temp.c_str());
+    return false;
+  }
+  return true;
+}
+
+/// loadSession - Restore the snapshot at Path into this session, which must
+/// be new.  The file stays mapped for the life of the process, since the
+/// linked objects are read from it.
+static bool loadSession(const std::string &Path, unsigned &NumObjects,
+                        unsigned &NumPrototypes) {
+  int FD = open(Path.c_str(), O_RDONLY);
+  struct stat St;
+  if (FD < 0 || fstat(FD, &St)) {
+    fprintf(stderr, "Error: cannot open %s: %s\n", Path.c_str(),
+            strerror(errno));
+    if (FD >= 0)
+      close(FD);
+    return false;
+  }
+  size_t Size = St.st_size;
+  void *Data = Size ? mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, FD, 0)
+                    : MAP_FAILED;
+  close(FD);
+  if (Data == MAP_FAILED) {
+    fprintf(stderr, "Error: cannot map %s: %s\n", Path.c_str(),
+            Size ? strerror(errno) : "empty file");
+    return false;
+  }
+
+  auto Damaged = [&]() {
+    fprintf(stderr, "Error: %s is not a session snapshot, or is damaged\n",
+            Path.c_str());
+    return false;
+  };
+  SnapshotReader R((const char *)Data, Size);
+  std::string Magic, CPU, Features;
+  uint32_t IsFloat32, IsLibmvec;
+  if (!R.readString(Magic) ||
+      Magic != StringRef(SessionMagic, sizeof(SessionMagic)) ||
+      !R.readInt(IsFloat32) || !R.readInt(IsLibmvec) || !R.readString(CPU) ||
+      !R.readString(Features))
+    return Damaged();
+  SnapshotWriter Expected;
+  addSessionHeader(Expected);
+  SnapshotWriter Found;
+  Found.addInt(IsFloat32);
+  Found.addInt(IsLibmvec);
+  Found.addString(CPU);
+  Found.addString(Features);
+  if (Found.str() != Expected.str()) {
+    auto Mode = [](bool F32, bool Vec) {
+      return std::string(F32 ? "with -float32" : "without -float32") +
+             (Vec ? " and -libmvec" : " and without -libmvec");
+    };
+    fprintf(stderr,
+            "Error: %s was saved %s for %s; this session runs %s on %s\n",
+            Path.c_str(), Mode(IsFloat32, IsLibmvec).c_str(), CPU.c_str(),
+            Mode(Float32, Libmvec).c_str(),
+            TheJIT->getTargetMachine().getTargetCPU().str().c_str());
+    return false;
+  }
+
+  NumObjects = NumPrototypes = 0;
+  while (true) {
+    uint32_t Tag;
+    if (!R.readInt(Tag))
+      return Damaged();
+    switch (Tag) {
+    case SR_Object: {
+      StringRef Obj;
+      if (!R.readObject(Obj))
+        return Damaged();
+      TheJIT->addObject(
+          MemoryBuffer::getMemBuffer(Obj, Path, /*RequiresNullTerminator=*/
+                                     false));
+      recordSessionObject(Obj);
+      ++NumObjects;
+      break;
+    }
+    case SR_Alias: {
+      std::string Name, Target;
+      if (!R.readString(Name) || !R.readString(Target))
+        return Damaged();
+      if (!TheJIT->addAlias(Name, Target))
+        return Damaged();
+      recordSessionAlias(Name, Target);
+      break;
+    }
+    case SR_Prototype: {
+      std::string Name;
+      uint32_t IsOperator, Precedence, IsExtern, NumArgs, RetType;
+      if (!R.readString(Name) || !R.readInt(IsOperator) ||
+          !R.readInt(Precedence) || !R.readInt(IsExtern) ||
+          !R.readInt(NumArgs))
+        return Damaged();
+      std::vector<std::string> Args(NumArgs);
+      std::vector<ValueType> ArgTypes;
+      for (std::string &Arg : Args) {
+        uint32_t Ty;
+        if (!R.readString(Arg) || !R.readInt(Ty) || Ty > VT_Bool)
+          return Damaged();
+        ArgTypes.push_back((ValueType)Ty);
+      }
+      if (!R.readInt(RetType) || RetType > VT_Bool)
+        return Damaged();
+
+      // As declareExtern or FunctionAST::codegen would.  There is no AST to
+      // check a definition for purity with.
+      if (IsExtern) {
+        ExternFunctions.insert(Name);
+      } else {
+        ExternFunctions.erase(Name);
+        PureFunctions.erase(Name);
+      }
+      FunctionProtos.add(llvm::make_unique<PrototypeAST>(
+          Name, std::move(Args), IsOperator, Precedence, std::move(ArgTypes),
+          (ValueType)RetType));
+      ++NumPrototypes;
+      break;
+    }
+    case SR_Operator: {
+      uint32_t Op, Precedence;
+      if (!R.readInt(Op) || !R.readInt(Precedence))
+        return Damaged();
+      BinopPrecedence[(char)Op] = Precedence;
+      break;
+    }
+    case SR_Array: {
+      std::string Name;
+      if (!R.readString(Name))
+        return Damaged();
+      // Code that uses an array the host does not bind now fails to link
+      // when it is first called, not here.
+      ArrayDeclarations.insert(Name);
+      if (isHostArray(Name))
+        ArrayNames.insert(Name);
+      else
+        fprintf(stderr, "Error: array %s is not bound by the host\n",
+                Name.c_str());
+      break;
+    }
+    case SR_End:
+      return true;
+    default:
+      return Damaged();
+    }
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Top-Level parsing and JIT Driver
+//===----------------------------------------------------------------------===//
+
+/// Interactive - Print the "ready> " prompt and dump the IR of every item.
+/// PrintResults - Report the value of each top-level expression.
+static thread_local bool Interactive = true;
+static thread_local bool PrintResults = true;
+
+/// ItemsHandled - Number of top-level items this session has processed.
+static thread_local unsigned ItemsHandled = 0;
+
+static void InitializeModuleAndPassManager() {
+  // Open a new module.
+  TheModule = llvm::make_unique<Module>("my cool jit", *TheContext);
+  TheModule->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
+
+  // Create a new pass manager attached to it.
+  TheFPM = llvm::make_unique<legacy::FunctionPassManager>(TheModule.get());
+  addTargetLibraryInfo(*TheFPM);
+
+  // Promote allocas to registers.
+  TheFPM->add(createPromoteMemoryToRegisterPass());
+  // Do simple "peephole" optimizations and bit-twiddling optzns.
+  TheFPM->add(createInstructionCombiningPass());
+  // Reassociate expressions.
+  TheFPM->add(createReassociatePass());
+  // Eliminate Common SubExpressions.
+  TheFPM->add(createGVNPass());
+  // Simplify the control flow graph (deleting unreachable blocks, etc).
+  TheFPM->add(createCFGSimplificationPass());
+  // Hoist loop invariants, such as host array descriptors, out of loops.
+  TheFPM->add(createLICMPass());
+  // Split off the iterations of for loops whose array bounds checks cannot
+  // fail, and drop the checks there.
+  TheFPM->add(createInductiveRangeCheckEliminationPass());
+
+  if (TailCalls) {
+    // Turn self-recursive tail calls into loops, and accumulator recursion
+    // too where the arithmetic may be reassociated (fast code, int ops).
+    TheFPM->add(createTailCallEliminationPass());
+    TheFPM->add(createInstructionCombiningPass());
+    TheFPM->add(createCFGSimplificationPass());
+  }
+
+  if (Vectorize) {
+    // Give for loops a canonical integer induction variable and a bottom test,
+    // then vectorize them (and straight-line code) for the host CPU.
+    TheFPM->add(createTargetTransformInfoWrapperPass(
+        TheJIT->getTargetMachine().getTargetIRAnalysis()));
+    TheFPM->add(createLoopRotatePass());
+    TheFPM->add(createIndVarSimplifyPass());
+    TheFPM->add(createLoopVectorizePass());
+    TheFPM->add(createSLPVectorizerPass());
+    TheFPM->add(createInstructionCombiningPass());
+    TheFPM->add(createCFGSimplificationPass());
+  }
+
+  TheFPM->doInitialization();
+}
+
+// Profile-guided reoptimization hooks, see below.
+static void installProfile(std::shared_ptr<FunctionAST> FnAST);
+static void recordPrototype(const PrototypeAST &P);
+static void queueHotFunctions();
+static void startProfiling();
+static void finishProfiling();
+
+// The thread pool of parfor, see the library functions.
+static KaleidoscopeThreadPool &getParforPool();
+
+/// addDefinitionModule - Hand the finished module of a definition to the JIT,
+/// or to the workers, and open a new one.
+static void addDefinitionModule() {
+  if (Workers) {
+    auto Obj = TheJIT->compileModule(*TheModule);
+    Workers->addObject(Obj.getBinary()->getData());
+  } else if (!SaveSession.empty()) {
+    // Keep the object for the snapshot; the JIT links a copy.
+    auto Obj = TheJIT->compileModule(*TheModule);
+    StringRef Data = Obj.getBinary()->getData();
+    recordSessionObject(Data);
+    TheJIT->addObject(MemoryBuffer::getMemBufferCopy(Data, "session-object"));
+  } else {
+    TheJIT->addModule(std::move(TheModule));
+  }
+  InitializeModuleAndPassManager();
+}
+
+/// recordInlineBody - Keep a copy of F, just optimized, for inlining into later
+/// modules if it is small enough, and forget any older version.
+static void recordInlineBody(Function *F) {
+  std::string Name = F->getName();
+  InlineBodies.erase(Name);
+  if (!InlineLimit || Profiles || F->hasFnAttribute(Attribute::NoInline) ||
+      countInstructions(*F) > InlineLimit)
+    return;
+  auto M = llvm::make_unique<Module>(Name, *TheContext);
+  M->setDataLayout(TheModule->getDataLayout());
+  copyBody(F, Function::Create(F->getFunctionType(), Function::ExternalLinkage,
+                               Name, M.get()));
+  InlineBodies[Name] = std::move(M);
+}
+
+/// recompileInliners - Name has just been redefined: recompile every
+/// definition that inlined its old body, and in turn those that inlined them.
+static void recompileInliners(const std::string &Name,
+                              std::set<std::string> &Done) {
+  auto I = InlinedInto.find(Name);
+  if (I == InlinedInto.end())
+    return;
+  std::set<std::string> Stale = std::move(I->second);
+  InlinedInto.erase(I);
+
+  for (const std::string &Caller : Stale) {
+    auto AST = DefinitionASTs.find(Caller);
+    if (AST == DefinitionASTs.end() || !Done.insert(Caller).second)
+      continue;
+    Function *F = AST->second->codegen();
+    if (!F) {
+      InitializeModuleAndPassManager();
+      continue;
+    }
+    if (Interactive)
+      fprintf(stderr, "Recompiled %s, which inlined %s\n", Caller.c_str(),
+              Name.c_str());
+    recordInlineBody(F);
+    addDefinitionModule();
+    recompileInliners(Caller, Done);
+  }
+}
+
+/// aliasDefinition - Bind the name of FnAST to the compiled body of an
+/// identical definition instead of compiling it.  Returns false if that body
+/// is gone.
+static bool aliasDefinition(std::shared_ptr<FunctionAST> FnAST,
+                            const SharedBody &B) {
+  typedef std::chrono::steady_clock Clock;
+  auto Start = Clock::now();
+  const PrototypeAST &P = FnAST->getProto();
+  std::string Name = P.getName();
+  if (!TheJIT->addAlias(Name, B.Canonical))
+    return false;
+  recordSessionAlias(Name, B.Canonical);
+
+  // Everything codegen would have recorded about the definition, taken from
+  // the canonical one.
+  ExternFunctions.erase(Name);
+  FunctionProtos.add(llvm::make_unique<PrototypeAST>(P));
+  if (PureFunctions.count(B.Canonical))
+    PureFunctions.insert(Name);
+  else
+    PureFunctions.erase(Name);
+  auto Body = InlineBodies.find(B.Canonical);
+  if (Body != InlineBodies.end()) {
+    Function *Src = Body->second->getFunction(B.Canonical);
+    auto M = llvm::make_unique<Module>(Name, *TheContext);
+    M->setDataLayout(TheModule->getDataLayout());
+    copyBody(Src, Function::Create(Src->getFunctionType(),
+                                   Function::ExternalLinkage, Name, M.get()));
+    InlineBodies[Name] = std::move(M);
+  }
+  // Whatever inlined the canonical body has to be recompiled along with it.
+  for (auto &Callers : InlinedInto)
+    if (Callers.second.count(B.Canonical))
+      Callers.second.insert(Name);
+  DefinitionASTs[Name] = std::move(FnAST);
+
+  if (Interactive)
+    fprintf(stderr, "Read function definition: %s shares the body of %s\n",
+            Name.c_str(), B.Canonical.c_str());
+  ++DedupCounts.Aliased;
+  DedupCounts.AliasSeconds +=
+      std::chrono::duration<double>(Clock::now() - Start).count();
+  DedupCounts.SavedSeconds += B.CompileSeconds;
+  DedupCounts.SavedInstrs += B.Instructions;
+  return true;
+}
+
+/// compileDefinition - Compile a parsed definition and hand it to the JIT.
+static void compileDefinition(std::shared_ptr<FunctionAST> FnAST) {
+  typedef std::chrono::steady_clock Clock;
+  if (Simplify)
+    FnAST->simplify();
+
+  // Workers link objects rather than symbols, and profiled and batch code
+  // keeps per-name state, so those compile every definition.
+  const PrototypeAST &Proto = FnAST->getProto();
+  bool Dedupable = Dedup && !Workers && !Profiles && !EmitMap && !BenchMap;
+  std::string Key;
+  if (Dedupable) {
+    if (Proto.isUnaryOp() || Proto.isBinaryOp() ||
+        FunctionProtos.find(Proto.getName())) {
+      // Bodies compiled so far may mean something else from now on.
+      SharedBodies.clear();
+      Dedupable = false;
+    } else {
+      auto Start = Clock::now();
+      Key = FnAST->getBodyKey();
+      DedupCounts.KeySeconds +=
+          std::chrono::duration<double>(Clock::now() - Start).count();
+      auto Shared = SharedBodies.find(Key);
+      if (Shared != SharedBodies.end() &&
+          aliasDefinition(FnAST, Shared->second))
+        return;
+    }
+  }
+
+  auto Start = Clock::now();
+  uint64_t Instrs = SimplifyCounts.OptimizedInstrs;
+  if (auto *FnIR = FnAST->codegen()) {
+    Instrs = SimplifyCounts.OptimizedInstrs - Instrs;
+    if (Interactive) {
+      fprintf(stderr, "Read function definition:");
+      FnIR->dump();
+    }
+
+    // Operators are only ever called from expressions, so they never get a
+    // batch entry point.
+    std::string Name = FnIR->getName();
+    unsigned Arity = FnIR->arg_size();
+    const PrototypeAST &P = *FunctionProtos.find(Name);
+    bool WantMap = (EmitMap || BenchMap) && !P.isUnaryOp() && !P.isBinaryOp();
+    recordInlineBody(FnIR);
+    if (WantMap) {
+      emitMapEntryPoint(FnIR);
+      optimizeMapEntryPoints(*TheModule);
+    }
+    addDefinitionModule();
+    double Secs = std::chrono::duration<double>(Clock::now() - Start).count();
+    ++DedupCounts.Compiled;
+    DedupCounts.CompileSeconds += Secs;
+    if (Dedupable)
+      SharedBodies[Key] = SharedBody{Name, Secs, Instrs};
+
+    // Definitions that inlined an older version of this one are stale now.
+    DefinitionASTs[Name] = FnAST;
+    std::set<std::string> Done;
+    Done.insert(Name);
+    recompileInliners(Name, Done);
+
+    if (WantMap && BenchMap && !Workers)
+      benchmarkMapEntryPoint(Name, Arity);
+
+    if (Profiles)
+      installProfile(std::move(FnAST));
+  }
+}
+
+static void HandleDefinition() {
+  if (std::shared_ptr<FunctionAST> FnAST = ParseDefinition()) {
+    compileDefinition(std::move(FnAST));
+  } else {
+    // Skip token for error recovery.
+    getNextToken();
+  }
+}
+
+/// declareExternArray - Make the host array Name visible to code.
+static void declareExternArray(const std::string &Name) {
+  if (!isHostArray(Name)) {
+    printMessage("Error: array %s is not bound by the host\n", Name.c_str());
+    return;
+  }
+  ArrayNames.insert(Name);
+  if (Interactive)
+    fprintf(stderr, "Read extern array %s\n", Name.c_str());
+}
+
+/// declareExtern - Declare a parsed extern function.
+static void declareExtern(std::unique_ptr<PrototypeAST> ProtoAST) {
+  if (FunctionProtos.find(ProtoAST->getName()))
+    SharedBodies.clear();
+  ExternFunctions.insert(ProtoAST->getName());
+  if (auto *FnIR = ProtoAST->codegen()) {
+    if (Interactive) {
+      fprintf(stderr, "Read extern: ");
+      FnIR->dump();
+    }
+    if (Profiles)
+      recordPrototype(*ProtoAST);
+    FunctionProtos.add(std::move(ProtoAST));
+  }
+}
+
+static void HandleExtern() {
+  auto ProtoAST = ParseExtern();
+  if (!ProtoAST && isExternArray()) {
+    declareExternArray(ParseExternArray());
+    return;
+  }
+
+  if (ProtoAST) {
+    declareExtern(std::move(ProtoAST));
+  } else {
+    // Skip token for error recovery.
+    getNextToken();
+  }
+}
+
+/// ExprOutput - What a top-level expression run under -async-exprs has printed
+/// so far.  Its parfor iterations may print to it from other threads.
+struct ExprOutput {
+  std::mutex Lock;
+  std::string Text;
+};
+
+/// CurOutput - Where the library functions print on this thread: an
+/// expression's buffer, or stderr when null.
+static thread_local ExprOutput *CurOutput = nullptr;
+
+/// PendingExpr - A top-level expression handed to the thread pool, or, without
+/// Done, a compiler message queued behind the expressions before it.
+struct PendingExpr {
+  std::future<void> Done;
+  KaleidoscopeJIT::ModuleHandleT Handle;
+  ExprOutput Output;
+  double Result = 0;
+};
+
+/// PendingExprs - The expressions still running, or waiting to be reported,
+/// oldest first.
+static thread_local std::deque<std::unique_ptr<PendingExpr>> PendingExprs;
+
+/// completeOldestExpr - Wait for the oldest pending expression, write out what
+/// it printed and its result, and unlink its module.
+static void completeOldestExpr() {
+  std::unique_ptr<PendingExpr> E = std::move(PendingExprs.front());
+  PendingExprs.pop_front();
+  if (E->Done.valid())
+    E->Done.wait();
+  fwrite(E->Output.Text.data(), 1, E->Output.Text.size(), stderr);
+  if (!E->Done.valid())
+    return;
+  if (PrintResults)
+    fprintf(stderr, "Evaluated to %f\n", E->Result);
+  TheJIT->removeModule(E->Handle);
+}
+
+/// queueMessage - Queue Text to be printed after the pending expressions, if
+/// there are any.
+static bool queueMessage(const std::string &Text) {
+  if (PendingExprs.empty())
+    return false;
+  auto E = llvm::make_unique<PendingExpr>();
+  E->Output.Text = Text;
+  PendingExprs.push_back(std::move(E));
+  return true;
+}
+
+/// finishAsyncExprs - Wait for and report every pending expression.
+static void finishAsyncExprs() {
+  while (!PendingExprs.empty())
+    completeOldestExpr();
+}
+
+/// runExprAsync - Call FP, the linked entry point of the expression in module
+/// H, on the thread pool.  The module stays linked until it is reported.
+static void runExprAsync(double (*FP)(), KaleidoscopeJIT::ModuleHandleT H) {
+  auto E = llvm::make_unique<PendingExpr>();
+  PendingExpr *P = E.get();
+  P->Handle = H;
+  P->Done = getParforPool().async([FP, P] {
+    ExprOutput *Saved = CurOutput;
+    CurOutput = &P->Output;
+    P->Result = FP();
+    CurOutput = Saved;
+  });
+  PendingExprs.push_back(std::move(E));
+
+  // Don't let compilation run arbitrarily far ahead.
+  while (PendingExprs.size() > 2 * getParforPool().size())
+    completeOldestExpr();
+}
+
+/// LinkedExpr - A top-level expression compiled and linked into the JIT: its
+/// entry point and the module to unlink once it has run.
+struct LinkedExpr {
+  double (*FP)();
+  KaleidoscopeJIT::ModuleHandleT Handle;
+};
+
+/// LinkedExprSink - Under -stream, where the compile stage passes linked
+/// expressions on to be run.
+static thread_local std::function<void(const LinkedExpr &)> LinkedExprSink;
+
+/// runTopLevelExpr - Compile a parsed top-level expression and run it.
+static void runTopLevelExpr(std::unique_ptr<FunctionAST> FnAST) {
+  if (Simplify)
+    FnAST->simplify();
+  if (!FnAST->codegen())
+    return;
+
+  // In worker mode, only compile here; the result is reported by
+  // reportWorkerResult once a worker has run it.
+  if (Workers) {
+    auto Obj = TheJIT->compileModule(*TheModule);
+    InitializeModuleAndPassManager();
+    Workers->runObject(Obj.getBinary()->getData(), "__anon_expr");
+    return;
+  }
+
+  // JIT the module containing the anonymous expression, keeping a handle so
+  // we can free it later.
+  auto H = TheJIT->addModule(std::move(TheModule));
+  InitializeModuleAndPassManager();
+
+  // Search the JIT for the __anon_expr symbol.
+  auto ExprSymbol = TheJIT->findSymbol("__anon_expr");
+  assert(ExprSymbol && "Function not found");
+
+  // Get the symbol's address and cast it to the right type (takes no
+  // arguments, returns a double) so we can call it as a native function.
+  // Getting it links the module, against the definitions made so far.
+  double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
+  if (LinkedExprSink) {
+    LinkedExprSink(LinkedExpr{FP, H});
+    return;
+  }
+  if (AsyncExprs) {
+    runExprAsync(FP, H);
+    return;
+  }
+  double Result = FP();
+  if (PrintResults)
+    fprintf(stderr, "Evaluated to %f\n", Result);
+
+  // Delete the anonymous expression module from the JIT.
+  TheJIT->removeModule(H);
+
+  // Running it may have made some definitions hot.
+  if (Profiles)
+    queueHotFunctions();
+}
+
+static void HandleTopLevelExpression() {
+  // Evaluate a top-level expression into an anonymous function.
+  if (auto FnAST = ParseTopLevelExpr()) {
+    runTopLevelExpr(std::move(FnAST));
+  } else {
+    // Skip token for error recovery.
+    getNextToken();
+  }
+}
+
+/// reportWorkerResult - Print the outcome of an expression run by a worker.
+static void reportWorkerResult(const WorkerResult &R) {
+  if (!R.Ok)
+    fprintf(stderr, "Error: %s\n", R.Error.c_str());
+  else if (PrintResults)
+    fprintf(stderr, "Evaluated to %f\n", R.Value);
+}
+
+/// top ::= definition | external | expression | ';'
+static void MainLoop() {
+  while (1) {
+    if (Interactive)
+      fprintf(stderr, "ready> ");
+    switch (CurTok) {
+    case tok_eof:
+      finishAsyncExprs();
+      return;
+    case ';': // ignore top-level semicolons.
+      getNextToken();
+      break;
+    case tok_extern:
+      HandleExtern();
+      ++ItemsHandled;
+      break;
+    default:
+      if (isDefinitionStart())
+        HandleDefinition();
+      else
+        HandleTopLevelExpression();
+      ++ItemsHandled;
+      break;
+    }
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Sessions
+//===----------------------------------------------------------------------===//
+
+/// installStandardOperators - Reset the calling thread's operator table to the
+/// built-in binary operators.
+static void installStandardOperators() {
+  // 1 is lowest precedence.
+  BinopPrecedence.clear();
+  BinopPrecedence['='] = 2;
+  BinopPrecedence['<'] = 10;
+  BinopPrecedence['+'] = 20;
+  BinopPrecedence['-'] = 20;
+  BinopPrecedence['*'] = 40; // highest.
+}
+
+/// printDiagnostic - The context's diagnostic handler under -vectorize-remarks.
+/// Remarks from the vectorizers are printed with the function they are about;
+/// other remarks are dropped, and anything else is handled as LLVM would.
+static void printDiagnostic(const DiagnosticInfo &DI, void *) {
+  std::string Text;
+  raw_string_ostream OS(Text);
+  if (auto *R = dyn_cast<DiagnosticInfoOptimizationBase>(&DI)) {
+    StringRef Pass = R->getPassName();
+    if (DI.getKind() == DK_OptimizationFailure || Pass == "loop-vectorize" ||
+        Pass == "slp-vectorizer") {
+      OS << "remark: " << R->getFunction().getName() << ": " << Pass << ": "
+         << R->getMsg() << "\n";
+      printMessage("%s", OS.str().c_str());
+    }
+    return;
+  }
+  if (DI.getSeverity() == DS_Remark || DI.getSeverity() == DS_Note)
+    return;
+
+  OS << (DI.getSeverity() == DS_Error ? "error: " : "warning: ");
+  DiagnosticPrinterRawOStream DP(OS);
+  DI.print(DP);
+  OS << "\n";
+  printMessage("%s", OS.str().c_str());
+  if (DI.getSeverity() == DS_Error) {
+    finishAsyncExprs();
+    exit(1);
+  }
+}
+
+/// InitializeSession - Create the calling thread's compiler state: a fresh
+/// LLVMContext and IR builder, the standard operator table and its own JIT.
+static void InitializeSession() {
+  TheContext = llvm::make_unique<LLVMContext>();
+  if (VectorizeRemarks)
+    TheContext->setDiagnosticHandler(printDiagnostic, nullptr);
+  Builder = llvm::make_unique<IRBuilder<>>(*TheContext);
+
+  installStandardOperators();
+
+  TheJIT = llvm::make_unique<KaleidoscopeJIT>();
+  InitializeModuleAndPassManager();
+}
+
+/// FinalizeSession - Tear down the calling thread's compiler state.  Everything
+/// that refers into the context has to go before the context itself, so this is
+/// done explicitly rather than left to thread_local destruction order.
+static void FinalizeSession() {
+  TheFPM.reset();
+  TheModule.reset();
+  NamedValues.clear();
+  FunctionProtos.clear();
+  TheJIT.reset();
+  Builder.reset();
+  TheContext.reset();
+}
+
+namespace {
+/// KaleidoscopeSession - An isolated compile-and-execute session over a piece
+/// of source text.  The session runs on its own thread, and since all compiler
+/// state is thread_local it gets its own LLVMContext, JIT, prototypes and
+/// operator table; any number of sessions can compile and run concurrently.
+class KaleidoscopeSession {
+  std::string Source;
+  bool Quiet;
+  unsigned NumItems = 0;
+  std::thread Thread;
 
-  // Reload, increment, and restore the alloca.  This handles the case where
-  // the body of the loop mutates the variable.
-  Value *CurVar = Builder.CreateLoad(Alloca, VarName.c_str());
-  Value *NextVar = Builder.CreateFAdd(CurVar, StepVal, "nextvar");
-  Builder.CreateStore(NextVar, Alloca);
+public:
+  KaleidoscopeSession(std::string Source, bool Quiet = false)
+      : Source(std::move(Source)), Quiet(Quiet) {}
+
+  /// start - Begin compiling and running the source on a new thread.
+  void start() { Thread = std::thread([this] { run(); }); }
+
+  /// join - Wait for the session to reach the end of its source.
+  void join() { Thread.join(); }
+
+  /// getNumItems - The number of top-level items handled so far; only stable
+  /// after join().
+  unsigned getNumItems() const { return NumItems; }
+
+private:
+  void run() {
+    SessionInput = &Source;
+    SessionInputPos = 0;
+    Interactive = false;
+    PrintResults = !Quiet;
+    ItemsHandled = 0;
+
+    InitializeSession();
+    if (PGO)
+      startProfiling();
+    getNextToken();
+    MainLoop();
+    if (PGO)
+      finishProfiling();
+    FinalizeSession();
 
-  // Convert condition to a bool by comparing equal to 0.0.
-  EndCond = Builder.CreateFCmpONE(
-      EndCond, ConstantFP::get(getGlobalContext(), APFloat(0.0)), "loopcond");
+    NumItems = ItemsHandled;
+  }
+};
+} // end anonymous namespace
 
-  // Create the "after loop" block and insert it.
-  BasicBlock *AfterBB =
-      BasicBlock::Create(getGlobalContext(), "afterloop", TheFunction);
+/// benchmarkSessions - Run the script on standard input in 1, 2, 4, ... up to
+/// MaxSessions concurrent sessions and report how throughput scales.
+static void benchmarkSessions(unsigned MaxSessions) {
+  std::string Script;
+  for (int C = getchar(); C != EOF; C = getchar())
+    Script += (char)C;
+
+  std::vector<unsigned> Counts;
+  for (unsigned N = 1; N < MaxSessions; N *= 2)
+    Counts.push_back(N);
+  Counts.push_back(MaxSessions);
+
+  typedef std::chrono::steady_clock Clock;
+  double BaseRate = 0;
+  for (unsigned N : Counts) {
+    std::vector<std::unique_ptr<KaleidoscopeSession>> Sessions;
+    for (unsigned i = 0; i != N; ++i)
+      Sessions.push_back(llvm::make_unique<KaleidoscopeSession>(Script, true));
+
+    auto Start = Clock::now();
+    for (auto &S : Sessions)
+      S->start();
+    unsigned Items = 0;
+    for (auto &S : Sessions) {
+      S->join();
+      Items += S->getNumItems();
+    }
+    double Secs = std::chrono::duration<double>(Clock::now() - Start).count();
+
+    double Rate = Items / Secs;
+    if (N == 1)
+      BaseRate = Rate;
+    fprintf(stderr,
+            "bench-sessions: %2u sessions: %8.2f ms, %10.1f items/s (%.2fx)\n",
+            N, Secs * 1000, Rate, BaseRate > 0 ? Rate / BaseRate : 0.0);
+  }
+}
 
-  // Insert the conditional branch into the end of LoopEndBB.
-  Builder.CreateCondBr(EndCond, LoopBB, AfterBB);
+/// benchmarkScopes - Parse NumDefs generated definitions whose bodies nest
+/// var scopes deeply, then time their codegen (optimization included) and
+/// report definitions and variable bindings per second.
+static void benchmarkScopes(unsigned NumDefs) {
+  // Every level binds a, b and c again, shadowing the level around it, and one
+  // of t0 ... t7, so lookups land on both fresh and much older bindings.
+  const unsigned Depth = 64, BindingsPerLevel = 4;
+  std::string Script;
+  for (unsigned D = 0; D != NumDefs; ++D) {
+    Script += "def scopes" + std::to_string(D) + "(x y)\n";
+    Script += "  var a = x, b = y, c = x * y, t0 = x, t1 = x, t2 = x, t3 = x, "
+              "t4 = x, t5 = x, t6 = x, t7 = x in\n";
+    for (unsigned L = 0; L != Depth; ++L) {
+      std::string T = "t" + std::to_string(L % 8);
+      Script += "  var a = b + c, b = a * x - " + T + ", c = b - y, " + T +
+                " = a + t" + std::to_string((L + 3) % 8) + " in\n";
+    }
+    Script += "  a + b + c + t0 + t7;\n";
+  }
 
-  // Any new code will be inserted in AfterBB.
-  Builder.SetInsertPoint(AfterBB);
+  SessionInput = &Script;
+  SessionInputPos = 0;
+  Interactive = false;
+  InitializeSession();
 
-  // Restore the unshadowed variable.
-  if (OldVal)
-    NamedValues[VarName] = OldVal;
-  else
-    NamedValues.erase(VarName);
+  std::vector<std::unique_ptr<FunctionAST>> Defs;
+  for (getNextToken(); CurTok == tok_def;) {
+    auto FnAST = ParseDefinition();
+    if (!FnAST)
+      break;
+    Defs.push_back(std::move(FnAST));
+    if (CurTok == ';')
+      getNextToken();
+  }
 
-  // for expr always returns 0.0.
-  return Constant::getNullValue(Type::getDoubleTy(getGlobalContext()));
+  typedef std::chrono::steady_clock Clock;
+  auto Start = Clock::now();
+  unsigned Compiled = 0;
+  for (auto &FnAST : Defs)
+    if (FnAST->codegen())
+      ++Compiled;
+  double Secs = std::chrono::duration<double>(Clock::now() - Start).count();
+
+  uint64_t Bindings = (uint64_t)Compiled * (Depth * BindingsPerLevel + 13);
+  fprintf(stderr,
+          "bench-scopes: %u definitions, %u nested scopes each: %8.2f ms, "
+          "%10.1f definitions/s, %12.1f bindings/s\n",
+          Compiled, Depth + 1, Secs * 1000, Compiled / Secs, Bindings / Secs);
+  FinalizeSession();
+  SessionInput = nullptr;
 }
 
-Value *VarExprAST::codegen() {
-  std::vector<AllocaInst *> OldBindings;
+//===----------------------------------------------------------------------===//
+// Streaming driver (-stream)
+//===----------------------------------------------------------------------===//
 
-  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+// For large piped input the main session runs as a pipeline of three threads
+// joined by bounded queues: one lexes and parses, the session's own thread
+// compiles and links, and one runs the linked expressions in order.  A stage
+// only waits when the next one is -stream-depth items behind, so a script runs
+// at the speed of its slowest stage rather than of all three in turn.
 
-  // Register all variables and emit their initializer.
-  for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
-    const std::string &VarName = VarNames[i].first;
-    ExprAST *Init = VarNames[i].second.get();
+namespace {
+/// BoundedQueue - A FIFO of at most Capacity items between two threads.  push
+/// blocks while it is full and pop while it is empty, until it is closed.
+template <typename T> class BoundedQueue {
+  std::mutex Lock;
+  std::condition_variable NotEmpty, NotFull;
+  std::deque<T> Items;
+  size_t Capacity;
+  bool Closed = false;
 
-    // Emit the initializer before adding the variable to scope, this prevents
-    // the initializer from referencing the variable itself, and permits stuff
-    // like this:
-    //  var a = 1 in
-    //    var a = a in ...   # refers to outer 'a'.
-    Value *InitVal;
-    if (Init) {
-      InitVal = Init->codegen();
-      if (!InitVal)
-        return nullptr;
-    } else { // If not specified, use 0.0.
-      InitVal = ConstantFP::get(getGlobalContext(), APFloat(0.0));
-    }
+public:
+  explicit BoundedQueue(size_t Capacity) : Capacity(Capacity ? Capacity : 1) {}
 
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
-    Builder.CreateStore(InitVal, Alloca);
+  void push(T Item) {
+    std::unique_lock<std::mutex> Guard(Lock);
+    NotFull.wait(Guard, [this] { return Items.size() < Capacity; });
+    Items.push_back(std::move(Item));
+    NotEmpty.notify_one();
+  }
 
-    // Remember the old variable binding so that we can restore the binding when
-    // we unrecurse.
-    OldBindings.push_back(NamedValues[VarName]);
+  /// close - Nothing more will be pushed.
+  void close() {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Closed = true;
+    NotEmpty.notify_all();
+  }
 
-    // Remember this binding.
-    NamedValues[VarName] = Alloca;
+  /// pop - Take the oldest item; false once the queue is closed and empty.
+  bool pop(T &Item) {
+    std::unique_lock<std::mutex> Guard(Lock);
+    NotEmpty.wait(Guard, [this] { return Closed || !Items.empty(); });
+    if (Items.empty())
+      return false;
+    Item = std::move(Items.front());
+    Items.pop_front();
+    NotFull.notify_one();
+    return true;
   }
+};
 
-  // Codegen the body, now that all vars are in scope.
-  Value *BodyVal = Body->codegen();
-  if (!BodyVal)
-    return nullptr;
+/// ParsedItem - A top-level item on its way from the parse stage to the compile
+/// stage.
+struct ParsedItem {
+  enum ItemKind { PI_Definition, PI_Extern, PI_ExternArray, PI_Expression };
+  ItemKind Kind = PI_Expression;
+  std::unique_ptr<FunctionAST> Function;
+  std::unique_ptr<PrototypeAST> Proto;
+  std::string Array;
+};
+} // end anonymous namespace
 
-  // Pop all our variables from scope.
-  for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
-    NamedValues[VarNames[i].first] = OldBindings[i];
+typedef std::chrono::steady_clock StageClock;
 
-  // Return the body computation.
-  return BodyVal;
+/// secondsSince - The time since T, in seconds.
+static double secondsSince(StageClock::time_point T) {
+  return std::chrono::duration<double>(StageClock::now() - T).count();
 }
 
-Function *PrototypeAST::codegen() {
-  // Make the function type:  double(double,double) etc.
-  std::vector<Type *> Doubles(Args.size(),
-                              Type::getDoubleTy(getGlobalContext()));
-  FunctionType *FT =
-      FunctionType::get(Type::getDoubleTy(getGlobalContext()), Doubles, false);
-
-  Function *F =
-      Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+/// parseStage - Lex and parse standard input into Out.  The thread has its own
+/// lexer and operator table, which start with the operators and arrays in
+/// Operators and Arrays (what -load-session restored); a binary operator is
+/// installed as soon as its definition is parsed, since the items after it may
+/// use it.
+static void parseStage(BoundedQueue<ParsedItem> &Out, double &BusySecs,
+                       const std::map<char, int> &Operators,
+                       const std::set<std::string> &Arrays) {
+  installStandardOperators();
+  for (auto &Op : Operators)
+    BinopPrecedence[Op.first] = Op.second;
+  ArrayDeclarations = Arrays;
+  auto Start = StageClock::now();
+  getNextToken();
+  while (CurTok != tok_eof) {
+    ParsedItem Item;
+    bool Parsed = false;
+    switch (CurTok) {
+    case ';': // ignore top-level semicolons.
+      getNextToken();
+      continue;
+    case tok_extern:
+      Item.Kind = ParsedItem::PI_Extern;
+      if ((Item.Proto = ParseExtern())) {
+        Parsed = true;
+      } else if (isExternArray()) {
+        Item.Kind = ParsedItem::PI_ExternArray;
+        Item.Array = ParseExternArray();
+        Parsed = true;
+      }
+      break;
+    default:
+      if (isDefinitionStart()) {
+        Item.Kind = ParsedItem::PI_Definition;
+        if ((Item.Function = ParseDefinition())) {
+          const PrototypeAST &P = Item.Function->getProto();
+          if (P.isBinaryOp())
+            BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+          Parsed = true;
+        }
+      } else {
+        Item.Kind = ParsedItem::PI_Expression;
+        Parsed = (bool)(Item.Function = ParseTopLevelExpr());
+      }
+      break;
+    }
+    if (!Parsed) {
+      // Skip token for error recovery.
+      getNextToken();
+      continue;
+    }
+    BusySecs += secondsSince(Start);
+    Out.push(std::move(Item));
+    Start = StageClock::now();
+  }
+  BusySecs += secondsSince(Start);
+  Out.close();
+}
 
-  // Set names for all arguments.
-  unsigned Idx = 0;
-  for (auto &Arg : F->args())
-    Arg.setName(Args[Idx++]);
+/// runStream - Handle standard input as a pipeline of parse, compile and run
+/// stages; this thread, which owns the session, is the compile stage.
+static void runStream() {
+  auto Start = StageClock::now();
+  BoundedQueue<ParsedItem> Parsed(StreamDepth);
+  BoundedQueue<LinkedExpr> Linked(StreamDepth);
+  double ParseSecs = 0, CompileSecs = 0, RunSecs = 0;
+
+  // Expressions that have run, waiting for this thread (whose JIT they are
+  // in) to unlink them.
+  std::mutex RetiredLock;
+  std::vector<KaleidoscopeJIT::ModuleHandleT> Retired;
+
+  std::map<char, int> Operators = BinopPrecedence;
+  std::set<std::string> Arrays = ArrayDeclarations;
+  std::thread Parser(
+      [&] { parseStage(Parsed, ParseSecs, Operators, Arrays); });
+  bool Print = PrintResults;
+  std::thread Runner([&] {
+    LinkedExpr E;
+    while (Linked.pop(E)) {
+      auto T = StageClock::now();
+      double Result = E.FP();
+      RunSecs += secondsSince(T);
+      if (Print)
+        fprintf(stderr, "Evaluated to %f\n", Result);
+      std::lock_guard<std::mutex> Guard(RetiredLock);
+      Retired.push_back(E.Handle);
+    }
+  });
 
-  return F;
+  auto UnlinkRetired = [&] {
+    std::vector<KaleidoscopeJIT::ModuleHandleT> Done;
+    {
+      std::lock_guard<std::mutex> Guard(RetiredLock);
+      Done.swap(Retired);
+    }
+    for (auto &H : Done)
+      TheJIT->removeModule(H);
+  };
+
+  // Time spent waiting for the run stage is not compile time.
+  double WaitSecs = 0;
+  LinkedExprSink = [&](const LinkedExpr &E) {
+    auto T = StageClock::now();
+    Linked.push(E);
+    WaitSecs += secondsSince(T);
+  };
+
+  ParsedItem Item;
+  while (Parsed.pop(Item)) {
+    auto T = StageClock::now();
+    UnlinkRetired();
+    switch (Item.Kind) {
+    case ParsedItem::PI_Definition:
+      compileDefinition(std::move(Item.Function));
+      break;
+    case ParsedItem::PI_Extern:
+      declareExtern(std::move(Item.Proto));
+      break;
+    case ParsedItem::PI_ExternArray:
+      declareExternArray(Item.Array);
+      break;
+    case ParsedItem::PI_Expression:
+      runTopLevelExpr(std::move(Item.Function));
+      break;
+    }
+    ++ItemsHandled;
+    CompileSecs += secondsSince(T);
+  }
+  CompileSecs -= WaitSecs;
+
+  LinkedExprSink = nullptr;
+  Linked.close();
+  Runner.join();
+  Parser.join();
+  UnlinkRetired();
+
+  if (StreamStats)
+    fprintf(stderr,
+            "stream: %u items in %.2f ms; busy: parse %.2f ms, compile %.2f "
+            "ms, run %.2f ms\n",
+            ItemsHandled, secondsSince(Start) * 1000, ParseSecs * 1000,
+            CompileSecs * 1000, RunSecs * 1000);
 }
 
-Function *FunctionAST::codegen() {
-  // Transfer ownership of the prototype to the FunctionProtos map, but keep a
-  // reference to it for use below.
-  auto &P = *Proto;
-  FunctionProtos[Proto->getName()] = std::move(Proto);
-  Function *TheFunction = getFunction(P.getName());
-  if (!TheFunction)
-    return nullptr;
+//===----------------------------------------------------------------------===//
+// Profile-guided reoptimization (-pgo)
+//===----------------------------------------------------------------------===//
 
-  // If this is an operator, install it.
-  if (P.isBinaryOp())
-    BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+/// recordPrototype - Remember P for the reoptimizer, which compiles on its own
+/// thread and so has its own (initially empty) FunctionProtos.
+static void recordPrototype(const PrototypeAST &P) {
+  std::lock_guard<std::mutex> Guard(Profiles->Lock);
+  Profiles->Protos[P.getName()] = llvm::make_unique<PrototypeAST>(P);
+}
 
-  // Create a new basic block to start insertion into.
-  BasicBlock *BB = BasicBlock::Create(getGlobalContext(), "entry", TheFunction);
-  Builder.SetInsertPoint(BB);
+/// installProfile - Make the definition just added to the JIT the current one
+/// for its name: point the call slot at its instrumented code and keep the AST
+/// for the reoptimizer.  FunctionAST::codegen left its profile in CurProfile.
+static void installProfile(std::shared_ptr<FunctionAST> FnAST) {
+  FunctionProfile *P = CurProfile;
+  CurProfile = nullptr;
+  recordPrototype(FnAST->getProto());
+
+  const std::string &Name = FnAST->getProto().getName();
+  P->InstrumentedAddr = TheJIT->findSymbol(Name).getAddress();
+  P->AST = std::move(FnAST);
+
+  std::lock_guard<std::mutex> Guard(Profiles->Lock);
+  auto &Slot = Profiles->Slots[P->Name];
+  if (!Slot)
+    Slot = llvm::make_unique<CallSlot>();
+  Slot->Address.store(P->InstrumentedAddr);
+  Profiles->Current[P->Name] = P;
+}
 
-  // Record the function arguments in the NamedValues map.
-  NamedValues.clear();
-  for (auto &Arg : TheFunction->args()) {
-    // Create an alloca for this variable.
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
+/// optimizeFromProfile - The module pipeline for reoptimized definitions: the
+/// per-function passes plus inlining of the hot call sites, loop rotation and
+/// unrolling, steered by the branch weights and unroll hints codegen attached.
+static void optimizeFromProfile(Module &M) {
+  legacy::PassManager PM;
+  addTargetLibraryInfo(PM);
+  PM.add(createTargetTransformInfoWrapperPass(
+      TheJIT->getTargetMachine().getTargetIRAnalysis()));
+  PM.add(createAlwaysInlinerPass());
+  // The private copies of the inlined callees are dead now.
+  PM.add(createGlobalDCEPass());
+  PM.add(createPromoteMemoryToRegisterPass());
+  PM.add(createInstructionCombiningPass());
+  PM.add(createReassociatePass());
+  PM.add(createGVNPass());
+  PM.add(createCFGSimplificationPass());
+  PM.add(createLoopRotatePass());
+  PM.add(createLICMPass());
+  PM.add(createIndVarSimplifyPass());
+  PM.add(createLoopUnrollPass());
+  PM.add(createInstructionCombiningPass());
+  PM.add(createCFGSimplificationPass());
+  PM.run(M);
+}
 
-    // Store the initial value into the alloca.
-    Builder.CreateStore(&Arg, Alloca);
+namespace {
+/// Reoptimizer - Recompiles hot definitions on a background thread.  The
+/// thread is a session of its own (context, JIT) that compiles the shared ASTs
+/// again in PM_Optimize mode, links the result into its JIT and stores the new
+/// address into the definition's call slot, at which point every caller picks
+/// it up.
+class Reoptimizer {
+  /// Specialization - A copy of a definition compiled for some constant
+  /// arguments, reached from call sites through Slot.  Weight is the number of
+  /// calls seen at the sites that asked for it, and decides eviction.
+  struct Specialization {
+    std::string Key;
+    CallSlot Slot;
+    uint64_t Weight = 0;
+    KaleidoscopeJIT::ModuleHandleT Handle;
+    bool Evicted = false, Freed = false;
+    uint64_t EvictedAt = 0;
+  };
+
+  std::shared_ptr<ProfileState> State;
+  std::mutex Lock;
+  std::condition_variable Wake, Idle;
+  std::deque<FunctionProfile *> Queue;
+  bool Stopping = false;
+  bool Working = false;
+  std::list<Specialization> Specializations;
+  std::atomic<unsigned> NumCompiled, NumLive, NumEvicted;
+  std::thread Thread;
 
-    // Add arguments to variable symbol table.
-    NamedValues[Arg.getName()] = Alloca;
+public:
+  explicit Reoptimizer(std::shared_ptr<ProfileState> State)
+      : State(std::move(State)), NumCompiled(0), NumLive(0), NumEvicted(0) {
+    Thread = std::thread([this] { run(); });
   }
 
-  if (Value *RetVal = Body->codegen()) {
-    // Finish off the function.
-    Builder.CreateRet(RetVal);
+  ~Reoptimizer() {
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      Stopping = true;
+    }
+    Wake.notify_one();
+    Thread.join();
+  }
 
-    // Validate the generated code, checking for consistency.
-    verifyFunction(*TheFunction);
+  void enqueue(FunctionProfile *P) {
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      Queue.push_back(P);
+    }
+    Wake.notify_one();
+  }
 
-    // Run the optimizer on the function.
-    TheFPM->run(*TheFunction);
+  /// waitIdle - Block until everything queued so far has been recompiled.
+  void waitIdle() {
+    std::unique_lock<std::mutex> Guard(Lock);
+    Idle.wait(Guard, [this] { return Queue.empty() && !Working; });
+  }
 
-    return TheFunction;
+  void printSpecializationStats() const {
+    fprintf(stderr, "pgo: %u specializations compiled, %u live, %u evicted\n",
+            NumCompiled.load(), NumLive.load(), NumEvicted.load());
   }
 
-  // Error reading body, remove function.
-  TheFunction->eraseFromParent();
+private:
+  void run() {
+    InitializeSession();
+    Interactive = false;
+    Profiles = State;
+    ProfileMode = PM_Optimize;
+
+    while (true) {
+      FunctionProfile *P;
+      {
+        std::unique_lock<std::mutex> Guard(Lock);
+        Wake.wait(Guard, [this] { return Stopping || !Queue.empty(); });
+        if (Queue.empty())
+          break;
+        P = Queue.front();
+        Queue.pop_front();
+        Working = true;
+      }
+      freeEvicted();
+      recompile(P);
+      {
+        std::lock_guard<std::mutex> Guard(Lock);
+        Working = false;
+      }
+      Idle.notify_all();
+    }
 
-  if (P.isBinaryOp())
-    BinopPrecedence.erase(Proto->getOperatorName());
-  return nullptr;
-}
+    // The optimized code dies with this thread's JIT; by now the session has
+    // stopped running code.
+    ProfileMode = PM_None;
+    Profiles.reset();
+    FinalizeSession();
+  }
 
-//===----------------------------------------------------------------------===//
-// Top-Level parsing and JIT Driver
-//===----------------------------------------------------------------------===//
+  /// specialize - A slot for Callee specialized on Consts, compiling one if
+  /// needed.  Once PGOMaxSpecializations are live the least called one is
+  /// evicted to make room, unless it is called more than this request.
+  CallSlot *specialize(FunctionProfile *Callee,
+                       const std::vector<std::pair<unsigned, double>> &Consts,
+                       uint64_t Weight) {
+    std::string Key = Callee->Name;
+    for (auto &C : Consts) {
+      uint64_t Bits;
+      memcpy(&Bits, &C.second, sizeof(Bits));
+      Key += "," + std::to_string(C.first) + "=" + std::to_string(Bits);
+    }
+    for (auto &S : Specializations)
+      if (!S.Evicted && S.Key == Key) {
+        S.Weight += Weight;
+        return &S.Slot;
+      }
+
+    if (NumLive >= PGOMaxSpecializations) {
+      Specialization *Victim = nullptr;
+      for (auto &S : Specializations)
+        if (!S.Evicted && (!Victim || S.Weight < Victim->Weight))
+          Victim = &S;
+      if (!Victim || Victim->Weight >= Weight)
+        return nullptr;
+      // Callers see an empty slot and take their generic path; the code stays
+      // linked until no call into it can still be on the stack.
+      Victim->Slot.Address.store(0);
+      Victim->Evicted = true;
+      Victim->EvictedAt = State->Epoch.load();
+      --NumLive;
+      ++NumEvicted;
+    }
 
-static void InitializeModuleAndPassManager() {
-  // Open a new module.
-  TheModule = llvm::make_unique<Module>("my cool jit", getGlobalContext());
-  TheModule->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
+    // The specialization is a wrapper that passes the constants to a private
+    // copy of the callee and has it inlined.
+    CurProfile = Callee;
+    Function *Generic = Callee->AST->codegen();
+    CurProfile = nullptr;
+    if (!Generic) {
+      InitializeModuleAndPassManager();
+      return nullptr;
+    }
+    Generic->setLinkage(GlobalValue::InternalLinkage);
+
+    std::string Name = Callee->Name + ".spec" + std::to_string(NumCompiled++);
+    Function *Spec = Function::Create(Generic->getFunctionType(),
+                                      Function::ExternalLinkage, Name,
+                                      TheModule.get());
+    Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", Spec));
+    std::vector<Value *> Args;
+    for (auto &Arg : Spec->args())
+      Args.push_back(&Arg);
+    for (auto &C : Consts)
+      Args[C.first] = ConstantFP::get(*TheContext, APFloat(C.second));
+    CallInst *Call = Builder->CreateCall(Generic, Args);
+    Call->addAttribute(AttributeSet::FunctionIndex, Attribute::AlwaysInline);
+    Builder->CreateRet(Call);
+
+    optimizeFromProfile(*TheModule);
+    Specializations.emplace_back();
+    Specialization &S = Specializations.back();
+    S.Key = Key;
+    S.Weight = Weight;
+    S.Handle = TheJIT->addModule(std::move(TheModule));
+    InitializeModuleAndPassManager();
+    S.Slot.Address.store(TheJIT->findSymbol(Name).getAddress());
+    ++NumLive;
+    return &S.Slot;
+  }
 
-  // Create a new pass manager attached to it.
-  TheFPM = llvm::make_unique<legacy::FunctionPassManager>(TheModule.get());
+  /// freeEvicted - Unlink the specializations evicted before the current
+  /// epoch.  Every top-level expression since then has returned, so none can
+  /// be executing them.  Their slots stay allocated, since optimized callers
+  /// still load them.
+  void freeEvicted() {
+    uint64_t Epoch = State->Epoch.load();
+    for (auto &S : Specializations)
+      if (S.Evicted && !S.Freed && S.EvictedAt < Epoch) {
+        TheJIT->removeModule(S.Handle);
+        S.Freed = true;
+      }
+  }
 
-  // Do simple "peephole" optimizations and bit-twiddling optzns.
-  TheFPM->add(createInstructionCombiningPass());
-  // Reassociate expressions.
-  TheFPM->add(createReassociatePass());
-  // Eliminate Common SubExpressions.
-  TheFPM->add(createGVNPass());
-  // Simplify the control flow graph (deleting unreachable blocks, etc).
-  TheFPM->add(createCFGSimplificationPass());
+  void recompile(FunctionProfile *P) {
+    std::vector<FunctionProfile *> Callees;
+    struct SpecRequest {
+      const ExprAST *Site;
+      FunctionProfile *Callee;
+      std::vector<std::pair<unsigned, double>> Consts, Guards;
+      uint64_t Weight;
+    };
+    std::vector<SpecRequest> Requests;
+    {
+      std::lock_guard<std::mutex> Guard(State->Lock);
+      FunctionProtos.clear();
+      for (auto &KV : State->Protos)
+        FunctionProtos.add(llvm::make_unique<PrototypeAST>(*KV.second));
+
+      for (auto &KV : P->Calls) {
+        const CallSiteProfile &CS = KV.second;
+        uint64_t Calls = getCounter(*P, CS.Counter);
+        auto I = State->Current.find(CS.Callee);
+        if (CS.Callee == P->Name || Calls < PGOHotCalls ||
+            I == State->Current.end() || !I->second->AST)
+          continue;
+
+        // Sites with constant arguments get a specialization; the rest inline
+        // the generic callee.
+        SpecRequest R;
+        R.Consts = getConstantArgs(*P, CS);
+        if (!R.Consts.empty() && PGOMaxSpecializations) {
+          R.Site = KV.first;
+          R.Callee = I->second;
+          R.Weight = Calls;
+          for (auto &C : R.Consts)
+            if (!CS.IsLiteral[C.first])
+              R.Guards.push_back(C);
+          Requests.push_back(std::move(R));
+          continue;
+        }
+        if (std::find(Callees.begin(), Callees.end(), I->second) ==
+            Callees.end())
+          Callees.push_back(I->second);
+      }
+    }
 
-  TheFPM->doInitialization();
-}
+    // Specializations live in modules of their own so that they can be
+    // shared between callers and evicted independently.
+    SpecializedCalls.clear();
+    for (auto &R : Requests)
+      if (CallSlot *Slot = specialize(R.Callee, R.Consts, R.Weight))
+        SpecializedCalls[R.Site] = SpecializedCall{Slot, R.Guards};
+
+    // Emit the hot callees first, as private copies for the hot call sites in
+    // P to be inlined from; each uses its own profile.
+    for (FunctionProfile *Callee : Callees) {
+      CurProfile = Callee;
+      if (Function *F = Callee->AST->codegen())
+        F->setLinkage(GlobalValue::InternalLinkage);
+    }
 
-static void HandleDefinition() {
-  if (auto FnAST = ParseDefinition()) {
-    if (auto *FnIR = FnAST->codegen()) {
-      fprintf(stderr, "Read function definition:");
-      FnIR->dump();
-      TheJIT->addModule(std::move(TheModule));
+    CurProfile = P;
+    Function *F = P->AST->codegen();
+    CurProfile = nullptr;
+    SpecializedCalls.clear();
+    if (!F) {
+      fprintf(stderr, "pgo: could not recompile %s\n", P->Name.c_str());
       InitializeModuleAndPassManager();
+      return;
     }
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
+
+    optimizeFromProfile(*TheModule);
+    TheJIT->addModule(std::move(TheModule));
+    InitializeModuleAndPassManager();
+    uint64_t Addr = TheJIT->findSymbol(P->Name).getAddress();
+
+    // Only swap in if P has not been redefined in the meantime.
+    std::lock_guard<std::mutex> Guard(State->Lock);
+    P->OptimizedAddr = Addr;
+    if (State->Current[P->Name] == P)
+      State->Slots[P->Name]->Address.store(Addr);
   }
-}
+};
+} // end anonymous namespace
 
-static void HandleExtern() {
-  if (auto ProtoAST = ParseExtern()) {
-    if (auto *FnIR = ProtoAST->codegen()) {
-      fprintf(stderr, "Read extern: ");
-      FnIR->dump();
-      FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+static thread_local std::unique_ptr<Reoptimizer> TheReoptimizer;
+
+/// queueHotFunctions - Hand every definition that has become hot to the
+/// reoptimizer.
+static void queueHotFunctions() {
+  std::vector<FunctionProfile *> Hot;
+  ++Profiles->Epoch;
+  {
+    std::lock_guard<std::mutex> Guard(Profiles->Lock);
+    for (auto &KV : Profiles->Current) {
+      FunctionProfile *P = KV.second;
+      if (!P->Queued && getCounter(*P, 0) >= PGOHotCalls) {
+        P->Queued = true;
+        Hot.push_back(P);
+      }
     }
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
   }
+  for (FunctionProfile *P : Hot)
+    TheReoptimizer->enqueue(P);
 }
 
-static void HandleTopLevelExpression() {
-  // Evaluate a top-level expression into an anonymous function.
-  if (auto FnAST = ParseTopLevelExpr()) {
-    if (FnAST->codegen()) {
-
-      // JIT the module containing the anonymous expression, keeping a handle so
-      // we can free it later.
-      auto H = TheJIT->addModule(std::move(TheModule));
-      InitializeModuleAndPassManager();
-
-      // Search the JIT for the __anon_expr symbol.
-      auto ExprSymbol = TheJIT->findSymbol("__anon_expr");
-      assert(ExprSymbol && "Function not found");
+/// callWithArgs - Call the double(double, ...) function at Addr.
+static double callWithArgs(uint64_t Addr, const std::vector<double> &A) {
+  intptr_t FP = (intptr_t)Addr;
+  switch (A.size()) {
+  case 0:
+    return ((double (*)())FP)();
+  case 1:
+    return ((double (*)(double))FP)(A[0]);
+  case 2:
+    return ((double (*)(double, double))FP)(A[0], A[1]);
+  case 3:
+    return ((double (*)(double, double, double))FP)(A[0], A[1], A[2]);
+  case 4:
+    return ((double (*)(double, double, double, double))FP)(A[0], A[1], A[2],
+                                                             A[3]);
+  default:
+    llvm_unreachable("too many arguments to time");
+  }
+}
 
-      // Get the symbol's address and cast it to the right type (takes no
-      // arguments, returns a double) so we can call it as a native function.
-      double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
-      fprintf(stderr, "Evaluated to %f\n", FP());
+/// timeCall - Nanoseconds per call of the function at Addr on Args, measured
+/// over at least 20ms.
+static double timeCall(uint64_t Addr, const std::vector<double> &Args) {
+  typedef std::chrono::steady_clock Clock;
+  auto Start = Clock::now();
+  uint64_t Calls = 0;
+  double Elapsed;
+  do {
+    for (unsigned i = 0; i != 16; ++i)
+      callWithArgs(Addr, Args);
+    Calls += 16;
+    Elapsed = std::chrono::duration<double, std::nano>(Clock::now() - Start)
+                  .count();
+  } while (Elapsed < 20e6);
+  return Elapsed / Calls;
+}
 
-      // Delete the anonymous expression module from the JIT.
-      TheJIT->removeModule(H);
+/// reportProfiles - For every reoptimized definition, print its profile and
+/// the per-call time of the instrumented and the reoptimized version, replaying
+/// the arguments of its first call.  Definitions that call externs could print
+/// or otherwise have effects, so those are not timed.
+static void reportProfiles() {
+  std::lock_guard<std::mutex> Guard(Profiles->Lock);
+  for (auto &Prof : Profiles->All) {
+    FunctionProfile &P = *Prof;
+    if (!P.OptimizedAddr)
+      continue;
+    fprintf(stderr, "pgo: %s: %llu calls, %u profiled sites", P.Name.c_str(),
+            (unsigned long long)getCounter(P, 0), (unsigned)P.Sites.size());
+    if (P.CallsExterns || P.SampleArgs.size() > 4) {
+      fprintf(stderr, ", not timed (%s)\n",
+              P.CallsExterns ? "calls externs" : "too many arguments");
+      continue;
     }
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
+    double Before = timeCall(P.InstrumentedAddr, P.SampleArgs);
+    double After = timeCall(P.OptimizedAddr, P.SampleArgs);
+    fprintf(stderr, ", %.1f ns/call instrumented, %.1f ns/call reoptimized "
+                    "(%.2fx)\n",
+            Before, After, After > 0 ? Before / After : 0.0);
   }
+  TheReoptimizer->printSpecializationStats();
 }
 
-/// top ::= definition | external | expression | ';'
-static void MainLoop() {
-  while (1) {
-    fprintf(stderr, "ready> ");
-    switch (CurTok) {
-    case tok_eof:
-      return;
-    case ';': // ignore top-level semicolons.
-      getNextToken();
-      break;
-    case tok_def:
-      HandleDefinition();
-      break;
-    case tok_extern:
-      HandleExtern();
-      break;
-    default:
-      HandleTopLevelExpression();
-      break;
-    }
-  }
+/// startProfiling - Turn on -pgo for the calling session.
+static void startProfiling() {
+  Profiles = std::make_shared<ProfileState>();
+  ProfileMode = PM_Instrument;
+  TheReoptimizer = llvm::make_unique<Reoptimizer>(Profiles);
+}
+
+/// finishProfiling - Let pending recompiles finish, report, and shut down the
+/// reoptimizer.  Must run before the session's own JIT goes away.
+static void finishProfiling() {
+  TheReoptimizer->waitIdle();
+  if (PrintResults)
+    reportProfiles();
+  TheReoptimizer.reset();
+  ProfileMode = PM_None;
+  CurProfile = nullptr;
+  Profiles.reset();
 }
 
 //===----------------------------------------------------------------------===//
 // "Library" functions that can be "extern'd" from user code.
 //===----------------------------------------------------------------------===//
 
+/// printOutput - Print Text for the running code: to stderr, or under
+/// -async-exprs to the buffer of the expression it belongs to.
+static void printOutput(const char *Text, size_t Size) {
+  if (!CurOutput) {
+    fwrite(Text, 1, Size, stderr);
+    return;
+  }
+  std::lock_guard<std::mutex> Guard(CurOutput->Lock);
+  CurOutput->Text.append(Text, Size);
+}
+
 /// putchard - putchar that takes a double and returns 0.
 extern "C" double putchard(double X) {
-  fputc((char)X, stderr);
+  char C = (char)X;
+  printOutput(&C, 1);
   return 0;
 }
 
 /// printd - printf that takes a double prints it as "%f\n", returning 0.
 extern "C" double printd(double X) {
-  fprintf(stderr, "%f\n", X);
+  char Buf[512];
+  int N = snprintf(Buf, sizeof(Buf), "%f\n", X);
+  printOutput(Buf, std::min<size_t>(N, sizeof(Buf) - 1));
   return 0;
 }
 
+/// clockd - Seconds on a monotonic clock, for timing code.
+extern "C" double clockd() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// The float variants that -float32 binds printd, putchard and clockd to.
+
+extern "C" float putchardf(float X) { return putchard(X); }
+
+extern "C" float printdf(float X) { return printd(X); }
+
+/// clockdf - Seconds since the first call: a float cannot hold the time since
+/// boot to the millisecond.
+extern "C" float clockdf() {
+  static const double Start = clockd();
+  return clockd() - Start;
+}
+
+/// kaleidoscope_bounds_error - Called by code that indexed a host array out of
+/// bounds; the read gives NaN or the store is skipped.
+extern "C" void kaleidoscope_bounds_error(double Index, int64_t Length) {
+  char Buf[128];
+  int N = snprintf(Buf, sizeof(Buf),
+                   "Error: index %g out of bounds for array of length %lld\n",
+                   Index, (long long)Length);
+  printOutput(Buf, std::min<size_t>(N, sizeof(Buf) - 1));
+}
+
+/// MaxParforChunks - How many pieces a parfor range is cut into at most.  It
+/// does not depend on the number of threads, so neither do the results.
+static const uint64_t MaxParforChunks = 256;
+
+/// getParforPool - The pool that runs parfor loops, shared by all sessions.
+static KaleidoscopeThreadPool &getParforPool() {
+  static KaleidoscopeThreadPool Pool(
+      ParforThreads ? ParforThreads
+                    : std::max(1u, std::thread::hardware_concurrency()));
+  return Pool;
+}
+
+/// kaleidoscope_parfor - Run Body, a parfor body outlined by the compiler, over
+/// [Begin, End) in chunks on the thread pool, and combine the reductions of the
+/// chunks (a ReduceKind) in order.
+extern "C" double kaleidoscope_parfor(double (*Body)(void *, int64_t, int64_t),
+                                      void *Env, int64_t Begin, int64_t End,
+                                      int32_t Kind) {
+  ReduceKind K = static_cast<ReduceKind>(Kind);
+  if (Begin >= End)
+    return getReduceIdentity(K);
+
+  uint64_t N = (uint64_t)End - (uint64_t)Begin;
+  uint64_t NumChunks = std::min(N, MaxParforChunks);
+  uint64_t ChunkSize = N / NumChunks + (N % NumChunks != 0);
+  NumChunks = N / ChunkSize + (N % ChunkSize != 0);
+
+  // Chunks print where the loop itself would.
+  ExprOutput *Output = CurOutput;
+  std::vector<double> Partials(NumChunks);
+  getParforPool().parallelFor(NumChunks, [&](size_t C) {
+    int64_t First = (int64_t)((uint64_t)Begin + C * ChunkSize);
+    int64_t Last = C + 1 == NumChunks ? End : First + (int64_t)ChunkSize;
+    ExprOutput *Saved = CurOutput;
+    CurOutput = Output;
+    Partials[C] = Body(Env, First, Last);
+    CurOutput = Saved;
+  });
+
+  double Acc = getReduceIdentity(K);
+  for (double P : Partials)
+    Acc = combineReduced(K, Acc, P);
+  return Acc;
+}
+
 //===----------------------------------------------------------------------===//
 // Main driver code.
 //===----------------------------------------------------------------------===//
 
-int main() {
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
+
   InitializeNativeTarget();
   InitializeNativeTargetAsmPrinter();
   InitializeNativeTargetAsmParser();
 
-  // Install standard binary operators.
-  // 1 is lowest precedence.
-  BinopPrecedence['='] = 2;
-  BinopPrecedence['<'] = 10;
-  BinopPrecedence['+'] = 20;
-  BinopPrecedence['-'] = 20;
-  BinopPrecedence['*'] = 40; // highest.
+  // Bind host arrays and load libmvec first: workers inherit them when they
+  // fork.
+  if (!bindCommandLineArrays())
+    return 1;
+  initVectorMath();
 
-  // Prime the first token.
-  fprintf(stderr, "ready> ");
-  getNextToken();
+  if (PGO && Float32) {
+    fprintf(stderr, "Error: -pgo profiles doubles; it cannot be combined "
+                    "with -float32\n");
+    return 1;
+  }
 
-  TheJIT = llvm::make_unique<KaleidoscopeJIT>();
+  if (PGO && NumWorkers) {
+    fprintf(stderr, "Error: -pgo profiles in this process; it cannot be "
+                    "combined with -workers\n");
+    return 1;
+  }
 
-  InitializeModuleAndPassManager();
+  if (PGO && AsyncExprs) {
+    fprintf(stderr, "Error: -pgo frees evicted code between expressions; it "
+                    "cannot be combined with -async-exprs\n");
+    return 1;
+  }
 
-  // Run the main "interpreter loop" now.
-  MainLoop();
+  if (AsyncExprs && NumWorkers) {
+    fprintf(stderr, "Error: -workers already runs expressions in parallel; "
+                    "it cannot be combined with -async-exprs\n");
+    return 1;
+  }
 
-  return 0;
+  if (Stream && (NumWorkers || AsyncExprs || PGO)) {
+    fprintf(stderr, "Error: -stream runs expressions on a stage of its own; "
+                    "it cannot be combined with -workers, -async-exprs or "
+                    "-pgo\n");
+    return 1;
+  }
+
+  if ((!SaveSession.empty() || !LoadSession.empty()) && (NumWorkers || PGO)) {
+    fprintf(stderr, "Error: -save-session and -load-session keep the code in "
+                    "this process; they cannot be combined with -workers or "
+                    "-pgo\n");
+    return 1;
+  }
+
+  if (BenchSessions) {
+    benchmarkSessions(BenchSessions);
+    return 0;
+  }
+
+  if (BenchScopes) {
+    benchmarkScopes(BenchScopes);
+    return 0;
+  }
+
+  // The main thread is a session of its own, reading standard input.
+  InitializeSession();
+  if (PGO)
+    startProfiling();
+
+  // Fork the workers before reading any input so they start out small.
+  if (NumWorkers)
+    Workers = llvm::make_unique<KaleidoscopeWorkerPool>(
+        NumWorkers, WorkerTimeout, reportWorkerResult);
+
+  // Results come out behind the input under -async-exprs and -stream, so
+  // prompts and IR dumps would only get in the way.
+  if (AsyncExprs || Stream)
+    Interactive = false;
+
+  if (!LoadSession.empty()) {
+    auto Start = std::chrono::steady_clock::now();
+    unsigned NumObjects, NumPrototypes;
+    if (!loadSession(LoadSession, NumObjects, NumPrototypes)) {
+      FinalizeSession();
+      return 1;
+    }
+    if (Interactive)
+      fprintf(stderr,
+              "Restored %u objects and %u prototypes from %s in %.2f ms\n",
+              NumObjects, NumPrototypes, LoadSession.c_str(),
+              std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - Start)
+                  .count());
+  }
+
+  if (Stream) {
+    runStream();
+  } else {
+    // Prime the first token.
+    if (Interactive)
+      fprintf(stderr, "ready> ");
+    getNextToken();
+
+    // Run the main "interpreter loop" now.
+    MainLoop();
+  }
+
+  // Wait for (and report) anything still running in the workers.
+  Workers.reset();
+  if (PGO)
+    finishProfiling();
+  // In worker mode the caches, and their counters, live in the workers.
+  if (MemoStats && !NumWorkers)
+    reportMemoStats();
+  if (DeclStats)
+    FunctionProtos.printStats();
+  if (SimplifyStats)
+    reportSimplifyStats();
+  if (DedupStats)
+    reportDedupStats();
+  bool Saved = SaveSession.empty() || saveSession(SaveSession);
+
+  FinalizeSession();
+  return Saved ? 0 : 1;
 }
\ No newline at end of file